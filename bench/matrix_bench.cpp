@@ -0,0 +1,130 @@
+// Micro-benchmark of the closed-form matrix kernels of geometry.h against the recursive cofactor
+// expansion and the indexed loops they replaced, which are kept here as the reference. Prints the
+// time per call of both and the largest relative difference of their results.
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+#include "geometry.h"
+
+// The former kernels: determinants and inverses by recursive cofactor expansion over submatrices
+namespace reference {
+template<int n> double det(const mat<n,n>& m);
+
+template<int n> double cofactor(const mat<n,n>& m, const int row, const int col) {
+    mat<n-1,n-1> submatrix;
+    for (int i=n-1; i--; )
+        for (int j=n-1; j--; submatrix[i][j]=m[i+int(i>=row)][j+int(j>=col)]);
+    return det(submatrix) * ((row+col)%2 ? -1 : 1);
+}
+
+template<int n> double det(const mat<n,n>& m) {
+    if constexpr (n == 1) return m[0][0];
+    else {
+        double ret = 0;
+        for (int i=n; i--; ret += m[0][i] * cofactor(m, 0, i));
+        return ret;
+    }
+}
+
+template<int n> mat<n,n> invert_transpose(const mat<n,n>& m) {
+    mat<n,n> adjugate_transpose;
+    for (int i=n; i--; )
+        for (int j=n; j--; adjugate_transpose[i][j]=cofactor(m, i, j));
+    return adjugate_transpose/(adjugate_transpose[0]*m[0]);
+}
+
+template<int n> mat<n,n> invert(const mat<n,n>& m) {
+    return invert_transpose(m).transpose();
+}
+
+// The generic templates of geometry.h, which loop over operator[]
+template<int n> vec<n> product(const mat<n,n>& m, const vec<n>& v) { return ::operator*<n,n>(m, v); }
+template<int n> mat<n,n> product(const mat<n,n>& a, const mat<n,n>& b) { return ::operator*<n,n,n>(a, b); }
+}
+
+template<int n> static double difference(const vec<n>& a, const vec<n>& b) {
+    double d = 0;
+    for (int i=0; i<n; i++) d = std::max(d, std::abs(a[i] - b[i]) / std::max(1., std::abs(b[i])));
+    return d;
+}
+
+template<int n> static double difference(const mat<n,n>& a, const mat<n,n>& b) {
+    double d = 0;
+    for (int i=0; i<n; i++) d = std::max(d, difference(a[i], b[i]));
+    return d;
+}
+
+static double difference(const double a, const double b) {
+    return std::abs(a - b) / std::max(1., std::abs(b));
+}
+
+// Folds a whole result into the sink of the timing loop, so that none of it is optimized away
+static double sum(const double x) { return x; }
+template<int n> static double sum(const vec<n>& v) {
+    double s = 0;
+    for (int i=0; i<n; i++) s += v[i];
+    return s;
+}
+template<int n> static double sum(const mat<n,n>& m) {
+    double s = 0;
+    for (int i=0; i<n; i++) s += sum(m[i]);
+    return s;
+}
+
+// Nanoseconds per call of f(i) over the inputs, the results are summed so that no call is dropped
+template<class F> static double time_ns(const int calls, const F& f) {
+    double sink = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i=0; i<calls; i++) sink += f(i);
+    const double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / calls;
+    volatile double keep = sink;
+    (void)keep;
+    return ns;
+}
+
+template<class Reference, class ClosedForm>
+static void compare(const char* name, const int n, const Reference& reference, const ClosedForm& closed_form) {
+    double d = 0;
+    for (int i=0; i<n; i++) d = std::max(d, difference(closed_form(i), reference(i)));
+    constexpr int calls = 4000000;
+    const double before = time_ns(calls, [&](const int i) { return sum(reference(i)); });
+    const double after  = time_ns(calls, [&](const int i) { return sum(closed_form(i)); });
+    std::printf("| %-28s | %9.1f ns | %9.1f ns | %6.1fx | %8.1e |\n", name, before, after, before / after, d);
+}
+
+// Compile-time evaluation
+constexpr mat<4,4> translation = {{{1,0,0,2}, {0,2,0,3}, {0,0,1,4}, {0,0,0,1}}};
+static_assert(translation.det() == 2);
+static_assert((translation.invert() * translation)[1][1] == 1 && (translation.invert() * translation)[0][3] == 0);
+static_assert(mat<3,3>{{{2,0,0}, {0,4,0}, {1,0,1}}}.invert_transpose()[0][0] == .5);
+
+int main() {
+    constexpr int n = 4096; // inputs, cycled through
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> uniform(-2, 2);
+    std::vector<mat<3,3>> m3(n);
+    std::vector<mat<4,4>> m4(n);
+    std::vector<vec3> v3(n);
+    std::vector<vec4> v4(n);
+    for (int k=0; k<n; k++) {
+        for (int i=0; i<3; i++) for (int j=0; j<3; j++) m3[k][i][j] = uniform(rng);
+        for (int i=0; i<4; i++) for (int j=0; j<4; j++) m4[k][i][j] = uniform(rng);
+        for (int i=0; i<3; i++) v3[k][i] = uniform(rng);
+        for (int i=0; i<4; i++) v4[k][i] = uniform(rng);
+    }
+    auto at = [](const int i) { return i & (n-1); };
+
+    std::printf("| Operation                    | Recursive    | Closed form  | Speedup | Max diff |\n");
+    std::printf("|------------------------------|--------------|--------------|---------|----------|\n");
+    compare("3x3 determinant", n, [&](int i) { return reference::det(m3[at(i)]); }, [&](int i) { return m3[at(i)].det(); });
+    compare("3x3 inverse transpose", n, [&](int i) { return reference::invert_transpose(m3[at(i)]); }, [&](int i) { return m3[at(i)].invert_transpose(); });
+    compare("4x4 determinant", n, [&](int i) { return reference::det(m4[at(i)]); }, [&](int i) { return m4[at(i)].det(); });
+    compare("4x4 inverse", n, [&](int i) { return reference::invert(m4[at(i)]); }, [&](int i) { return m4[at(i)].invert(); });
+    compare("3x3 * vec3", n, [&](int i) { return reference::product(m3[at(i)], v3[at(i+1)]); }, [&](int i) { return m3[at(i)] * v3[at(i+1)]; });
+    compare("4x4 * vec4", n, [&](int i) { return reference::product(m4[at(i)], v4[at(i+1)]); }, [&](int i) { return m4[at(i)] * v4[at(i+1)]; });
+    compare("4x4 * 4x4", n, [&](int i) { return reference::product(m4[at(i)], m4[at(i+7)]); }, [&](int i) { return m4[at(i)] * m4[at(i+7)]; });
+    return 0;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "arena.h"
+#include "geometry.h"
+
+class Model;
+
+// Skeletal animation of a mesh, read from a little-endian binary .anim file:
+//   char[4]  "SWAN"
+//   uint32   version (1), nverts, njoints, nframes
+//   float    frames per second
+//   nverts  x { uint8 joint[4]; float weight[4]; }   influences of the .obj vertices, in file order
+//   nframes x njoints x float[12]                     skinning matrices (joint pose times inverse bind
+//                                                     pose), 3x4 row-major
+// Unused influences have a zero weight; the weights of a vertex are renormalized on load.
+class Animation {
+public:
+    bool load(const std::string& filename); // false, with a message, on a malformed file
+    int nverts()  const { return influences.size(); }
+    int njoints() const { return joints; }
+    int nframes() const { return frames; }
+    double fps()  const { return rate; }
+
+    // Skinning matrices at time seconds, looping, interpolated between the two nearest frames.
+    // 16 floats per joint: the 4 columns of the 3x4 matrix, padded for aligned SIMD loads
+    void palette(const double time, FrameVector<float>& out) const;
+    // Positions of the model's vertices (bind pose) deformed by the palette, in parallel over the
+    // scheduler, each vertex blending its joints' matrices with 4-wide SIMD
+    void skin(const Model& model, const FrameVector<float>& palette, FrameVector<vec3>& out) const;
+
+private:
+    struct Influence {
+        float weight[4];
+        std::uint8_t joint[4];
+    };
+    std::vector<Influence> influences;
+    std::vector<float> matrices; // nframes*njoints matrices, as in the palette
+    int joints = 0, frames = 0;
+    double rate = 30;
+};
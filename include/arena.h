@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Linear allocator for the transient data of a frame: allocations bump an offset into one block
+// and are never freed individually, the whole arena is rewound at the end of the frame. When a
+// frame needs more than the block, the extra goes to overflow blocks and the next reset replaces
+// everything with one block large enough, so after the first frames there are no heap calls.
+class Arena {
+public:
+    void* allocate(const std::size_t bytes, const std::size_t align = alignof(std::max_align_t));
+    void reset();
+    std::size_t used() const { return offset + overflow_bytes; }
+    std::size_t capacity() const { return size; }
+
+private:
+    std::unique_ptr<char[]> block;
+    std::size_t size = 0, offset = 0;
+    std::vector<std::unique_ptr<char[]>> overflow; // blocks added since the last reset
+    std::size_t overflow_bytes = 0;
+};
+
+// Arena of the calling thread. Every thread rendering a frame (the main thread and the scheduler
+// workers) has its own, so allocating needs no lock.
+Arena& frame_arena();
+
+// Puts the calling thread's arena on the list that every frame_arena_reset() rewinds. The
+// scheduler's workers share theirs, they allocate for the frames of whichever thread runs loops.
+void frame_arena_share();
+
+// Rewinds the arenas of the calling thread and of the shared threads, called between frames
+// while no frame work is running; other threads (renderers of sw_renderer.h) keep theirs.
+// Returns the number of bytes the frame used.
+std::size_t frame_arena_reset();
+
+// Standard allocator drawing from the arena of the thread that created it, deallocation is a
+// no-op. A FrameVector must not outlive the frame, and must only grow on the thread that made it.
+template<class T> struct FrameAllocator {
+    using value_type = T;
+    Arena* arena;
+    FrameAllocator() : arena(&frame_arena()) {}
+    template<class U> FrameAllocator(const FrameAllocator<U>& other) : arena(other.arena) {}
+    T* allocate(const std::size_t n) { return static_cast<T*>(arena->allocate(n*sizeof(T), alignof(T))); }
+    void deallocate(T*, std::size_t) {}
+    template<class U> bool operator==(const FrameAllocator<U>& other) const { return arena == other.arena; }
+    template<class U> bool operator!=(const FrameAllocator<U>& other) const { return arena != other.arena; }
+};
+
+template<class T> using FrameVector = std::vector<T, FrameAllocator<T>>;
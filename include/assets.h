@@ -0,0 +1,36 @@
+#pragma once
+
+#include <chrono>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include "animation.h"
+#include "model.h"
+#include "texture.h"
+
+// Loads meshes and textures as background jobs of the scheduler. Every request returns a future
+// immediately; requests for a path already requested with the same options share the first one's
+// future. Failed loads yield a null pointer.
+class AssetLoader {
+public:
+    using MeshFuture = std::shared_future<std::shared_ptr<const Model>>;
+    using TextureFuture = std::shared_future<std::shared_ptr<const Texture>>;
+    using AnimationFuture = std::shared_future<std::shared_ptr<const Animation>>;
+
+    MeshFuture load_mesh(const std::string& filename, const int lod_levels, const bool quantize = false); // parses the OBJ and builds its LOD chain
+    TextureFuture load_texture(const std::string& filename, const TextureCompression compression = TEXTURE_UNCOMPRESSED);
+    AnimationFuture load_animation(const std::string& filename);
+
+private:
+    std::mutex mutex;
+    std::map<std::tuple<std::string, int, bool>, MeshFuture> meshes; // requests seen so far, by path, LOD levels and quantization
+    std::map<std::pair<std::string, TextureCompression>, TextureFuture> textures;
+    std::map<std::string, AnimationFuture> animations;
+};
+
+template<class T> bool is_ready(const std::shared_future<T>& future) {
+    return future.valid() && future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
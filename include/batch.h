@@ -0,0 +1,25 @@
+#pragma once
+
+#include <limits>
+#include <vector>
+#include "tgaimage.h"
+#include "scheduler.h"
+
+// Renders nviews independent views of a scene at once. Each view is a scheduler task with its own
+// framebuffer and z-buffer, and the draws inside a view still spread their tiles over idle
+// threads, so the cores stay busy whether there are few large views or many small ones. Meshes,
+// textures and lights are shared read-only between the views.
+//   draw_view(i, framebuffer, zbuffer)  renders view i into cleared buffers
+//   done(i, framebuffer)                receives the finished image, on the thread that rendered it
+template<class Draw, class Done>
+void render_batch(const int nviews, const int width, const int height, const TGAColor& background, const Draw& draw_view, const Done& done) {
+    scheduler.parallel_for(0, nviews, 1, [&](const int first, const int last) {
+        for (int i=first; i<last; i++) {
+            TGAImage framebuffer(width, height, TGAImage::RGB);
+            std::vector<double> zbuffer(width*height, -std::numeric_limits<double>::max());
+            for (int y=0; y<height; y++) for (int x=0; x<width; x++) framebuffer.set(x, y, background);
+            draw_view(i, framebuffer, zbuffer);
+            done(i, framebuffer);
+        }
+    });
+}
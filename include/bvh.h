@@ -0,0 +1,49 @@
+#pragma once
+
+#include <limits>
+#include <vector>
+#include "geometry.h"
+
+class Model;
+struct RenderContext;
+
+// Closest intersection of a ray with the triangles of a set of models
+struct RayHit {
+    int model = -1;                                // index in the model list, -1 = nothing hit
+    int face = -1;                                 // triangle of the full detail mesh
+    double t = std::numeric_limits<double>::max(); // hit point = origin + t*dir
+    vec3 bary = {};                                // barycentric coordinates of the hit point in the triangle
+    vec2 uv = {};                                  // texture coordinates at the hit point
+};
+
+// Bounding volume hierarchy over the triangles of a model, for ray queries. Built top-down with
+// the surface area heuristic evaluated on 16 bins per axis; the two halves of large nodes are
+// built in parallel on the scheduler. Nodes are 32 bytes with float bounds rounded outwards,
+// children always come after their parent, and the leaves hold at most 8 triangles.
+// The positions default to the model's own, animated models pass their posed vertices.
+class BVH {
+public:
+    void build(const Model& model, const vec3* positions = nullptr);
+    void refit(const Model& model, const vec3* positions = nullptr); // new bounds for moved vertices, same tree
+    // Closest triangle hit by origin + t*dir with 0 < t < hit.t; fills face, t, bary and uv of hit
+    bool intersect(const Model& model, const vec3& origin, const vec3& dir, RayHit& hit, const vec3* positions = nullptr) const;
+    bool empty() const { return nodes.empty(); }
+    int nnodes() const { return nodes.size(); }
+    size_t size_bytes() const { return nodes.size()*sizeof(Node) + faces.size()*sizeof(int); }
+
+private:
+    struct Node {
+        float lo[3], hi[3];
+        int first; // leaf: faces[first, first+count), inner node: children first and first+1
+        int count; // 0 for inner nodes
+    };
+    std::vector<Node> nodes;
+    std::vector<int> faces; // triangle indices, in leaf order
+};
+
+// Closest triangle of the models hit by the ray origin + t*dir (t > 0), in the object space of
+// the models. Animated models are posed at ctx.time, their tree refitted for the query.
+bool raycast(const RenderContext& ctx, const std::vector<Model>& models, const vec3& origin, const vec3& dir, RayHit& hit);
+// What is drawn at the pixel x,y (framebuffer coordinates, y up) of a render of the models with
+// ctx and the model matrix
+bool pick(const RenderContext& ctx, const std::vector<Model>& models, const mat<4,4>& Model, const double x, const double y, RayHit& hit);
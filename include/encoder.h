@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "tgaimage.h"
+
+enum ImageFormat {
+    IMAGE_TGA,  // run-length encoded TGA
+    IMAGE_QOI,  // "Quite OK Image" format, lossless and several times faster to encode than PNG
+    IMAGE_PNG   // deflate with the in-tree compressor
+};
+
+bool parse_image_format(const std::string& name, ImageFormat& format); // "tga", "qoi" or "png"
+const char* image_format_extension(const ImageFormat format);
+
+// Encodes a whole file into bytes (appended). As for write_tga_file, vflip means the rows of img
+// are stored bottom to top. PNG compresses bands of rows in parallel on the scheduler.
+void encode_image(const TGAImage& img, const ImageFormat format, std::vector<std::uint8_t>& bytes, const bool vflip = true);
+void encode_qoi(const TGAImage& img, std::vector<std::uint8_t>& bytes, const bool vflip = true);
+void encode_png(const TGAImage& img, std::vector<std::uint8_t>& bytes, const bool vflip = true);
+bool write_image(const TGAImage& img, const std::string& filename, const ImageFormat format, const bool vflip = true);
+
+// Output stage: images handed to write() are encoded and saved by background jobs of the scheduler
+// while the caller goes on rendering. With max_pending writes in flight, write() encodes on the
+// calling thread instead, which bounds the memory held by queued images. Safe to call from
+// several threads.
+class ImageWriter {
+public:
+    explicit ImageWriter(const ImageFormat format, const int max_pending = 8) : format(format), max_pending(max_pending) {}
+    ~ImageWriter() { finish(); }
+    void write(TGAImage&& image, const std::string& filename);
+    bool finish(); // waits for every pending write, false if any of them failed
+
+private:
+    const ImageFormat format;
+    const int max_pending;
+    std::mutex mutex;
+    std::vector<std::shared_future<bool>> pending;
+    bool failed = false;
+};
@@ -1,43 +1,45 @@
 #pragma once
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
 #include <cassert>
 #include <iostream>
 
 template<int n> struct vec {
     double data[n] = {0};
-    double& operator[](const int i)       { assert(i>=0 && i<n); return data[i]; }
-    double  operator[](const int i) const { assert(i>=0 && i<n); return data[i]; }
+    constexpr double& operator[](const int i)       { assert(i>=0 && i<n); return data[i]; }
+    constexpr double  operator[](const int i) const { assert(i>=0 && i<n); return data[i]; }
 };
 
-template<int n> double operator*(const vec<n>& lhs, const vec<n>& rhs) {
+template<int n> constexpr double operator*(const vec<n>& lhs, const vec<n>& rhs) {
     double ret = 0;                         // N.B. Do not ever, ever use such for loops! They are highly confusing.
     for (int i=n; i--; ret+=lhs[i]*rhs[i]); // Here I used them as a tribute to old-school game programmers fighting for every CPU cycle.
     return ret;                             // Once upon a time reverse loops were faster than the normal ones, it is not the case anymore.
 }
 
-template<int n> vec<n> operator+(const vec<n>& lhs, const vec<n>& rhs) {
+template<int n> constexpr vec<n> operator+(const vec<n>& lhs, const vec<n>& rhs) {
     vec<n> ret = lhs;
     for (int i=n; i--; ret[i]+=rhs[i]);
     return ret;
 }
 
-template<int n> vec<n> operator-(const vec<n>& lhs, const vec<n>& rhs) {
+template<int n> constexpr vec<n> operator-(const vec<n>& lhs, const vec<n>& rhs) {
     vec<n> ret = lhs;
     for (int i=n; i--; ret[i]-=rhs[i]);
     return ret;
 }
 
-template<int n> vec<n> operator*(const vec<n>& lhs, const double& rhs) {
+template<int n> constexpr vec<n> operator*(const vec<n>& lhs, const double& rhs) {
     vec<n> ret = lhs;
     for (int i=n; i--; ret[i]*=rhs);
     return ret;
 }
 
-template<int n> vec<n> operator*(const double& lhs, const vec<n> &rhs) {
+template<int n> constexpr vec<n> operator*(const double& lhs, const vec<n> &rhs) {
     return rhs * lhs;
 }
 
-template<int n> vec<n> operator/(const vec<n>& lhs, const double& rhs) {
+template<int n> constexpr vec<n> operator/(const vec<n>& lhs, const double& rhs) {
     vec<n> ret = lhs;
     for (int i=n; i--; ret[i]/=rhs);
     return ret;
@@ -50,22 +52,22 @@ template<int n> std::ostream& operator<<(std::ostream& out, const vec<n>& v) {
 
 template<> struct vec<2> {
     double x = 0, y = 0;
-    double& operator[](const int i)       { assert(i>=0 && i<2); return i ? y : x; }
-    double  operator[](const int i) const { assert(i>=0 && i<2); return i ? y : x; }
+    constexpr double& operator[](const int i)       { assert(i>=0 && i<2); return i ? y : x; }
+    constexpr double  operator[](const int i) const { assert(i>=0 && i<2); return i ? y : x; }
 };
 
 template<> struct vec<3> {
     double x = 0, y = 0, z = 0;
-    double& operator[](const int i)       { assert(i>=0 && i<3); return i ? (1==i ? y : z) : x; }
-    double  operator[](const int i) const { assert(i>=0 && i<3); return i ? (1==i ? y : z) : x; }
+    constexpr double& operator[](const int i)       { assert(i>=0 && i<3); return i ? (1==i ? y : z) : x; }
+    constexpr double  operator[](const int i) const { assert(i>=0 && i<3); return i ? (1==i ? y : z) : x; }
 };
 
 template<> struct vec<4> {
     double x = 0, y = 0, z = 0, w = 0;
-    double& operator[](const int i)       { assert(i>=0 && i<4); return i<2 ? (i ? y : x) : (2==i ? z : w); }
-    double  operator[](const int i) const { assert(i>=0 && i<4); return i<2 ? (i ? y : x) : (2==i ? z : w); }
-    vec<2> xy()  const { return {x, y};    }
-    vec<3> xyz() const { return {x, y, z}; }
+    constexpr double& operator[](const int i)       { assert(i>=0 && i<4); return i<2 ? (i ? y : x) : (2==i ? z : w); }
+    constexpr double  operator[](const int i) const { assert(i>=0 && i<4); return i<2 ? (i ? y : x) : (2==i ? z : w); }
+    constexpr vec<2> xy()  const { return {x, y};    }
+    constexpr vec<3> xyz() const { return {x, y, z}; }
 };
 
 typedef vec<2> vec2;
@@ -80,45 +82,65 @@ template<int n> vec<n> normalized(const vec<n>& v) {
     return v / norm(v);
 }
 
-template<int n> double dot(const vec<n>& v1, const vec<n>& v2) {
+template<int n> constexpr double dot(const vec<n>& v1, const vec<n>& v2) {
     return v1 * v2;
 }
 
-inline vec3 cross(const vec3 &v1, const vec3 &v2) {
+constexpr vec3 cross(const vec3 &v1, const vec3 &v2) {
     return {v1.y*v2.z - v1.z*v2.y, v1.z*v2.x - v1.x*v2.z, v1.x*v2.y - v1.y*v2.x};
 }
 
+// Unit vector packed as two 16-bit coordinates of its octahedral projection (the lower half
+// folded over the upper one), precise to a few thousandths of a degree
+inline std::uint32_t octahedral_encode(const vec3& n) {
+    const double l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    double x = n.x / l1, y = n.y / l1;
+    if (n.z < 0) {
+        const double fx = (1 - std::abs(y)) * (x >= 0 ? 1 : -1);
+        y = (1 - std::abs(x)) * (y >= 0 ? 1 : -1);
+        x = fx;
+    }
+    const std::uint32_t qx = std::lround((x*.5 + .5) * 65535), qy = std::lround((y*.5 + .5) * 65535);
+    return qx | qy << 16;
+}
+
+inline vec3 octahedral_decode(const std::uint32_t packed) {
+    vec3 n = {(packed & 0xffff) / 65535. * 2 - 1, (packed >> 16) / 65535. * 2 - 1, 0};
+    n.z = 1 - std::abs(n.x) - std::abs(n.y);
+    const double t = std::max(-n.z, 0.);
+    n.x += n.x >= 0 ? -t : t;
+    n.y += n.y >= 0 ? -t : t;
+    return normalized(n);
+}
+
 template<int n> struct dt;
 
 template<int nrows,int ncols> struct mat {
     vec<ncols> rows[nrows] = {{}};
 
-          vec<ncols>& operator[] (const int idx)       { assert(idx>=0 && idx<nrows); return rows[idx]; }
-    const vec<ncols>& operator[] (const int idx) const { assert(idx>=0 && idx<nrows); return rows[idx]; }
+    constexpr       vec<ncols>& operator[] (const int idx)       { assert(idx>=0 && idx<nrows); return rows[idx]; }
+    constexpr const vec<ncols>& operator[] (const int idx) const { assert(idx>=0 && idx<nrows); return rows[idx]; }
 
-    double det() const {
+    constexpr double det() const {
         return dt<ncols>::det(*this);
     }
 
-    double cofactor(const int row, const int col) const {
+    constexpr double cofactor(const int row, const int col) const { // of any size, the inverses of 2x2 to 4x4 do not use it
         mat<nrows-1,ncols-1> submatrix;
         for (int i=nrows-1; i--; )
             for (int j=ncols-1;j--; submatrix[i][j]=rows[i+int(i>=row)][j+int(j>=col)]);
         return submatrix.det() * ((row+col)%2 ? -1 : 1);
     }
 
-    mat<nrows,ncols> invert_transpose() const {
-        mat<nrows,ncols> adjugate_transpose; // transpose to ease determinant computation, check the last line
-        for (int i=nrows; i--; )
-            for (int j=ncols; j--; adjugate_transpose[i][j]=cofactor(i,j));
-        return adjugate_transpose/(adjugate_transpose[0]*rows[0]);
+    constexpr mat<nrows,ncols> invert_transpose() const {
+        return dt<ncols>::invert_transpose(*this);
     }
 
-    mat<nrows,ncols> invert() const {
+    constexpr mat<nrows,ncols> invert() const {
         return invert_transpose().transpose();
     }
 
-    mat<ncols,nrows> transpose() const {
+    constexpr mat<ncols,nrows> transpose() const {
         mat<ncols,nrows> ret;
         for (int i=ncols; i--; )
             for (int j=nrows; j--; ret[i][j]=rows[j][i]);
@@ -126,17 +148,17 @@ template<int nrows,int ncols> struct mat {
     }
 };
 
-template<int nrows,int ncols> vec<ncols> operator*(const vec<nrows>& lhs, const mat<nrows,ncols>& rhs) {
+template<int nrows,int ncols> constexpr vec<ncols> operator*(const vec<nrows>& lhs, const mat<nrows,ncols>& rhs) {
     return (mat<1,nrows>{{lhs}}*rhs)[0];
 }
 
-template<int nrows,int ncols> vec<nrows> operator*(const mat<nrows,ncols>& lhs, const vec<ncols>& rhs) {
+template<int nrows,int ncols> constexpr vec<nrows> operator*(const mat<nrows,ncols>& lhs, const vec<ncols>& rhs) {
     vec<nrows> ret;
     for (int i=nrows; i--; ret[i]=lhs[i]*rhs);
     return ret;
 }
 
-template<int R1,int C1,int C2>mat<R1,C2> operator*(const mat<R1,C1>& lhs, const mat<C1,C2>& rhs) {
+template<int R1,int C1,int C2> constexpr mat<R1,C2> operator*(const mat<R1,C1>& lhs, const mat<C1,C2>& rhs) {
     mat<R1,C2> result;
     for (int i=R1; i--; )
         for (int j=C2; j--; )
@@ -144,26 +166,60 @@ template<int R1,int C1,int C2>mat<R1,C2> operator*(const mat<R1,C1>& lhs, const
     return result;
 }
 
-template<int nrows,int ncols>mat<nrows,ncols> operator*(const mat<nrows,ncols>& lhs, const double& val) {
+// Unrolled products of the 3 and 4 dimensional transforms, which the per-vertex and per-triangle
+// work uses: the fields are named instead of indexed through the branches of operator[]. The
+// terms are summed last to first like the generic loops (and the dot product), which the micro
+// triangle rasterizer reproduces operation for operation.
+constexpr vec3 operator*(const mat<3,3>& m, const vec3& v) {
+    return {m[0].z*v.z + m[0].y*v.y + m[0].x*v.x,
+            m[1].z*v.z + m[1].y*v.y + m[1].x*v.x,
+            m[2].z*v.z + m[2].y*v.y + m[2].x*v.x};
+}
+
+constexpr vec4 operator*(const mat<4,4>& m, const vec4& v) {
+    return {m[0].w*v.w + m[0].z*v.z + m[0].y*v.y + m[0].x*v.x,
+            m[1].w*v.w + m[1].z*v.z + m[1].y*v.y + m[1].x*v.x,
+            m[2].w*v.w + m[2].z*v.z + m[2].y*v.y + m[2].x*v.x,
+            m[3].w*v.w + m[3].z*v.z + m[3].y*v.y + m[3].x*v.x};
+}
+
+constexpr vec4 operator*(const vec4& r, const mat<4,4>& m) {
+    return {r.w*m[3].x + r.z*m[2].x + r.y*m[1].x + r.x*m[0].x,
+            r.w*m[3].y + r.z*m[2].y + r.y*m[1].y + r.x*m[0].y,
+            r.w*m[3].z + r.z*m[2].z + r.y*m[1].z + r.x*m[0].z,
+            r.w*m[3].w + r.z*m[2].w + r.y*m[1].w + r.x*m[0].w};
+}
+
+constexpr mat<4,4> operator*(const mat<4,4>& lhs, const mat<4,4>& rhs) {
+    return {{lhs[0]*rhs, lhs[1]*rhs, lhs[2]*rhs, lhs[3]*rhs}};
+}
+
+// lhs * rhs for an affine lhs (last row 0 0 0 1) such as a viewport or a camera: the last row
+// of the product is that of rhs
+constexpr mat<4,4> affine_product(const mat<4,4>& lhs, const mat<4,4>& rhs) {
+    return {{lhs[0]*rhs, lhs[1]*rhs, lhs[2]*rhs, rhs[3]}};
+}
+
+template<int nrows,int ncols> constexpr mat<nrows,ncols> operator*(const mat<nrows,ncols>& lhs, const double& val) {
     mat<nrows,ncols> result;
     for (int i=nrows; i--; result[i] = lhs[i]*val);
     return result;
 }
 
-template<int nrows,int ncols>mat<nrows,ncols> operator/(const mat<nrows,ncols>& lhs, const double& val) {
+template<int nrows,int ncols> constexpr mat<nrows,ncols> operator/(const mat<nrows,ncols>& lhs, const double& val) {
     mat<nrows,ncols> result;
     for (int i=nrows; i--; result[i] = lhs[i]/val);
     return result;
 }
 
-template<int nrows,int ncols>mat<nrows,ncols> operator+(const mat<nrows,ncols>& lhs, const mat<nrows,ncols>& rhs) {
+template<int nrows,int ncols> constexpr mat<nrows,ncols> operator+(const mat<nrows,ncols>& lhs, const mat<nrows,ncols>& rhs) {
     mat<nrows,ncols> result;
     for (int i=nrows; i--; )
         for (int j=ncols; j--; result[i][j]=lhs[i][j]+rhs[i][j]);
     return result;
 }
 
-template<int nrows,int ncols>mat<nrows,ncols> operator-(const mat<nrows,ncols>& lhs, const mat<nrows,ncols>& rhs) {
+template<int nrows,int ncols> constexpr mat<nrows,ncols> operator-(const mat<nrows,ncols>& lhs, const mat<nrows,ncols>& rhs) {
     mat<nrows,ncols> result;
     for (int i=nrows; i--; )
         for (int j=ncols; j--; result[i][j]=lhs[i][j]-rhs[i][j]);
@@ -175,16 +231,79 @@ template<int nrows,int ncols> std::ostream& operator<<(std::ostream& out, const
     return out;
 }
 
-template<int n> struct dt { // template metaprogramming to compute the determinant recursively
-    static double det(const mat<n,n>& src) {
+template<int n> struct dt { // template metaprogramming to compute the determinant recursively, for sizes without a closed form
+    static constexpr double det(const mat<n,n>& src) {
         double ret = 0;
         for (int i=n; i--; ret += src[0][i] * src.cofactor(0,i));
         return ret;
     }
+
+    static constexpr mat<n,n> invert_transpose(const mat<n,n>& src) {
+        mat<n,n> adjugate_transpose; // transpose to ease determinant computation, check the last line
+        for (int i=n; i--; )
+            for (int j=n; j--; adjugate_transpose[i][j]=src.cofactor(i,j));
+        return adjugate_transpose/(adjugate_transpose[0]*src[0]);
+    }
 };
 
 template<> struct dt<1> {   // template specialization to stop the recursion
-    static double det(const mat<1,1>& src) {
+    static constexpr double det(const mat<1,1>& src) {
         return src[0][0];
     }
 };
+
+// Closed forms of the small sizes: the cofactors are spelled out, the 4x4 ones from the 2x2
+// determinants of the top two and the bottom two rows, each computed once
+template<> struct dt<2> {
+    static constexpr double det(const mat<2,2>& m) {
+        return m[0].x*m[1].y - m[0].y*m[1].x;
+    }
+
+    static constexpr mat<2,2> invert_transpose(const mat<2,2>& m) {
+        const double inv = 1 / det(m);
+        return {{{m[1].y*inv, -m[1].x*inv}, {-m[0].y*inv, m[0].x*inv}}};
+    }
+};
+
+template<> struct dt<3> {
+    static constexpr mat<3,3> cofactors(const mat<3,3>& m) {
+        const vec3 &a = m[0], &b = m[1], &c = m[2];
+        return {{cross(b, c), cross(c, a), cross(a, b)}};
+    }
+
+    static constexpr double det(const mat<3,3>& m) {
+        return m[0] * cross(m[1], m[2]);
+    }
+
+    static constexpr mat<3,3> invert_transpose(const mat<3,3>& m) {
+        const mat<3,3> c = cofactors(m);
+        const double inv = 1 / (m[0] * c[0]);
+        return {{c[0]*inv, c[1]*inv, c[2]*inv}};
+    }
+};
+
+template<> struct dt<4> {
+    static constexpr double det(const mat<4,4>& m) {
+        const vec4 &a = m[0], &b = m[1], &c = m[2], &d = m[3];
+        const double s0 = a.x*b.y - b.x*a.y, s1 = a.x*b.z - b.x*a.z, s2 = a.x*b.w - b.x*a.w;
+        const double s3 = a.y*b.z - b.y*a.z, s4 = a.y*b.w - b.y*a.w, s5 = a.z*b.w - b.z*a.w;
+        const double c0 = c.x*d.y - d.x*c.y, c1 = c.x*d.z - d.x*c.z, c2 = c.x*d.w - d.x*c.w;
+        const double c3 = c.y*d.z - d.y*c.z, c4 = c.y*d.w - d.y*c.w, c5 = c.z*d.w - d.z*c.w;
+        return s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0;
+    }
+
+    static constexpr mat<4,4> invert_transpose(const mat<4,4>& m) {
+        const vec4 &a = m[0], &b = m[1], &c = m[2], &d = m[3];
+        const double s0 = a.x*b.y - b.x*a.y, s1 = a.x*b.z - b.x*a.z, s2 = a.x*b.w - b.x*a.w;
+        const double s3 = a.y*b.z - b.y*a.z, s4 = a.y*b.w - b.y*a.w, s5 = a.z*b.w - b.z*a.w;
+        const double c0 = c.x*d.y - d.x*c.y, c1 = c.x*d.z - d.x*c.z, c2 = c.x*d.w - d.x*c.w;
+        const double c3 = c.y*d.z - d.y*c.z, c4 = c.y*d.w - d.y*c.w, c5 = c.z*d.w - d.z*c.w;
+        const double inv = 1 / (s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0);
+        return {{
+            {( b.y*c5 - b.z*c4 + b.w*c3)*inv, (-b.x*c5 + b.z*c2 - b.w*c1)*inv, ( b.x*c4 - b.y*c2 + b.w*c0)*inv, (-b.x*c3 + b.y*c1 - b.z*c0)*inv},
+            {(-a.y*c5 + a.z*c4 - a.w*c3)*inv, ( a.x*c5 - a.z*c2 + a.w*c1)*inv, (-a.x*c4 + a.y*c2 - a.w*c0)*inv, ( a.x*c3 - a.y*c1 + a.z*c0)*inv},
+            {( d.y*s5 - d.z*s4 + d.w*s3)*inv, (-d.x*s5 + d.z*s2 - d.w*s1)*inv, ( d.x*s4 - d.y*s2 + d.w*s0)*inv, (-d.x*s3 + d.y*s1 - d.z*s0)*inv},
+            {(-c.y*s5 + c.z*s4 - c.w*s3)*inv, ( c.x*s5 - c.z*s2 + c.w*s1)*inv, (-c.x*s4 + c.y*s2 - c.w*s0)*inv, ( c.x*s3 - c.y*s1 + c.z*s0)*inv}
+        }};
+    }
+};
@@ -0,0 +1,44 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "tgaimage.h"
+#include "profiler.h"
+
+enum HeatmapView {
+    HEATMAP_DEPTH_TESTS,  // fragments depth-tested per pixel (overdraw before the depth test)
+    HEATMAP_SHADED,       // fragments shaded per pixel (overdraw after the depth test)
+    HEATMAP_TILE_COST,    // CPU time spent on the pixels of each tile
+    HEATMAP_VIEW_COUNT
+};
+
+// Recording statistics policy for rasterize(), a view into the buffers of a Heatmap.
+// Each pixel is only written by the thread rasterizing its tile, so no atomics are needed.
+struct HeatmapStats {
+    int width;
+    std::uint16_t* depth_tests;
+    std::uint16_t* shaded_count;
+    std::uint32_t* ticks;
+
+    std::uint64_t start() const { return profile_ticks(); }
+    void depth_test(const int x, const int y) const { depth_tests[x+y*width]++; }
+    void shaded(const int x, const int y, const std::uint64_t start) const {
+        shaded_count[x+y*width]++;
+        ticks[x+y*width] += profile_ticks() - start;
+    }
+};
+
+// Per-pixel fragment counts and cost accumulated over a frame, rendered as a false-colour image
+class Heatmap {
+    int w = 0, h = 0;
+    std::vector<std::uint16_t> depth_tests = {};
+    std::vector<std::uint16_t> shaded_count = {};
+    std::vector<std::uint32_t> ticks = {};
+public:
+    static constexpr int tile_size = 32;
+    void reset(const int width, const int height);
+    HeatmapStats stats();
+    // Overwrites img with the selected view, returns the value mapped to the hottest colour
+    double render(const HeatmapView view, TGAImage& img) const;
+};
+
+const char* heatmap_view_name(const HeatmapView view);
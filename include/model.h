@@ -1,31 +1,101 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <vector>
 #include <string>
+#include <memory>
+#include <algorithm>
+#include "bvh.h"
 #include "geometry.h"
 #include "tgaimage.h"
+#include "texture.h"
+
+class Animation;
+
+// Group of neighbouring triangles culled as a whole before any per-vertex work
+struct Cluster {
+    int first_face = 0, nfaces = 0;  // contiguous range of faces
+    vec3 center = {};                // bounding sphere of the triangles
+    double radius = 0;
+    vec3 cone_axis = {};             // normal cone around the face normals
+    double cone_cutoff = 1;          // sine of the cone half-angle, 1 if the cone is too wide to ever cull
+};
 
 class Model {
     std::vector<vec3> verts = {};    // array of vertices
     std::vector<int> facet_vrt = {}; // per-triangle index in the above array
     std::vector<vec2> tex_coords = {}; // texture coordinates
     std::vector<int> facet_tex = {};  // per-triangle texture index
-    TGAImage normal_map;              // normal map texture
-    TGAImage color_texture;            // color/diffuse texture
+    std::shared_ptr<const Texture> normal_map = {};    // normal map texture, shared with the LODs
+    std::shared_ptr<const Texture> color_texture = {}; // color/diffuse texture, shared with the LODs
     bool has_normal_map = false;
     bool has_color_texture = false;
+    vec3 bound_center = {};           // bounding sphere of the vertices
+    double bound_radius = 0;
+    std::vector<Model> lods = {};     // simplified levels of detail 1..n, level 0 is the model itself
+    std::vector<Cluster> face_clusters = {};
+    // Compact storage after quantize(), replacing verts and tex_coords: 16-bit coordinates relative
+    // to the bounding boxes of the positions and of the texture coordinates, octahedral normals
+    // per vertex and tangents per face
+    bool is_quantized = false;
+    std::vector<std::array<std::uint16_t,3>> qverts = {};
+    std::vector<std::array<std::uint16_t,2>> qtex_coords = {};
+    std::vector<std::uint32_t> packed_normals = {};
+    std::vector<std::uint32_t> packed_tangents = {};
+    vec3 vert_origin = {}, vert_step = {};
+    vec2 tex_origin = {}, tex_step = {};
+    std::shared_ptr<const Animation> skeleton = {}; // skinning data of the vertices, see animation.h
+    BVH face_bvh = {};                // ray queries on the full detail triangles, empty until build_bvh()
+    Model() = default;
+    void compute_bounds();
+    void build_clusters(const int max_faces = 64); // reorders the faces so that every cluster is contiguous
 public:
     Model(const std::string& filename);
     Model(const std::string& filename, const std::string& normal_map_filename);
     Model(const std::string& filename, const std::string& normal_map_filename, const std::string& color_texture_filename);
-    int nverts() const; // number of vertices
-    int nfaces() const; // number of triangles
+    int nverts() const { return is_quantized ? qverts.size() : verts.size(); } // number of vertices
+    int nfaces() const { return facet_vrt.size()/3; } // number of triangles
     vec3 vert(const int i) const;                          // 0 <= i < nverts()
-    vec3 vert(const int iface, const int nthvert) const;   // 0 <= iface <= nfaces(), 0 <= nthvert < 3
+    vec3 vert(const int iface, const int nthvert) const { return vert(facet_vrt[iface*3+nthvert]); } // 0 <= iface <= nfaces(), 0 <= nthvert < 3
     vec2 tex_coord(const int iface, const int nthvert) const; // texture coordinate for face vertex
-    int get_vertex_index(const int iface, const int nthvert) const; // get vertex index for face
+    int get_vertex_index(const int iface, const int nthvert) const { return facet_vrt[iface*3+nthvert]; } // get vertex index for face
     vec3 normal(const vec2& uv) const; // sample normal map at UV coordinates
     vec3 color(const vec2& uv) const; // sample color texture at UV coordinates
     bool has_normal() const { return has_normal_map; }
     bool has_color() const { return has_color_texture; }
+    void set_normal_map(const std::shared_ptr<const Texture>& map);       // maps arriving after the mesh, applied to all LODs
+    void set_color_texture(const std::shared_ptr<const Texture>& texture);
+    vec3 center() const { return bound_center; }
+    double radius() const { return bound_radius; }
+    Model simplified(const int target_faces) const; // quadric error edge collapse down to about target_faces triangles
+    void build_lods(const int levels, const int min_faces = 64); // each level halves the triangle count of the previous one
+    int nlods() const { return 1 + lods.size(); }
+    const std::vector<Cluster>& clusters() const { return face_clusters; }
+    const Model& lod(const int level) const { return level<=0 ? *this : lods[std::min<int>(level, lods.size())-1]; }
+    void quantize(); // switches the model and its LODs to the compact storage, once the LODs are built
+    bool quantized() const { return is_quantized; }
+    vec3 vertex_normal(const int i) const { return octahedral_decode(packed_normals[i]); } // quantized models only
+    vec3 face_tangent(const int iface) const { return octahedral_decode(packed_tangents[iface]); } // quantized models only
+    size_t size_bytes() const; // vertex, index and cluster storage, LODs included
+    // Animated models are skinned every frame and always drawn at full detail: the LODs and the
+    // clusters only describe the bind pose
+    void set_animation(const std::shared_ptr<const Animation>& animation) { skeleton = animation; }
+    const Animation* animation() const { return skeleton.get(); }
+    void build_bvh() { face_bvh.build(*this); } // after quantize(), the tree bounds the positions as drawn
+    const BVH& bvh() const { return face_bvh; }
 };
+
+// Decoding is inline so that it folds into the vertex stage of the shaders
+inline vec3 Model::vert(const int i) const {
+    if (!is_quantized) return verts[i];
+    const std::array<std::uint16_t,3>& q = qverts[i];
+    return {vert_origin.x + q[0]*vert_step.x, vert_origin.y + q[1]*vert_step.y, vert_origin.z + q[2]*vert_step.z};
+}
+
+inline vec2 Model::tex_coord(const int iface, const int nthvert) const {
+    const int i = facet_tex[iface*3+nthvert];
+    if (!is_quantized) return tex_coords[i];
+    const std::array<std::uint16_t,2>& q = qtex_coords[i];
+    return {tex_origin.x + q[0]*tex_step.x, tex_origin.y + q[1]*tex_step.y};
+}
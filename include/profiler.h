@@ -0,0 +1,83 @@
+#pragma once
+#include <cstdint>
+#include <chrono>
+#include <string>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define PROFILE_HAS_RDTSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_HAS_RDTSC
+#endif
+
+// Per-stage timers and counters, compiled in with the SW_PROFILE build option.
+// Scoped stages become trace events; the fine-grained per-triangle/per-pixel
+// stages are accumulated as ticks and reported once per frame.
+enum ProfileStage {
+    STAGE_FRAME,
+    STAGE_CLEAR,
+    STAGE_SKINNING,
+    STAGE_VERTEX,
+    STAGE_NORMALS,
+    STAGE_SETUP,
+    STAGE_BINNING,
+    STAGE_RASTER,
+    STAGE_SHADING,
+    STAGE_SSAO,
+    STAGE_UPSCALE,
+    STAGE_CONVERT,
+    STAGE_PRESENT,
+    STAGE_COUNT
+};
+
+enum ProfileCounter {
+    COUNTER_TRIANGLES_SUBMITTED,
+    COUNTER_TRIANGLES_CULLED,     // off-screen or smaller than a pixel
+    COUNTER_TRIANGLES_BACKFACED,
+    COUNTER_PIXELS_TESTED,        // pixels inside a triangle that went through the depth test
+    COUNTER_PIXELS_PASSED,        // pixels that passed the depth test and were shaded
+    COUNTER_PIXELS_COVERED,       // distinct pixels covered at the end of the frame
+    COUNTER_PIXELS_REUSED,        // covered pixels whose colour the temporal mode took from the previous frame
+    COUNTER_PIXELS_COARSE,        // pixels that passed the depth test and took the colour shaded for their coarse block
+    COUNTER_HEAP_ALLOCATIONS,     // calls to operator new, from any thread
+    COUNTER_FRAME_ARENA_BYTES,    // transient frame data, see arena.h
+    COUNTER_COUNT
+};
+
+bool profiler_open(const std::string& trace_filename, const std::string& csv_filename);
+void profiler_close();
+void profiler_end_frame();
+void profiler_add_ticks(const ProfileStage stage, const std::uint64_t ticks);
+void profiler_count(const ProfileCounter counter, const std::uint64_t n);
+void profiler_record(const ProfileStage stage, const std::chrono::steady_clock::time_point start, const std::chrono::steady_clock::time_point end);
+
+// Cheap monotonic tick counter for the hot paths, converted to time once per frame
+inline std::uint64_t profile_ticks() {
+#ifdef PROFILE_HAS_RDTSC
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+struct ProfileScope {
+    ProfileStage stage;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    ProfileScope(const ProfileStage stage) : stage(stage) {}
+    ~ProfileScope() { profiler_record(stage, start, std::chrono::steady_clock::now()); }
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#ifdef SW_PROFILE
+#define PROFILE_SCOPE(stage)             ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(stage)
+#define PROFILE_TICKS()                  profile_ticks()
+#define PROFILE_ADD_TICKS(stage, ticks)  profiler_add_ticks(stage, ticks)
+#define PROFILE_COUNT(counter, n)        profiler_count(counter, n)
+#else
+#define PROFILE_SCOPE(stage)             ((void)0)
+#define PROFILE_TICKS()                  std::uint64_t(0)
+#define PROFILE_ADD_TICKS(stage, ticks)  ((void)sizeof(ticks))
+#define PROFILE_COUNT(counter, n)        ((void)sizeof(n))
+#endif
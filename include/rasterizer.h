@@ -1,9 +1,18 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
+#include <cstdint>
+#include "arena.h"
 #include "geometry.h"
 #include "tgaimage.h"
 #include "model.h"
+#include "profiler.h"
+#include "scheduler.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RASTER_SSE2
+#endif
 
 // Lighting and material properties
 struct Material {
@@ -13,25 +22,485 @@ struct Material {
     float shininess;
 };
 
+enum LightType {
+    POINT_LIGHT,
+    DIRECTIONAL_LIGHT
+};
+
 struct Light {
-    vec3 position;
+    vec3 position;              // point light: position, directional light: direction towards the light
     vec3 ambient;
     vec3 diffuse;
     vec3 specular;
+    LightType type = POINT_LIGHT;
+    double range = 0;           // point light radius of influence, 0 = unbounded (no attenuation)
+};
+
+// Per screen tile list of the lights that can reach it, rebuilt every frame in the frame arena
+struct LightGrid {
+    static constexpr int tile_size = 32;
+    int tiles_x = 0, tiles_y = 0;
+    FrameVector<int> offsets;   // tiles_x*tiles_y+1 entries, tile t owns indices[offsets[t]..offsets[t+1])
+    FrameVector<int> indices;   // indices into the light list
+    int tile(const int x, const int y) const { return x/tile_size + (y/tile_size)*tiles_x; }
 };
 
-// Global lighting setup
-extern const Material material;
-extern const Light light;
-extern const vec3 viewPos;
+// Lights, material and viewer position of the Phong shading, in the object space of the models
+struct Lighting {
+    std::vector<Light> lights;
+    Material material;
+    vec3 view_position; // for the specular term
+};
+extern const Lighting default_lighting; // one white light
+
+// Camera, viewport and lighting of one render. Every draw takes its context instead of reading
+// globals, so that several views (or several renderers, see sw_renderer.h) can be rendered at the same time.
+struct RenderContext {
+    mat<4,4> ModelView, Perspective, Viewport;
+    double time = 0; // seconds, selects the pose of animated models
+    const Lighting* lighting = &default_lighting; // not owned, must outlive the draws
+    double lod_triangle_area = 4; // levels of detail: target on-screen area in pixels of the selected level's triangles, 0 = always full detail
+    void lookat(const vec3 eye, const vec3 center, const vec3 up);
+    void perspective_fov(const double fov_degrees);
+    void viewport(const int x, const int y, const int w, const int h);
+    mat<4,4> MVP(const mat<4,4>& Model) const { return Perspective * affine_product(ModelView, Model); }
+};
+
+// Rotation of the models, Y then X
+mat<4,4> model_rotation(const double angleX, const double angleY);
 
 // Function declarations
-vec3 calculate_phong_lighting(const vec3& worldPos, const vec3& normal, const Material& mat, const Light& light, const vec3& viewPos);
-void rasterize(const vec4 clip[3], const vec3 worldPos[3], const vec3 normals[3], 
-               const vec2 texCoords[3], const Model& model, std::vector<double> &zbuffer, TGAImage &framebuffer, bool use_normal_mapping = true, bool use_color_texture = false);
-void rasterize_simple(const vec4 clip[3], std::vector<double> &zbuffer, TGAImage &framebuffer, const TGAColor color);
-void cpu_rasterize_models(const std::vector<Model>& models, TGAImage& framebuffer, 
-                         std::vector<double>& zbuffer, const mat<4,4>& Model, 
-                         bool smooth_shading = true, bool use_normal_mapping = true, bool use_color_texture = false);
-std::vector<vec3> calculate_vertex_normals(const Model& model);
-void calculate_tangent_space(const Model& model, int face_idx, vec3& tangent, vec3& bitangent);
+vec3 calculate_phong_lighting(const vec3& worldPos, const vec3& normal, const Material& mat, const std::vector<Light>& lights,
+                              const int* light_ids, const int nlights, const vec3& viewPos);
+int select_lod(const RenderContext& ctx, const Model& model, const mat<4,4>& MVP);
+void build_light_grid(const RenderContext& ctx, LightGrid& grid, const std::vector<Light>& lights, const mat<4,4>& Model, const int width, const int height);
+// Screen rectangle around the projection of a sphere, false when the sphere crosses the camera plane
+bool project_sphere(const RenderContext& ctx, const vec3& center, const double radius, const mat<4,4>& MVP, double& minx, double& miny, double& maxx, double& maxy);
+// Tiles of the framebuffer to redraw when only part of the image changed, on the grid of TileBins.
+// Draws given a DirtyTiles only touch these tiles, the rest is kept from the previous frame.
+struct DirtyTiles {
+    int width = 0, height = 0, tiles_x = 0, tiles_y = 0;
+    std::vector<std::uint8_t> tiles;               // non-zero = redraw
+    int xmin = 0, ymin = 0, xmax = -1, ymax = -1;  // pixel bounds of the dirty tiles, empty when xmin > xmax
+    void reset(const int width, const int height);
+    void add(const int x0, const int y0, const int x1, const int y1); // marks the tiles touching the pixels [x0,x1]x[y0,y1]
+    bool empty() const { return xmin > xmax; }
+    bool misses(const RenderContext& ctx, const Model& model, const mat<4,4>& MVP) const; // the model's bounding sphere is outside the dirty tiles
+};
+
+// Coarse shading rate of every square of tile_size pixels: 1 shades each pixel, 2 and 4 shade once
+// per 2x2 and 4x4 block and give the colour to the block's pixels that the triangle covers and
+// that pass the depth test. Coverage and depth stay per pixel.
+struct ShadingRates {
+    static constexpr int tile_size = 16; // divides TileBins::tile_size and LightGrid::tile_size
+    double threshold = 0;                // largest step of a colour channel (8-bit levels) between neighbouring pixels of a square shaded 2x2
+    int width = 0, height = 0, tiles_x = 0, tiles_y = 0;
+    std::vector<std::uint8_t> rates;
+    // Picks the rates of the next frame from a finished one, from the steps between covered pixels
+    // of the same surface (no depth jump): a square whose steps stay within threshold/2 is shaded
+    // 4x4, within threshold 2x2. shaded_at_rates tells that the frame was shaded at these rates.
+    void update(const TGAImage& frame, const std::vector<double>& zbuffer, const bool shaded_at_rates);
+    void invalidate() { width = height = 0; }
+    bool fits(const int w, const int h) const { return w == width && h == height; }
+};
+
+// Per-fragment statistics policy of the rasterizer, the default records nothing and compiles away
+// (see HeatmapStats in heatmap.h for the recording one)
+struct NoFragmentStats {
+    std::uint64_t start() const { return 0; }
+    void depth_test(const int, const int) const {}
+    void shaded(const int, const int, const std::uint64_t) const {}
+};
+
+class TemporalCache;
+// With a temporal cache (see temporal.h, full frames without statistics only), fragments reuse the
+// colours of the previous frame where they can; with shading rates (of the framebuffer's size)
+// they are shaded per block where the rates allow it
+template<bool smooth_shading, bool normal_mapping, bool color_texture, class Stats = NoFragmentStats>
+void cpu_rasterize_models(const RenderContext& ctx, const std::vector<Model>& models, TGAImage& framebuffer, 
+                         std::vector<double>& zbuffer, const mat<4,4>& Model, const Stats& stats = {}, const DirtyTiles* dirty = nullptr,
+                         TemporalCache* temporal = nullptr, const ShadingRates* rates = nullptr);
+// Both take the positions of the vertices from the model, or from positions when given (one per vertex)
+FrameVector<vec3> calculate_vertex_normals(const Model& model, const vec3* positions = nullptr);
+void calculate_tangent_space(const Model& model, int face_idx, vec3& tangent, vec3& bitangent, const vec3* positions = nullptr);
+// Vertex positions of an animated model posed at ctx.time, empty for a static model
+FrameVector<vec3> pose_vertices(const RenderContext& ctx, const Model& model);
+
+// Cluster culling state of one draw: projection centre and screen edge planes in object space
+struct ClusterCuller {
+    vec3 eye;
+    vec4 planes[5]; // left, right, bottom, top, camera plane
+    ClusterCuller(const RenderContext& ctx, const mat<4,4>& MVP, const double x0, const double y0, const double x1, const double y1); // screen area [x0,x1]x[y0,y1]
+    bool backfacing(const Cluster& cluster) const; // every triangle of the cluster faces away from the camera
+    bool outside(const Cluster& cluster) const;    // the bounding sphere is entirely off-screen
+};
+
+// Triangles whose clipped bounding box fits in micro_triangle_size pixels square take the
+// rasterize_micro path
+constexpr int micro_triangle_size = 8;
+
+// Triangle after the vertex stage and setup, everything a tile needs to rasterize its part
+template<int nvaryings> struct ScreenTriangle {
+    mat<3,3> ABC_invt;          // maps screen {x,y,1} to barycentric coordinates
+    vec3 depth;                 // NDC z of the corners
+    int xmin, xmax, ymin, ymax; // bounding box clipped by the screen, empty when the triangle is culled
+    bool micro;                 // the bounding box is at most micro_triangle_size pixels wide and high
+    vec<nvaryings> varyings[3];
+};
+
+// Triangle lists of the screen tiles, kept in submission order so that each tile resolves the
+// depth test exactly as a sequential rasterizer would
+struct TileBins {
+    static constexpr int tile_size = 64;
+    int tiles_x = 0, tiles_y = 0;
+    FrameVector<int> offsets;   // tiles_x*tiles_y+1 entries, tile t owns triangles[offsets[t]..offsets[t+1])
+    FrameVector<int> triangles; // indices into the draw's triangles
+};
+
+// Per-tile totals, added to the profiler once per tile
+struct RasterCounters {
+    std::uint64_t tested = 0, passed = 0, coarse = 0, shading_ticks = 0;
+};
+
+// Projects the triangle to the screen; returns false and leaves an empty bounding box if it is
+// backfacing or too small (counted in backfaced/culled)
+template<int nvaryings>
+bool setup_triangle(const RenderContext& ctx, const vec4 clip[3], const int width, const int height, ScreenTriangle<nvaryings>& tri, int& backfaced, int& culled) {
+    tri.xmin = 1;
+    tri.xmax = 0;
+    vec4 ndc[3]    = { clip[0]/clip[0].w, clip[1]/clip[1].w, clip[2]/clip[2].w };                // normalized device coordinates
+    vec2 screen[3] = { (ctx.Viewport*ndc[0]).xy(), (ctx.Viewport*ndc[1]).xy(), (ctx.Viewport*ndc[2]).xy() }; // screen coordinates
+
+    mat<3,3> ABC = {{ {screen[0].x, screen[0].y, 1.}, {screen[1].x, screen[1].y, 1.}, {screen[2].x, screen[2].y, 1.} }};
+    const double det = ABC.det();
+    if (det<1) { // backface culling + discarding triangles that cover less than a pixel
+        (det<=0 ? backfaced : culled)++;
+        return false;
+    }
+    tri.ABC_invt = ABC.invert_transpose();
+    tri.depth = { ndc[0].z, ndc[1].z, ndc[2].z };
+
+    auto [bbminx,bbmaxx] = std::minmax({screen[0].x, screen[1].x, screen[2].x}); // bounding box for the triangle
+    auto [bbminy,bbmaxy] = std::minmax({screen[0].y, screen[1].y, screen[2].y}); // defined by its top left and bottom right corners
+    tri.xmin = std::max<int>(bbminx, 0); tri.xmax = std::min<int>(bbmaxx, width-1);  // clip the bounding box by the screen
+    tri.ymin = std::max<int>(bbminy, 0); tri.ymax = std::min<int>(bbmaxy, height-1);
+    if (tri.xmin>tri.xmax || tri.ymin>tri.ymax) {
+        culled++;
+        return false;
+    }
+    tri.micro = tri.xmax-tri.xmin < micro_triangle_size && tri.ymax-tri.ymin < micro_triangle_size;
+    return true;
+}
+
+// Stable counting sort of the (tile, triangle) pairs: chunks of triangles are counted and then
+// scattered in parallel, each chunk writing after the chunks before it in every tile
+template<int nvaryings>
+void bin_triangles(const FrameVector<ScreenTriangle<nvaryings>>& triangles, const int width, const int height, TileBins& bins) {
+    PROFILE_SCOPE(STAGE_BINNING);
+    constexpr int T = TileBins::tile_size;
+    bins.tiles_x = (width + T - 1) / T;
+    bins.tiles_y = (height + T - 1) / T;
+    const int ntiles = bins.tiles_x * bins.tiles_y;
+    const int ntriangles = triangles.size();
+    const int nchunks = std::max(1, std::min(ntriangles, scheduler.nthreads()*4));
+    const int chunk_size = (ntriangles + nchunks - 1) / nchunks;
+    FrameVector<int> cursors(nchunks*ntiles, 0);
+    auto for_tiles = [&](const ScreenTriangle<nvaryings>& tri, auto&& f) {
+        if (tri.xmin > tri.xmax) return;
+        for (int ty=tri.ymin/T; ty<=tri.ymax/T; ty++)
+            for (int tx=tri.xmin/T; tx<=tri.xmax/T; tx++)
+                f(tx + ty*bins.tiles_x);
+    };
+    scheduler.parallel_for(0, nchunks, 1, [&](const int first, const int last) {
+        for (int c=first; c<last; c++)
+            for (int i=c*chunk_size; i<std::min(ntriangles, (c+1)*chunk_size); i++)
+                for_tiles(triangles[i], [&](const int tile) { cursors[c*ntiles+tile]++; });
+    });
+    bins.offsets.resize(ntiles+1);
+    int total = 0;
+    for (int tile=0; tile<ntiles; tile++) {
+        bins.offsets[tile] = total;
+        for (int c=0; c<nchunks; c++) {
+            const int count = cursors[c*ntiles+tile];
+            cursors[c*ntiles+tile] = total;
+            total += count;
+        }
+    }
+    bins.offsets[ntiles] = total;
+    bins.triangles.resize(total);
+    scheduler.parallel_for(0, nchunks, 1, [&](const int first, const int last) {
+        for (int c=first; c<last; c++)
+            for (int i=c*chunk_size; i<std::min(ntriangles, (c+1)*chunk_size); i++)
+                for_tiles(triangles[i], [&](const int tile) { bins.triangles[cursors[c*ntiles+tile]++] = i; });
+    });
+}
+
+// Rasterizes the part of the triangle inside the pixel rectangle [x0,x1]x[y0,y1]
+template<class Shader, class Stats>
+void rasterize(const Shader& shader, const ScreenTriangle<Shader::nvaryings>& tri, const int x0, const int y0, const int x1, const int y1,
+               std::vector<double> &zbuffer, TGAImage &framebuffer, const Stats& stats, RasterCounters& counters) {
+    const int xmin = std::max(tri.xmin, x0), xmax = std::min(tri.xmax, x1);
+    const int ymin = std::max(tri.ymin, y0), ymax = std::min(tri.ymax, y1);
+    for (int y=ymin; y<=ymax; y++) {
+        for (int x=xmin; x<=xmax; x++) {
+            vec3 bc = tri.ABC_invt * vec3{static_cast<double>(x), static_cast<double>(y), 1.}; // barycentric coordinates of {x,y} w.r.t the triangle
+            if (bc.x<0 || bc.y<0 || bc.z<0) continue;                                          // negative barycentric coordinate => the pixel is outside the triangle
+            shade_pixel(shader, tri, x, y, bc, bc * tri.depth, zbuffer, framebuffer, stats, counters);
+        }
+    }
+}
+
+// Depth test and shading of one covered pixel, shared by both rasterizers
+template<class Shader, class Stats>
+inline void shade_pixel(const Shader& shader, const ScreenTriangle<Shader::nvaryings>& tri, const int x, const int y, const vec3& bc, const double z,
+                        std::vector<double> &zbuffer, TGAImage &framebuffer, const Stats& stats, RasterCounters& counters) {
+    const int width = framebuffer.width();
+    counters.tested++;
+    stats.depth_test(x, y);
+    if (z <= zbuffer[x+y*width]) return;
+    zbuffer[x+y*width] = z;
+    counters.passed++;
+
+    const std::uint64_t shading_start = PROFILE_TICKS();
+    const std::uint64_t stats_start = stats.start();
+    vec<Shader::nvaryings> varying = bc.x * tri.varyings[0] + bc.y * tri.varyings[1] + bc.z * tri.varyings[2];
+    TGAColor color;
+    shader.fragment(x, y, varying, color);
+    framebuffer.set(x, y, color);
+    stats.shaded(x, y, stats_start);
+    counters.shading_ticks += PROFILE_TICKS() - shading_start;
+}
+
+// Rasterizer of the triangles flagged micro: the coverage of the whole (at most 8x8) box is
+// computed first, two pixels per SSE2 register without a branch, into one bit per pixel; only
+// the covered pixels are then visited. The arithmetic is that of rasterize, operation for
+// operation, so both paths produce the same image.
+template<class Shader, class Stats>
+void rasterize_micro(const Shader& shader, const ScreenTriangle<Shader::nvaryings>& tri, const int x0, const int y0, const int x1, const int y1,
+                     std::vector<double> &zbuffer, TGAImage &framebuffer, const Stats& stats, RasterCounters& counters) {
+    constexpr int N = micro_triangle_size;
+    const int xmin = std::max(tri.xmin, x0), xmax = std::min(tri.xmax, x1);
+    const int ymin = std::max(tri.ymin, y0), ymax = std::min(tri.ymax, y1);
+    if (xmin > xmax || ymin > ymax) return;
+    alignas(16) double bc[3][N*N], z[N*N];
+    std::uint64_t covered = 0;
+    const vec3& r0 = tri.ABC_invt[0];
+    const vec3& r1 = tri.ABC_invt[1];
+    const vec3& r2 = tri.ABC_invt[2];
+    for (int y=ymin; y<=ymax; y++) {
+        const int row = (y-ymin)*N;
+        // ABC_invt * {x,y,1} sums the z, y and x terms in this order
+        const double c0 = r0.z + r0.y*y, c1 = r1.z + r1.y*y, c2 = r2.z + r2.y*y;
+        std::uint64_t row_mask = 0;
+#ifdef RASTER_SSE2
+        for (int i=0; i<=xmax-xmin; i+=2) {
+            const __m128d x = _mm_set_pd(xmin+i+1, xmin+i);
+            const __m128d b0 = _mm_add_pd(_mm_set1_pd(c0), _mm_mul_pd(_mm_set1_pd(r0.x), x));
+            const __m128d b1 = _mm_add_pd(_mm_set1_pd(c1), _mm_mul_pd(_mm_set1_pd(r1.x), x));
+            const __m128d b2 = _mm_add_pd(_mm_set1_pd(c2), _mm_mul_pd(_mm_set1_pd(r2.x), x));
+            const __m128d zero = _mm_setzero_pd();
+            const __m128d inside = _mm_and_pd(_mm_and_pd(_mm_cmpge_pd(b0, zero), _mm_cmpge_pd(b1, zero)), _mm_cmpge_pd(b2, zero));
+            row_mask |= std::uint64_t(_mm_movemask_pd(inside)) << i;
+            // bc * depth sums the z, y and x terms in this order
+            const __m128d d = _mm_add_pd(_mm_add_pd(_mm_mul_pd(b2, _mm_set1_pd(tri.depth.z)), _mm_mul_pd(b1, _mm_set1_pd(tri.depth.y))),
+                                         _mm_mul_pd(b0, _mm_set1_pd(tri.depth.x)));
+            _mm_store_pd(bc[0]+row+i, b0);
+            _mm_store_pd(bc[1]+row+i, b1);
+            _mm_store_pd(bc[2]+row+i, b2);
+            _mm_store_pd(z+row+i, d);
+        }
+        row_mask &= (std::uint64_t(1) << (xmax-xmin+1)) - 1; // the second pixel of the last pair can be past the box
+#else
+        for (int i=0; i<=xmax-xmin; i++) {
+            const double b0 = c0 + r0.x*(xmin+i), b1 = c1 + r1.x*(xmin+i), b2 = c2 + r2.x*(xmin+i);
+            row_mask |= std::uint64_t(b0>=0 && b1>=0 && b2>=0) << i;
+            bc[0][row+i] = b0;
+            bc[1][row+i] = b1;
+            bc[2][row+i] = b2;
+            z[row+i] = b2*tri.depth.z + b1*tri.depth.y + b0*tri.depth.x;
+        }
+#endif
+        covered |= row_mask << row;
+    }
+    for (int i=0; covered; i++, covered>>=1) {
+        if (!(covered & 1)) continue;
+        shade_pixel(shader, tri, xmin + i%N, ymin + i/N, vec3{bc[0][i], bc[1][i], bc[2][i]}, z[i], zbuffer, framebuffer, stats, counters);
+    }
+}
+
+// Rasterizes the part of the triangle inside [x0,x1]x[y0,y1] shading once per rate x rate block
+// (aligned on the screen). The colour is shaded at the mean barycentric coordinates of the
+// block's pixels that passed the depth test, a point inside the triangle, so the varyings are
+// never extrapolated.
+template<class Shader, class Stats>
+void rasterize_coarse(const Shader& shader, const ScreenTriangle<Shader::nvaryings>& tri, const int x0, const int y0, const int x1, const int y1, const int rate,
+                      std::vector<double> &zbuffer, TGAImage &framebuffer, const Stats& stats, RasterCounters& counters) {
+    const int width = framebuffer.width();
+    const int xmin = std::max(tri.xmin, x0), xmax = std::min(tri.xmax, x1);
+    const int ymin = std::max(tri.ymin, y0), ymax = std::min(tri.ymax, y1);
+    for (int by=ymin - ymin%rate; by<=ymax; by+=rate) {
+        for (int bx=xmin - xmin%rate; bx<=xmax; bx+=rate) {
+            int passed[16], npassed = 0;
+            vec3 sum = {0, 0, 0};
+            for (int y=std::max(by, ymin); y<=std::min(by+rate-1, ymax); y++) {
+                for (int x=std::max(bx, xmin); x<=std::min(bx+rate-1, xmax); x++) {
+                    vec3 bc = tri.ABC_invt * vec3{static_cast<double>(x), static_cast<double>(y), 1.};
+                    if (bc.x<0 || bc.y<0 || bc.z<0) continue;
+                    counters.tested++;
+                    stats.depth_test(x, y);
+                    const double z = bc * tri.depth;
+                    if (z <= zbuffer[x+y*width]) continue;
+                    zbuffer[x+y*width] = z;
+                    passed[npassed++] = x+y*width;
+                    sum = sum + bc;
+                }
+            }
+            if (!npassed) continue;
+            counters.passed += npassed;
+            counters.coarse += npassed - 1;
+
+            const std::uint64_t shading_start = PROFILE_TICKS();
+            const int x = passed[0] % width, y = passed[0] / width;
+            const std::uint64_t stats_start = stats.start();
+            const vec3 bc = sum / npassed;
+            vec<Shader::nvaryings> varying = bc.x * tri.varyings[0] + bc.y * tri.varyings[1] + bc.z * tri.varyings[2];
+            TGAColor color;
+            shader.fragment(x, y, varying, color);
+            for (int i=0; i<npassed; i++) framebuffer.set(passed[i] % width, passed[i] / width, color);
+            stats.shaded(x, y, stats_start);
+            counters.shading_ticks += PROFILE_TICKS() - shading_start;
+        }
+    }
+}
+
+// Rasterizes the part of the triangle inside the tile [x0,x1]x[y0,y1] square by square, at the
+// square's shading rate
+template<class Shader, class Stats>
+void rasterize_rates(const Shader& shader, const ScreenTriangle<Shader::nvaryings>& tri, const int x0, const int y0, const int x1, const int y1, const ShadingRates& rates,
+                     std::vector<double> &zbuffer, TGAImage &framebuffer, const Stats& stats, RasterCounters& counters) {
+    constexpr int S = ShadingRates::tile_size;
+    const int xmin = std::max(tri.xmin, x0), xmax = std::min(tri.xmax, x1);
+    const int ymin = std::max(tri.ymin, y0), ymax = std::min(tri.ymax, y1);
+    for (int sy=ymin/S; sy<=ymax/S; sy++) {
+        for (int sx=xmin/S; sx<=xmax/S; sx++) {
+            const int sx0 = std::max(xmin, sx*S), sx1 = std::min(xmax, sx*S + S-1);
+            const int sy0 = std::max(ymin, sy*S), sy1 = std::min(ymax, sy*S + S-1);
+            const int rate = rates.rates[sx + sy*rates.tiles_x];
+            if (rate > 1) rasterize_coarse(shader, tri, sx0, sy0, sx1, sy1, rate, zbuffer, framebuffer, stats, counters);
+            else if (tri.micro) rasterize_micro(shader, tri, sx0, sy0, sx1, sy1, zbuffer, framebuffer, stats, counters);
+            else rasterize(shader, tri, sx0, sy0, sx1, sy1, zbuffer, framebuffer, stats, counters);
+        }
+    }
+}
+
+// The rasterizer is instantiated per shader type, a shader is any type providing
+//   static constexpr int nvaryings;                                                    // number of interpolated values
+//   vec4 vertex(const int iface, const int nthvert, vec<nvaryings>& varying) const;    // returns clip coordinates
+//   void fragment(const int x, const int y, const vec<nvaryings>& varying, TGAColor& color) const;
+// so features a shader does not use cost nothing per fragment and there are no virtual calls.
+//
+// A draw runs in three parallel passes on the scheduler: vertex stage and setup over the face
+// ranges, binning of the triangles into screen tiles, then every tile rasterized on its own.
+// Both shader functions are called from several threads at once. The per-draw triangle and tile
+// lists live in the frame arena. With dirty tiles, the other tiles are left untouched; with
+// shading rates, the tiles are rasterized at the rates of their squares.
+template<class Shader, class Stats = NoFragmentStats>
+void draw_ranges(const RenderContext& ctx, const Shader& shader, const FrameVector<std::pair<int,int>>& ranges, std::vector<double> &zbuffer, TGAImage &framebuffer,
+                 const Stats& stats = {}, const DirtyTiles* dirty = nullptr, const ShadingRates* rates = nullptr) {
+    const int width = framebuffer.width(), height = framebuffer.height();
+    FrameVector<int> range_start(ranges.size()+1, 0); // position of the first triangle of each range
+    for (size_t r=0; r<ranges.size(); r++)
+        range_start[r+1] = range_start[r] + ranges[r].second - ranges[r].first;
+    if (!range_start.back()) return;
+    PROFILE_COUNT(COUNTER_TRIANGLES_SUBMITTED, range_start.back());
+
+    FrameVector<ScreenTriangle<Shader::nvaryings>> triangles(range_start.back());
+    scheduler.parallel_for(0, ranges.size(), 1, [&](const int first, const int last) {
+        std::uint64_t vertex_ticks = 0, setup_ticks = 0;
+        int backfaced = 0, culled = 0;
+        for (int r=first; r<last; r++)
+            for (int i=ranges[r].first, t=range_start[r]; i<ranges[r].second; i++, t++) {
+                const std::uint64_t vertex_start = PROFILE_TICKS();
+                vec4 clip[3];
+                for (int d : {0,1,2})
+                    clip[d] = shader.vertex(i, d, triangles[t].varyings[d]);
+                const std::uint64_t setup_start = PROFILE_TICKS();
+                vertex_ticks += setup_start - vertex_start;
+                setup_triangle(ctx, clip, width, height, triangles[t], backfaced, culled);
+                setup_ticks += PROFILE_TICKS() - setup_start;
+            }
+        PROFILE_ADD_TICKS(STAGE_VERTEX, vertex_ticks);
+        PROFILE_ADD_TICKS(STAGE_SETUP, setup_ticks);
+        PROFILE_COUNT(COUNTER_TRIANGLES_BACKFACED, backfaced);
+        PROFILE_COUNT(COUNTER_TRIANGLES_CULLED, culled);
+    });
+
+    TileBins bins;
+    bin_triangles(triangles, width, height, bins);
+
+    scheduler.parallel_for(0, bins.tiles_x*bins.tiles_y, 1, [&](const int first, const int last) {
+        for (int tile=first; tile<last; tile++) {
+            if (bins.offsets[tile] == bins.offsets[tile+1] || (dirty && !dirty->tiles[tile])) continue;
+            const std::uint64_t tile_start = PROFILE_TICKS();
+            const int x0 = (tile % bins.tiles_x) * TileBins::tile_size, x1 = std::min(x0 + TileBins::tile_size, width) - 1;
+            const int y0 = (tile / bins.tiles_x) * TileBins::tile_size, y1 = std::min(y0 + TileBins::tile_size, height) - 1;
+            RasterCounters counters;
+            for (int k=bins.offsets[tile]; k<bins.offsets[tile+1]; k++) {
+                const ScreenTriangle<Shader::nvaryings>& tri = triangles[bins.triangles[k]];
+                if (rates) rasterize_rates(shader, tri, x0, y0, x1, y1, *rates, zbuffer, framebuffer, stats, counters);
+                else if (tri.micro) rasterize_micro(shader, tri, x0, y0, x1, y1, zbuffer, framebuffer, stats, counters);
+                else rasterize(shader, tri, x0, y0, x1, y1, zbuffer, framebuffer, stats, counters);
+            }
+            PROFILE_ADD_TICKS(STAGE_SHADING, counters.shading_ticks);
+            PROFILE_ADD_TICKS(STAGE_RASTER, PROFILE_TICKS() - tile_start - counters.shading_ticks);
+            PROFILE_COUNT(COUNTER_PIXELS_TESTED, counters.tested);
+            PROFILE_COUNT(COUNTER_PIXELS_PASSED, counters.passed);
+            PROFILE_COUNT(COUNTER_PIXELS_COARSE, counters.coarse);
+        }
+    });
+}
+
+// Runs the shader over the faces [first, last)
+template<class Shader, class Stats = NoFragmentStats>
+void draw_faces(const RenderContext& ctx, const Shader& shader, const int first, const int last, std::vector<double> &zbuffer, TGAImage &framebuffer, const Stats& stats = {}) {
+    FrameVector<std::pair<int,int>> ranges;
+    ranges.reserve((last-first+63)/64);
+    for (int i=first; i<last; i+=64)
+        ranges.push_back({i, std::min(i+64, last)});
+    draw_ranges(ctx, shader, ranges, zbuffer, framebuffer, stats);
+}
+
+// Runs the shader over the first nfaces triangles
+template<class Shader, class Stats = NoFragmentStats>
+void draw(const RenderContext& ctx, const Shader& shader, const int nfaces, std::vector<double> &zbuffer, TGAImage &framebuffer, const Stats& stats = {}) {
+    draw_faces(ctx, shader, 0, nfaces, zbuffer, framebuffer, stats);
+}
+
+// Draws the clusters of the model that may be visible: whole clusters facing away from the
+// camera or lying off-screen (or outside the dirty tiles) are rejected before their vertices are transformed.
+// The bounds of the clusters do not hold once an animated model is skinned, all of them are drawn.
+template<class Shader, class Stats = NoFragmentStats>
+void draw_clustered(const RenderContext& ctx, const Shader& shader, const Model& model, const mat<4,4>& MVP, std::vector<double> &zbuffer, TGAImage &framebuffer,
+                    const Stats& stats = {}, const DirtyTiles* dirty = nullptr, const ShadingRates* rates = nullptr) {
+    if (model.animation()) {
+        FrameVector<std::pair<int,int>> ranges;
+        ranges.reserve(model.clusters().size());
+        for (const Cluster& cluster : model.clusters())
+            ranges.push_back({cluster.first_face, cluster.first_face+cluster.nfaces});
+        return draw_ranges(ctx, shader, ranges, zbuffer, framebuffer, stats, dirty, rates);
+    }
+    const ClusterCuller culler = dirty ? ClusterCuller(ctx, MVP, dirty->xmin, dirty->ymin, dirty->xmax+1, dirty->ymax+1)
+                                       : ClusterCuller(ctx, MVP, 0, 0, framebuffer.width(), framebuffer.height());
+    FrameVector<std::pair<int,int>> ranges;
+    ranges.reserve(model.clusters().size());
+    int backfaced = 0, culled = 0;
+    for (const Cluster& cluster : model.clusters()) {
+        if (culler.backfacing(cluster)) backfaced += cluster.nfaces;
+        else if (culler.outside(cluster)) culled += cluster.nfaces;
+        else ranges.push_back({cluster.first_face, cluster.first_face+cluster.nfaces});
+    }
+    PROFILE_COUNT(COUNTER_TRIANGLES_SUBMITTED, backfaced + culled);
+    PROFILE_COUNT(COUNTER_TRIANGLES_BACKFACED, backfaced);
+    PROFILE_COUNT(COUNTER_TRIANGLES_CULLED, culled);
+    draw_ranges(ctx, shader, ranges, zbuffer, framebuffer, stats, dirty, rates);
+}
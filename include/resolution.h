@@ -0,0 +1,27 @@
+#pragma once
+
+#include "tgaimage.h"
+
+// Render size of the interactive viewer while the view moves. The render times of the moving
+// frames drive the size: it shrinks as soon as two frames in a row miss the budget, and grows
+// back once four frames in a row take less than 3/4 of it. Sizes are multiples of 16 pixels,
+// so that the viewport of the smaller image is exactly the window's scaled, and never below half
+// the window. A budget of 0 keeps the full size.
+class DynamicResolution {
+public:
+    DynamicResolution(const int width, const int height, const double budget_ms);
+    int width() const;
+    int height() const;
+    void frame_rendered(const double render_time_ms); // a frame of width() x height() took render_time_ms
+
+private:
+    int full_width, full_height;
+    double budget;
+    int steps, min_steps, level; // the render width is level/steps of the window's
+    double recent[4] = {};       // last render times at the current level
+    int nrecent = 0;
+};
+
+// Bilinear resize of src into dst (same pixel format), in parallel over rows. Pixel x of dst is sampled at
+// x*src.width()/dst.width() in src, where the rasterizer put the same point of the scene.
+void upscale_bilinear(const TGAImage& src, TGAImage& dst);
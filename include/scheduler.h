@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Persistent worker threads with one task deque per thread. A thread pushes and pops its own
+// tasks at the back of its deque while idle threads steal from the front of the others', so the
+// chunks of a parallel loop spread over the cores without a central queue. The thread that
+// started the scheduler owns a deque too and works on its loops instead of blocking.
+//
+// Background jobs (asset loading) go to a separate queue served only by workers that found no
+// loop chunk to run, so a long load never delays a frame waiting on its loops. The chunks of
+// loops inside a background job are marked as such: a thread waiting on a frame's loop never
+// runs them, only idle workers and threads waiting inside background jobs do.
+class Scheduler {
+public:
+    // nthreads counts the calling thread, 0 = one per hardware thread; there is always at least
+    // one worker so that background jobs progress. pin binds thread i to core i.
+    void start(int nthreads = 0, const bool pin = false);
+    void stop(); // background jobs that have not started are abandoned
+    ~Scheduler() { stop(); }
+    int nthreads() const { return queues.empty() ? 1 : queues.size(); }
+    static bool on_scheduler_thread() { return slot >= 0; } // the calling thread started the scheduler or is one of its workers
+
+    // Calls body(first, last) over [begin, end) split into chunks of grain items and returns
+    // once all of them are done. Threads unknown to the scheduler run the loop inline.
+    template<class F> void parallel_for(const int begin, const int end, const int grain, const F& body) {
+        if (begin >= end) return;
+        if (slot < 0 || end-begin <= grain) {
+            body(begin, end);
+            return;
+        }
+        std::atomic<int> pending{(end-begin+grain-1)/grain};
+        auto run = [](const void* f, const int first, const int last) { (*static_cast<const F*>(f))(first, last); };
+        push(run, &body, begin, end, grain, pending);
+        wait(pending);
+    }
+
+    template<class T> std::shared_future<T> background(std::function<T()> job) {
+        auto task = std::make_shared<std::packaged_task<T()>>(std::move(job)); // std::function needs a copyable callable
+        std::shared_future<T> future = task->get_future().share();
+        push_background([task] { (*task)(); });
+        return future;
+    }
+
+private:
+    struct Task {
+        void (*run)(const void* body, const int first, const int last);
+        const void* body;
+        int first, last;
+        std::atomic<int>* pending;
+        bool background; // pushed by a background job
+    };
+    // Ring buffer rather than std::deque, whose blocks are allocated and freed as a loop's chunks
+    // come and go; the ring only grows, so a steady frame does no allocation here
+    struct Queue {
+        std::mutex mutex;
+        std::vector<Task> ring;
+        std::size_t head = 0, count = 0;
+        void push_back(const Task& task);
+        Task pop_back();
+        Task pop_front();
+    };
+
+    void push(void (*run)(const void*, const int, const int), const void* body, const int begin, const int end, const int grain, std::atomic<int>& pending);
+    void push_background(std::function<void()> job);
+    // With frame_only, chunks of background jobs are left where they are
+    bool pop(Task& task, const bool frame_only);   // back of the own deque
+    bool steal(Task& task, const bool frame_only); // front of another thread's deque
+    void execute(const Task& task);
+    void wait(std::atomic<int>& pending);
+    void worker(const int index, const bool pin);
+
+    static thread_local int slot; // deque of the current thread, -1 for threads the scheduler does not know
+    static thread_local bool in_background; // running a background job or one of its chunks
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<int> queued{0};  // loop chunks waiting in the deques
+    std::mutex sleep_mutex;      // guards the background queue and the sleep of idle workers
+    std::condition_variable wakeup;
+    std::queue<std::function<void()>> background_jobs;
+    bool stopping = false;
+};
+
+extern Scheduler scheduler;
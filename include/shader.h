@@ -0,0 +1,87 @@
+#pragma once
+
+#include <vector>
+#include "geometry.h"
+#include "model.h"
+#include "rasterizer.h"
+
+// Phong shading pipeline, one instantiation per feature combination so the
+// per-fragment path only contains the work the selected shading mode needs
+template<bool smooth_shading, bool normal_mapping, bool color_texture>
+struct PhongShader {
+    static constexpr int nvaryings = normal_mapping ? 11 : 8; // world position, normal, uv [, tangent]
+
+    const Model& model;
+    const mat<4,4>& MVP;                      // Perspective * ModelView * Model
+    const FrameVector<vec3>& vertex_normals;  // per-vertex normals, only read with smooth shading of unquantized or posed models
+    const LightGrid& light_grid;
+    const Lighting& lighting;
+    const vec3* positions = nullptr;          // skinned vertex positions of an animated model, nullptr for the model's own
+
+    vec3 position(const int iface, const int nthvert) const {
+        return positions ? positions[model.get_vertex_index(iface, nthvert)] : model.vert(iface, nthvert);
+    }
+
+    vec4 vertex(const int iface, const int nthvert, vec<nvaryings>& varying) const {
+        vec3 v = position(iface, nthvert);
+        vec3 n;
+        if constexpr (smooth_shading) {
+            const int i = model.get_vertex_index(iface, nthvert);
+            n = model.quantized() && !positions ? model.vertex_normal(i) : vertex_normals[i];
+        } else {
+            // Face normal for flat shading, the same for all three vertices
+            vec3 v0 = position(iface, 0);
+            n = normalized(cross(position(iface, 1) - v0, position(iface, 2) - v0));
+        }
+        vec2 uv = model.tex_coord(iface, nthvert);
+        for (int i : {0,1,2}) {
+            varying[i]   = v[i];
+            varying[i+3] = n[i];
+        }
+        varying[6] = uv.x;
+        varying[7] = uv.y;
+        if constexpr (normal_mapping) {
+            vec3 tangent, bitangent;
+            if (model.quantized() && !positions) tangent = model.face_tangent(iface);
+            else calculate_tangent_space(model, iface, tangent, bitangent, positions);
+            for (int i : {0,1,2}) varying[i+8] = tangent[i];
+        }
+        return MVP * vec4{v.x, v.y, v.z, 1.};
+    }
+
+    void fragment(const int x, const int y, const vec<nvaryings>& varying, TGAColor& color) const {
+        vec3 worldPos = {varying[0], varying[1], varying[2]};
+        vec3 normal   = {varying[3], varying[4], varying[5]};
+        vec2 uv       = {varying[6], varying[7]};
+
+        if constexpr (normal_mapping) {
+            // Transform the sampled normal from tangent space to world space
+            // TBN matrix: [T, B, N] where T=tangent, B=bitangent, N=normal
+            vec3 tangent = normalized(vec3{varying[8], varying[9], varying[10]});
+            vec3 bitangent = normalized(cross(normal, tangent));
+            mat<3,3> TBN = {{{tangent.x, bitangent.x, normal.x},
+                            {tangent.y, bitangent.y, normal.y},
+                            {tangent.z, bitangent.z, normal.z}}};
+            normal = normalized(TBN * model.normal(uv));
+        }
+
+        // Only the lights binned into this pixel's tile are evaluated
+        const int tile = light_grid.tile(x, y);
+        const int* light_ids = light_grid.indices.data() + light_grid.offsets[tile];
+        const int nlights = light_grid.offsets[tile+1] - light_grid.offsets[tile];
+        vec3 final_color = calculate_phong_lighting(worldPos, normal, lighting.material, lighting.lights, light_ids, nlights, lighting.view_position);
+
+        if constexpr (color_texture) {
+            // Use texture color as base material color, then apply lighting
+            vec3 texture_color = model.color(uv);
+            final_color.x = texture_color.x * final_color.x;
+            final_color.y = texture_color.y * final_color.y;
+            final_color.z = texture_color.z * final_color.z;
+        }
+
+        color[0] = (unsigned char)(final_color.x * 255);
+        color[1] = (unsigned char)(final_color.y * 255);
+        color[2] = (unsigned char)(final_color.z * 255);
+        color.bytespp = 3;
+    }
+};
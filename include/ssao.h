@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+#include "geometry.h"
+#include "rasterizer.h"
+#include "tgaimage.h"
+
+// Screen-space ambient occlusion, a post-process of a finished frame that needs nothing but its
+// z-buffer. The view-space position of every pixel is rebuilt from its depth, the normal from the
+// positions of its neighbours, and the occlusion from samples on a spiral of radius (object space)
+// around the pixel: a sample above the pixel's tangent plane and within the radius occludes it
+// by the cosine of its direction to the normal. Four spiral rotations alternate over the screen
+// and a separable bilateral blur, which does not cross depth discontinuities, removes the noise.
+// The samples are taken over 64x64 tiles on the scheduler and the other passes over bands of
+// rows, all of them four pixels of a row at a time in SSE2 registers (scalar without SSE2). With half_resolution, the occlusion is computed
+// on every other pixel of every other row and each pixel takes the nearest in depth of its four
+// closest ones.
+class AmbientOcclusion {
+public:
+    static constexpr int tile_size = 64;
+    static constexpr int samples = 12;
+    static constexpr int max_radius = 24;  // pixels of the occlusion buffer, larger radii are clamped
+    static constexpr int blur_radius = 4;  // taps on each side of the blur
+
+    double radius = .1;       // object space
+    double intensity = 2.5;   // darkening per unit of the samples' mean occlusion (cosine to the normal, within the radius)
+    bool half_resolution = false;
+
+    // Darkens the covered pixels of framebuffer, or with dirty tiles only those inside them, by
+    // their occlusion in the frame drawn with ctx into zbuffer
+    void apply(const RenderContext& ctx, const std::vector<double>& zbuffer, TGAImage& framebuffer, const DirtyTiles* dirty = nullptr);
+
+private:
+    void resize(const int width, const int height);
+
+    int width = 0, height = 0; // occlusion buffer, the framebuffer's or half of it
+    int stride = 0;            // row length of the buffers, with a border of pad pixels on every side
+    std::vector<float> px, py, pz; // view-space positions, the border and the background far away
+    std::vector<float> occlusion, blurred;
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "tgaimage.h"
+
+enum StreamFormat { STREAM_RGB24, STREAM_RGBA };
+
+bool parse_stream_format(const std::string& name, StreamFormat& format); // "rgb24" or "rgba", as ffmpeg's -pix_fmt
+
+// Raw video output: frames of a fixed size go to stdout or a file/named pipe as headerless RGB24
+// or RGBA rows, top to bottom, for a consumer such as
+//   ffmpeg -f rawvideo -pix_fmt rgb24 -s 800x800 -r 60 -i - preview.mp4
+// push() converts the frame into one of max_queued preallocated buffers and returns; a dedicated
+// thread does the blocking writes. The renderer only waits once max_queued frames are queued
+// behind a slow consumer, and no frame is dropped. Streaming to stdout moves everything else
+// printed there to stderr.
+class FrameStream {
+public:
+    ~FrameStream() { close(); }
+    bool open(const std::string& path, const int width, const int height, const StreamFormat format, const int max_queued = 4); // "-" is stdout
+    bool push(const TGAImage& frame); // false once the consumer went away
+    void close();                     // writes the queued frames first
+    bool is_open() const { return file != nullptr; }
+
+private:
+    void writer();
+
+    std::FILE* file = nullptr;
+    int width = 0, height = 0;
+    StreamFormat format = STREAM_RGB24;
+    std::vector<std::vector<std::uint8_t>> buffers; // ring of frames, [head, head+count) are queued
+    int head = 0, count = 0;
+    bool closing = false, failed = false;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::thread thread;
+    long frames = 0, waits = 0; // frames pushed and pushes that found the queue full
+};
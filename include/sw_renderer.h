@@ -0,0 +1,182 @@
+#pragma once
+
+/* C interface of the renderer, for programs embedding the sw_renderer_core library; the
+ * sw_renderer program itself is a window and a command line on top of it.
+ *
+ * A renderer owns its models, camera, lights, settings and framebuffer, and shares nothing
+ * writable with other renderers: any number of them can render at the same time, each on its own
+ * thread. One renderer must not be used from two threads at once. A render runs on the calling
+ * thread; on the thread that started the rendering threads it is spread over the workers.
+ *
+ * Functions returning int return 1 on success and 0 on failure, after printing the reason to
+ * stderr. Positions and directions are in the object space of the models, before their rotation
+ * for the lights and after it for the camera, as in the viewer. */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct SwRenderer SwRenderer;
+
+typedef enum {
+    SW_MODE_PHONG,             /* Phong lighting with the selected shading */
+    SW_MODE_COLORED_TRIANGLES, /* one unlit colour per triangle */
+    SW_MODE_HEATMAP,           /* the Phong frame's fragment statistics as false colours */
+    SW_MODE_COUNT
+} SwMode;
+
+/* Features of the Phong shading, each model uses those its maps allow */
+typedef enum {
+    SW_SHADING_FLAT,
+    SW_SHADING_SMOOTH,
+    SW_SHADING_NORMAL_MAP,
+    SW_SHADING_COLOR_TEXTURE,
+    SW_SHADING_NORMAL_AND_COLOR,
+    SW_SHADING_COUNT
+} SwShading;
+
+/* Statistic shown by the heatmap mode */
+typedef enum {
+    SW_HEATMAP_DEPTH_TESTS, /* fragments depth-tested per pixel */
+    SW_HEATMAP_SHADED,      /* fragments shaded per pixel */
+    SW_HEATMAP_TILE_COST,   /* CPU time spent on the pixels of each tile */
+    SW_HEATMAP_VIEW_COUNT
+} SwHeatmapView;
+
+/* What a pixel shows */
+typedef struct {
+    int model;       /* index of the model, -1 = nothing */
+    int face;        /* triangle of the full detail mesh */
+    double bary[3];  /* barycentric coordinates of the hit in the triangle */
+    double uv[2];    /* texture coordinates of the hit */
+    double distance; /* from the camera */
+} SwHit;
+
+/* Rendering threads shared by all renderers, nthreads counting the calling thread (0 = one per
+ * hardware thread), pin binds thread i to core i. The calling thread becomes the host: its
+ * renders and model loads use the workers, and it ends its frames with sw_renderer_end_frame.
+ * Without threads everything runs on the calling thread. */
+void sw_renderer_start_threads(int nthreads, int pin);
+void sw_renderer_stop_threads(void);
+/* Ends a frame of the host: rewinds the frame arenas of all rendering threads and closes the
+ * profiler frame. Renders on other threads rewind their own arena. */
+void sw_renderer_end_frame(void);
+/* Per-stage timings of the frames as a Chrome trace and as CSV rows (NULL for none), fails
+ * unless built with SW_PROFILE */
+int sw_renderer_open_profile(const char* trace_filename, const char* csv_filename);
+void sw_renderer_close_profile(void);
+
+/* A renderer with a width x height framebuffer, the viewer's camera and light and no models, or
+ * NULL if the size is not positive. The models fill the middle 7/8 of the framebuffer. It
+ * renders Phong frames with all maps of the models at full size. */
+SwRenderer* sw_renderer_create(int width, int height);
+/* Waits for the pending image writes and closes the stream */
+void sw_renderer_destroy(SwRenderer* renderer);
+
+/* Levels of detail built for the models loaded next (default 4, 0 = none), textures kept
+ * block-compressed in memory, meshes stored quantized */
+void sw_renderer_set_load_options(SwRenderer* renderer, int lod_levels, int compress_textures, int quantize_meshes);
+/* Loads a Wavefront .obj model with optional tangent-space normal map and colour texture (.tga
+ * files, NULL for none). Returns the index of the model, or -1 when the mesh or a texture cannot
+ * be read. */
+int sw_renderer_load_model(SwRenderer* renderer, const char* obj, const char* normal_map, const char* color_texture);
+/* Starts loading a model and its optional maps and .anim animation in the background. The model
+ * joins the scene in sw_renderer_poll_models once its mesh is in, and is drawn untextured until
+ * its maps arrive. A file requested twice with the same load options is loaded once. */
+void sw_renderer_request_model(SwRenderer* renderer, const char* obj, const char* normal_map, const char* color_texture, const char* animation);
+/* Adds the finished loads to the scene, returns the number of requests still loading */
+int sw_renderer_poll_models(SwRenderer* renderer);
+int sw_renderer_model_count(const SwRenderer* renderer);
+
+/* Camera at eye looking at center, vertical field of view in degrees */
+void sw_renderer_set_camera(SwRenderer* renderer, const double eye[3], const double center[3], const double up[3], double fov_degrees);
+/* Rotation of the models about the x and then the y axis, in radians */
+void sw_renderer_set_rotation(SwRenderer* renderer, double angle_x, double angle_y);
+/* Seconds since the start of the animations, selects the pose of animated models */
+void sw_renderer_set_time(SwRenderer* renderer, double seconds);
+/* Moves the animation time forward while an animated model is in the scene */
+void sw_renderer_advance_time(SwRenderer* renderer, double seconds);
+void sw_renderer_set_background(SwRenderer* renderer, unsigned char r, unsigned char g, unsigned char b);
+
+/* Lights, colours in 0..1. A point light stops at range (0 = unbounded, no attenuation), a
+ * directional light shines from direction. A light ring is count coloured point lights of range
+ * 1 around the models. */
+void sw_renderer_clear_lights(SwRenderer* renderer);
+void sw_renderer_add_point_light(SwRenderer* renderer, const double position[3], const double color[3], double range);
+void sw_renderer_add_directional_light(SwRenderer* renderer, const double direction[3], const double color[3]);
+void sw_renderer_add_light_ring(SwRenderer* renderer, int count);
+
+void sw_renderer_set_mode(SwRenderer* renderer, SwMode mode);
+void sw_renderer_set_shading(SwRenderer* renderer, SwShading shading);
+void sw_renderer_set_heatmap_view(SwRenderer* renderer, SwHeatmapView view);
+const char* sw_renderer_heatmap_view_name(SwHeatmapView view);
+/* Value of the hottest colour of the last heatmap frame */
+double sw_renderer_heatmap_scale(const SwRenderer* renderer);
+/* Average on-screen area in pixels of the triangles of the selected level of detail (default 4,
+ * 0 = always full detail) */
+void sw_renderer_set_lod_area(SwRenderer* renderer, double pixels);
+/* Darkens the Phong frames and turntable views by their screen-space ambient occlusion, reaching
+ * radius model units, computed at full or half resolution */
+void sw_renderer_set_ssao(SwRenderer* renderer, int enabled, int half_resolution, double radius);
+
+/* The following only affect sw_renderer_update while the view moves. Temporal reuse takes the
+ * shading of the previous frame where the surface was already visible. A shading rate shades once
+ * per 2x2 or 4x4 block where the last frame's colour steps stayed within threshold levels (0 =
+ * off, ignored with temporal reuse). A frame budget lowers the render size of the moving frames
+ * to take about that many milliseconds (0 = full size, the default). */
+void sw_renderer_set_temporal_reuse(SwRenderer* renderer, int enabled);
+void sw_renderer_set_shading_rate(SwRenderer* renderer, double threshold);
+void sw_renderer_set_frame_budget(SwRenderer* renderer, double milliseconds);
+
+/* Renders a whole exact frame at full size in the current mode, fails without models */
+int sw_renderer_render(SwRenderer* renderer);
+/* Brings the framebuffer up to date for an interactive view and returns whether it changed: a
+ * frame after a change of the view or the settings, approximate and at the reduced size while
+ * the view keeps moving, then exact once it stops; the areas of the models that arrived or got
+ * a map since the last update; nothing otherwise. */
+int sw_renderer_update(SwRenderer* renderer);
+/* Milliseconds taken by the last frame and its render width over the framebuffer's */
+double sw_renderer_render_time(const SwRenderer* renderer);
+double sw_renderer_render_scale(const SwRenderer* renderer);
+/* What the pixel x, y (from the top left) of the framebuffer shows with the current view */
+int sw_renderer_pick(SwRenderer* renderer, int x, int y, SwHit* hit);
+
+/* Copies the last frame as width*height RGBA pixels, rows from the top. Fails when size (in
+ * bytes) is too small. */
+int sw_renderer_read_pixels(const SwRenderer* renderer, unsigned char* rgba, size_t size);
+int sw_renderer_width(const SwRenderer* renderer);
+int sw_renderer_height(const SwRenderer* renderer);
+
+/* File format of the written images: "tga" (the default), "qoi" or "png". An unknown name keeps
+ * the format and fails. */
+int sw_renderer_set_image_format(SwRenderer* renderer, const char* name);
+const char* sw_renderer_image_extension(const SwRenderer* renderer); /* ".tga", ".qoi" or ".png" */
+/* Saves the framebuffer, encoded and written in the background while rendering goes on */
+void sw_renderer_write_image(SwRenderer* renderer, const char* filename);
+/* Waits for the images being written, fails if any could not be */
+int sw_renderer_finish_writes(SwRenderer* renderer);
+
+/* Raw video output: frames of width x height as headerless "rgb24" or "rgba" rows (an unknown
+ * format streams rgb24), top to bottom, to a file, a named pipe or stdout ("-"), which then
+ * moves everything else printed there to stderr. The renderer runs at most max_queued frames
+ * ahead of the consumer. */
+int sw_renderer_open_stream(SwRenderer* renderer, const char* path, int width, int height, const char* format, int max_queued);
+/* Sends the framebuffer, fails and closes the stream once the consumer went away */
+int sw_renderer_stream_frame(SwRenderer* renderer);
+
+/* Turntables: nviews views of size x size pixels around the vertical axis, with all maps of the
+ * models and the current camera, lights and ambient occlusion. Animated models are posed at
+ * i/frame_rate seconds in view i. The views render at the same time and are written as
+ * turntable_NNN files in the image format, or with atlas as a single turntable sheet with the
+ * views in rows, first view top left. They fail without models. */
+int sw_renderer_turntable(SwRenderer* renderer, int nviews, int size, int atlas, double frame_rate);
+/* The same views one after the other to the stream, which is closed afterwards */
+int sw_renderer_stream_turntable(SwRenderer* renderer, int nviews, int size, double frame_rate);
+/* What the pixel x, y (from the top left) of each turntable view shows, into hits[nviews] */
+int sw_renderer_pick_turntable(SwRenderer* renderer, int nviews, int size, double frame_rate, int x, int y, SwHit* hits);
+
+#ifdef __cplusplus
+}
+#endif
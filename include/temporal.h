@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "geometry.h"
+#include "rasterizer.h"
+#include "tgaimage.h"
+
+// Shading of the previous frame, for the temporal mode of the viewer. The lights and the view
+// position live in object space, so the colour of a point of the surface does not change when
+// the model rotates: a fragment whose point was visible in the previous frame, on the same
+// triangle and at the same depth, takes the colour of the nearest pixel there instead of being
+// shaded. That colour was shaded up to half a pixel away from the point, so a pixel is shaded
+// again after at most max_age reuses in a row (staggered over the pixels so that the refreshes
+// do not all fall on the same frame).
+class TemporalCache {
+public:
+    static constexpr int max_age = 8;
+    static constexpr double depth_tolerance = 1e-3; // NDC
+
+    // Starts a frame of width x height pixels drawn with ctx and Model; without reuse (or after
+    // invalidate(), or when the size changed) every fragment is shaded, and only recorded
+    void begin_frame(const RenderContext& ctx, const mat<4,4>& Model, const int width, const int height, const bool reuse);
+    // Keeps the finished frame for the next one
+    void end_frame(const TGAImage& framebuffer, const std::vector<double>& zbuffer);
+    void invalidate() { valid = false; } // the previous frame no longer shows the current scene
+
+    // Records the fragment of triangle id (0 = never reused) at screen x,y with NDC depth z as the
+    // visible one so far, returns true with color set when the previous frame's colour applies.
+    // Called by the thread that owns the pixel's tile.
+    bool fetch(const int x, const int y, const double z, const std::uint32_t id, TGAColor& color) {
+        const int i = x + y*width;
+        ids[i] = id;
+        age[i] = (x ^ y) & 3;
+        if (!reusing || !id) return false;
+        const vec4 p = reprojection * vec4{double(x), double(y), z, 1.};
+        if (p.w <= 0) return false;
+        const double px = p.x/p.w + .5, py = p.y/p.w + .5; // nearest pixel, rounded by the casts below
+        if (px < 0 || py < 0 || px >= width || py >= height) return false;
+        const int j = int(px) + int(py)*width;
+        if (last_ids[j] != id || (last_age[j] & 0x7f) >= max_age || std::abs(last_depth[j] - p.z/p.w) > depth_tolerance) return false;
+        age[i] = ((last_age[j] & 0x7f) + 1) | 0x80;
+        for (int k : {0,1,2}) color[k] = last_color[j*3 + k];
+        color.bytespp = 3;
+        return true;
+    }
+
+private:
+    int width = 0, height = 0;
+    bool valid = false, reusing = false;
+    mat<4,4> screen;       // object space to screen of the current frame, homogeneous
+    mat<4,4> last_screen;
+    mat<4,4> reprojection; // current screen {x,y,z,1} to the previous frame's screen
+    std::vector<std::uint32_t> ids, last_ids; // visible triangle per pixel, 0 = none
+    std::vector<std::uint8_t> age, last_age;  // reuses in a row of the pixel's colour, top bit set when reused in that frame
+    std::vector<std::uint8_t> last_color;     // BGR
+    std::vector<float> last_depth;
+};
+
+// Wraps a shader to reuse the colours of the previous frame through a TemporalCache. The NDC depth
+// and the triangle id travel as two extra varyings, constant ids interpolate back to themselves.
+template<class Shader> struct TemporalShader {
+    static constexpr int nvaryings = Shader::nvaryings + 2;
+
+    const Shader& shader;
+    TemporalCache& cache;
+    std::uint32_t first_id; // id of face 0, 0 for a model that is never reused (animated)
+
+    vec4 vertex(const int iface, const int nthvert, vec<nvaryings>& varying) const {
+        vec<Shader::nvaryings> inner;
+        const vec4 clip = shader.vertex(iface, nthvert, inner);
+        for (int i=0; i<Shader::nvaryings; i++) varying[i] = inner[i];
+        varying[Shader::nvaryings] = clip.z / clip.w;
+        varying[Shader::nvaryings+1] = first_id ? first_id + iface : 0;
+        return clip;
+    }
+
+    void fragment(const int x, const int y, const vec<nvaryings>& varying, TGAColor& color) const {
+        if (cache.fetch(x, y, varying[Shader::nvaryings], std::uint32_t(varying[Shader::nvaryings+1] + .5), color)) return;
+        vec<Shader::nvaryings> inner;
+        for (int i=0; i<Shader::nvaryings; i++) inner[i] = varying[i];
+        shader.fragment(x, y, inner, color);
+    }
+};
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "tgaimage.h"
+
+enum TextureCompression {
+    TEXTURE_UNCOMPRESSED,
+    TEXTURE_BC1, // colour: two RGB565 endpoints and 2-bit indices, 8 bytes per 4x4 block
+    TEXTURE_BC5  // tangent-space normals: red and green as two BC4 channels, 16 bytes per block
+};
+
+// Texture sampled by the shaders. Compressed textures keep only the 4x4 blocks and decode a
+// whole block on first access into a small per-thread cache, so neighbouring fetches of the
+// same block cost a lookup.
+class Texture {
+public:
+    explicit Texture(TGAImage&& image, const TextureCompression compression = TEXTURE_UNCOMPRESSED);
+    int width()  const { return w; }
+    int height() const { return h; }
+    TextureCompression compression() const { return format; }
+    size_t size_bytes() const { return bytes; } // texel storage
+    TGAColor fetch(const int x, const int y) const; // BC5 returns red and green, with blue = 0
+private:
+    const std::uint8_t* decode_block(const int block) const; // 16 texels of 4 bytes, in the caller's thread cache
+    TextureCompression format;
+    int w, h;
+    int blocks_x = 0;
+    size_t bytes = 0;
+    TGAImage image = {};                  // uncompressed texels
+    std::vector<std::uint64_t> blocks = {}; // BC1: one word per block, BC5: red then green word
+    std::uint32_t id;                     // cache tag, unique per texture
+};
@@ -1,6 +1,6 @@
 #pragma once
 #include <cstdint>
-#include <fstream>
+#include <string>
 #include <vector>
 
 #pragma pack(push,1)
@@ -26,21 +26,31 @@ struct TGAColor {
     std::uint8_t& operator[](const int i) { return bgra[i]; }
 };
 
+struct TGAInfo {
+    int width = 0, height = 0, bpp = 0;
+};
+
 struct TGAImage {
     enum Format { GRAYSCALE=1, RGB=3, RGBA=4 };
     TGAImage() = default;
     TGAImage(const int w, const int h, const int bpp);
-    bool  read_tga_file(const std::string filename);
+    // Rows are stored top to bottom, or bottom to top when vflip is set
+    bool  read_tga_file(const std::string filename, const bool vflip=false);
     bool write_tga_file(const std::string filename, const bool vflip=true, const bool rle=true) const;
+    void encode_tga(std::vector<std::uint8_t> &bytes, const bool vflip=true, const bool rle=true) const; // appends the whole file
+    // Decoding into a caller-provided buffer of at least width*height*bpp bytes, no image is allocated
+    static bool read_tga_info(const std::string filename, TGAInfo &info);
+    static bool read_tga_file(const std::string filename, std::uint8_t *pixels, const size_t size, TGAInfo &info, const bool vflip=false);
     void flip_horizontally();
     void flip_vertically();
     TGAColor get(const int x, const int y) const;
     void set(const int x, const int y, const TGAColor &c);
     int width()  const;
     int height() const;
+    int bytespp() const;
+    const std::uint8_t *buffer() const; // width*height pixels of bytespp() bytes, BGR(A) order
+    std::uint8_t *buffer();
 private:
-    bool   load_rle_data(std::ifstream &in);
-    bool unload_rle_data(std::ofstream &out) const;
     int w = 0, h = 0;
     std::uint8_t bpp = 0;
     std::vector<std::uint8_t> data = {};
@@ -2,14 +2,17 @@
 #include <vector>
 #include "tgaimage.h"
 
-enum ViewerKey { ViewerKey_Left, ViewerKey_Right, ViewerKey_Up, ViewerKey_Down, ViewerKey_Space, ViewerKey_S };
+enum ViewerKey { ViewerKey_Left, ViewerKey_Right, ViewerKey_Up, ViewerKey_Down, ViewerKey_Space, ViewerKey_S, ViewerKey_H, ViewerKey_E };
 
 bool viewer_init(int width, int height, const char* title);
 bool viewer_should_close();
 bool viewer_key_down(ViewerKey key);
+bool viewer_mouse_clicked(int& x, int& y); // left button pressed since the last call, window pixel from the top left
 void viewer_present_from_tga(const TGAImage &img, std::vector<unsigned char> &rgbaScratch);
-void viewer_present_with_timing(const TGAImage &img, std::vector<unsigned char> &rgbaScratch, 
-                                double render_time_ms, double angleX, double angleY, const char* mode_name, const char* shading_name, const char* normal_mapping_status);
+void viewer_present_with_timing(const std::vector<unsigned char> &rgba, // window-sized RGBA rows from the top
+                                double render_time_ms, double angleX, double angleY, const char* mode_name, const char* shading_name, const char* normal_mapping_status,
+                                double render_scale = 1,    // render width over window width, shown when below 1
+                                bool image_changed = true); // false redraws the previous image, only the text is updated
 void viewer_shutdown();
 
 
@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include "animation.h"
+#include "model.h"
+#include "scheduler.h"
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define SKIN_SSE
+#endif
+
+// Fields are read with memcpy, the file is little-endian like the platforms the renderer targets
+template<class T> static bool read_value(const std::vector<char>& bytes, size_t& offset, T& value) {
+    if (offset + sizeof(T) > bytes.size()) return false;
+    std::memcpy(&value, bytes.data() + offset, sizeof(T));
+    offset += sizeof(T);
+    return true;
+}
+
+bool Animation::load(const std::string& filename) {
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
+    if (!in.is_open()) {
+        std::cerr << "can't open file " << filename << std::endl;
+        return false;
+    }
+    const std::streamoff size = in.tellg();
+    in.seekg(0);
+    if (size < 0 || in.peek() == EOF) { // a directory opens, but its size is bogus and reading it fails
+        std::cerr << "can't read file " << filename << std::endl;
+        return false;
+    }
+    std::vector<char> bytes(size);
+    in.read(bytes.data(), bytes.size());
+
+    size_t offset = 4;
+    std::uint32_t version = 0, nverts = 0, njoints = 0, nframes = 0;
+    float frame_rate = 0;
+    if (bytes.size() < 4 || std::memcmp(bytes.data(), "SWAN", 4) || !read_value(bytes, offset, version) || version != 1
+        || !read_value(bytes, offset, nverts) || !read_value(bytes, offset, njoints) || !read_value(bytes, offset, nframes)
+        || !read_value(bytes, offset, frame_rate)) {
+        std::cerr << filename << " is not a version 1 animation" << std::endl;
+        return false;
+    }
+    if (!njoints || njoints > 256 || !nframes || !(frame_rate > 0)
+        || bytes.size() - offset != nverts*(size_t)20 + size_t(nframes)*njoints*12*sizeof(float)) {
+        std::cerr << "malformed animation " << filename << std::endl;
+        return false;
+    }
+
+    std::vector<Influence> in_influences(nverts);
+    for (Influence& v : in_influences) {
+        for (std::uint8_t& j : v.joint) read_value(bytes, offset, j);
+        float sum = 0;
+        for (float& w : v.weight) {
+            read_value(bytes, offset, w);
+            if (!(w >= 0)) w = 0;
+            sum += w;
+        }
+        for (int k=0; k<4; k++) {
+            if (v.joint[k] >= njoints) {
+                std::cerr << "joint index out of range in " << filename << std::endl;
+                return false;
+            }
+            v.weight[k] = sum > 0 ? v.weight[k]/sum : k == 0; // unweighted vertices follow their first joint
+        }
+    }
+    // Rows of the file to the padded columns of the palette
+    std::vector<float> in_matrices(size_t(nframes)*njoints*16, 0.f);
+    for (size_t m=0; m<size_t(nframes)*njoints; m++)
+        for (int row=0; row<3; row++)
+            for (int col=0; col<4; col++)
+                read_value(bytes, offset, in_matrices[m*16 + col*4 + row]);
+
+    influences = std::move(in_influences);
+    matrices = std::move(in_matrices);
+    joints = njoints;
+    frames = nframes;
+    rate = frame_rate;
+    std::cerr << "Animation loaded: " << filename << ", " << joints << " joints, " << frames << " frames at " << rate << " fps" << std::endl;
+    return true;
+}
+
+void Animation::palette(const double time, FrameVector<float>& out) const {
+    const double t = std::fmod(time*rate, frames);
+    const int f0 = std::clamp(int(std::floor(t < 0 ? t + frames : t)), 0, frames-1), f1 = (f0 + 1) % frames;
+    const float a = float((t < 0 ? t + frames : t) - f0);
+    const float* m0 = matrices.data() + size_t(f0)*joints*16;
+    const float* m1 = matrices.data() + size_t(f1)*joints*16;
+    out.resize(size_t(joints)*16);
+    // Blending the matrices is not a rotation interpolation, but frames are close enough for it not to show
+    for (size_t i=0; i<out.size(); i++) out[i] = m0[i] + (m1[i] - m0[i])*a;
+}
+
+// Weighted sum of the joint matrices of the vertex applied to its bind position, each matrix
+// column being one 4-wide register
+static vec3 skin_vertex(const float* palette, const float weight[4], const std::uint8_t joint[4], const vec3& p) {
+#ifdef SKIN_SSE
+    const __m128 x = _mm_set1_ps(float(p.x)), y = _mm_set1_ps(float(p.y)), z = _mm_set1_ps(float(p.z));
+    __m128 sum = _mm_setzero_ps();
+    for (int k=0; k<4; k++) {
+        if (weight[k] == 0) continue;
+        const float* m = palette + joint[k]*16;
+        const __m128 t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(m), x), _mm_mul_ps(_mm_loadu_ps(m+4), y)),
+                                    _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(m+8), z), _mm_loadu_ps(m+12)));
+        sum = _mm_add_ps(sum, _mm_mul_ps(t, _mm_set1_ps(weight[k])));
+    }
+    float r[4];
+    _mm_storeu_ps(r, sum);
+    return {r[0], r[1], r[2]};
+#else
+    float r[3] = {0, 0, 0};
+    for (int k=0; k<4; k++) {
+        if (weight[k] == 0) continue;
+        const float* m = palette + joint[k]*16;
+        for (int i=0; i<3; i++)
+            r[i] += weight[k]*(m[i]*float(p.x) + m[4+i]*float(p.y) + m[8+i]*float(p.z) + m[12+i]);
+    }
+    return {r[0], r[1], r[2]};
+#endif
+}
+
+void Animation::skin(const Model& model, const FrameVector<float>& palette, FrameVector<vec3>& out) const {
+    out.resize(influences.size());
+    scheduler.parallel_for(0, influences.size(), 1024, [&](const int first, const int last) {
+        for (int i=first; i<last; i++)
+            out[i] = skin_vertex(palette.data(), influences[i].weight, influences[i].joint, model.vert(i));
+    });
+}
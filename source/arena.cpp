@@ -0,0 +1,71 @@
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include "arena.h"
+
+void* Arena::allocate(const std::size_t bytes, const std::size_t align) {
+    const std::uintptr_t base = reinterpret_cast<std::uintptr_t>(block.get());
+    const std::size_t start = ((base + offset + align - 1) & ~std::uintptr_t(align - 1)) - base;
+    if (block && start + bytes <= size) {
+        offset = start + bytes;
+        return block.get() + start;
+    }
+    overflow.emplace_back(new char[bytes + align]);
+    overflow_bytes += bytes + align;
+    const std::uintptr_t p = reinterpret_cast<std::uintptr_t>(overflow.back().get());
+    return reinterpret_cast<void*>((p + align - 1) & ~std::uintptr_t(align - 1));
+}
+
+void Arena::reset() {
+    if (!overflow.empty()) { // grow to the next power of two above this frame's needs
+        std::size_t grown = std::max<std::size_t>(size, 1 << 16);
+        while (grown < used()) grown *= 2;
+        overflow.clear();
+        overflow_bytes = 0;
+        block.reset(new char[grown]);
+        size = grown;
+    }
+    offset = 0;
+}
+
+// Shared arenas of the live threads, a thread's arena leaves the list when the thread exits
+static std::mutex g_arenas_mutex;
+static std::vector<Arena*> g_arenas;
+
+namespace {
+struct ThreadArena {
+    Arena arena;
+    bool shared = false;
+    ~ThreadArena() {
+        if (!shared) return;
+        std::lock_guard<std::mutex> lock(g_arenas_mutex);
+        g_arenas.erase(std::find(g_arenas.begin(), g_arenas.end(), &arena));
+    }
+};
+thread_local ThreadArena thread_arena;
+}
+
+Arena& frame_arena() {
+    return thread_arena.arena;
+}
+
+void frame_arena_share() {
+    if (thread_arena.shared) return;
+    std::lock_guard<std::mutex> lock(g_arenas_mutex);
+    g_arenas.push_back(&thread_arena.arena);
+    thread_arena.shared = true;
+}
+
+std::size_t frame_arena_reset() {
+    std::size_t bytes = 0;
+    if (!thread_arena.shared) {
+        bytes += thread_arena.arena.used();
+        thread_arena.arena.reset();
+    }
+    std::lock_guard<std::mutex> lock(g_arenas_mutex);
+    for (Arena* arena : g_arenas) {
+        bytes += arena->used();
+        arena->reset();
+    }
+    return bytes;
+}
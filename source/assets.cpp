@@ -0,0 +1,58 @@
+#include <iostream>
+#include "assets.h"
+#include "scheduler.h"
+
+AssetLoader::MeshFuture AssetLoader::load_mesh(const std::string& filename, const int lod_levels, const bool quantize) {
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto key = std::make_tuple(filename, lod_levels, quantize);
+    auto it = meshes.find(key);
+    if (it != meshes.end()) return it->second;
+    return meshes[key] = scheduler.background<std::shared_ptr<const Model>>([filename, lod_levels, quantize]() -> std::shared_ptr<const Model> {
+        auto model = std::make_shared<Model>(filename);
+        if (!model->nfaces()) {
+            std::cerr << "Failed to load model: " << filename << std::endl;
+            return nullptr;
+        }
+        model->build_lods(lod_levels);
+        if (quantize) {
+            const size_t full = model->size_bytes();
+            model->quantize();
+            std::cerr << filename << " quantized: " << full/1024 << " KB -> " << model->size_bytes()/1024 << " KB" << std::endl;
+        }
+        model->build_bvh();
+        return model;
+    });
+}
+
+AssetLoader::TextureFuture AssetLoader::load_texture(const std::string& filename, const TextureCompression compression) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = textures.find({filename, compression});
+    if (it != textures.end()) return it->second;
+    return textures[{filename, compression}] = scheduler.background<std::shared_ptr<const Texture>>([filename, compression]() -> std::shared_ptr<const Texture> {
+        TGAImage image;
+        if (!image.read_tga_file(filename, true)) { // bottom to top, as sampled by Model
+            std::cerr << "Failed to load texture: " << filename << std::endl;
+            return nullptr;
+        }
+        const size_t uncompressed = size_t(image.width())*image.height()*image.get(0, 0).bytespp;
+        auto texture = std::make_shared<const Texture>(std::move(image), compression);
+        if (compression != TEXTURE_UNCOMPRESSED)
+            std::cerr << filename << " compressed to " << (compression == TEXTURE_BC1 ? "BC1" : "BC5") << ": "
+                      << uncompressed/1024 << " KB -> " << texture->size_bytes()/1024 << " KB" << std::endl;
+        return texture;
+    });
+}
+
+AssetLoader::AnimationFuture AssetLoader::load_animation(const std::string& filename) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = animations.find(filename);
+    if (it != animations.end()) return it->second;
+    return animations[filename] = scheduler.background<std::shared_ptr<const Animation>>([filename]() -> std::shared_ptr<const Animation> {
+        auto animation = std::make_shared<Animation>();
+        if (!animation->load(filename)) {
+            std::cerr << "Failed to load animation: " << filename << std::endl;
+            return nullptr;
+        }
+        return animation;
+    });
+}
@@ -0,0 +1,266 @@
+#include <atomic>
+#include <cmath>
+#include "bvh.h"
+#include "model.h"
+#include "rasterizer.h"
+#include "scheduler.h"
+
+struct Box {
+    vec3 lo = {std::numeric_limits<double>::max(), std::numeric_limits<double>::max(), std::numeric_limits<double>::max()};
+    vec3 hi = {-std::numeric_limits<double>::max(), -std::numeric_limits<double>::max(), -std::numeric_limits<double>::max()};
+    void grow(const vec3& p) {
+        for (int k : {0,1,2}) {
+            lo[k] = std::min(lo[k], p[k]);
+            hi[k] = std::max(hi[k], p[k]);
+        }
+    }
+    void grow(const Box& b) { grow(b.lo); grow(b.hi); }
+    double area() const {
+        const vec3 d = hi - lo;
+        return d.x < 0 ? 0 : 2*(d.x*d.y + d.y*d.z + d.z*d.x);
+    }
+};
+
+struct BuildState {
+    const std::vector<Box>& boxes;   // per triangle
+    const std::vector<vec3>& centroids;
+    std::vector<int>& faces;
+    std::atomic<int>& used;          // nodes allocated so far
+};
+
+static constexpr int nbins = 16;
+static constexpr int max_leaf = 8;
+static constexpr int max_depth = 48;        // deeper subtrees are split at the median, well within the traversal stack
+static constexpr int parallel_faces = 4096; // smaller subtrees are built by the thread that split their parent
+
+static vec3 corner(const Model& model, const vec3* positions, const int face, const int k) {
+    return positions ? positions[model.get_vertex_index(face, k)] : model.vert(face, k);
+}
+
+static Box face_box(const Model& model, const vec3* positions, const int face) {
+    Box b;
+    for (int k : {0,1,2}) b.grow(corner(model, positions, face, k));
+    return b;
+}
+
+// Float bounds rounded outwards, so that the boxes still contain the double precision triangles
+template<class Node> static void set_bounds(Node& node, const Box& b) {
+    for (int k : {0,1,2}) {
+        node.lo[k] = float(b.lo[k]);
+        node.hi[k] = float(b.hi[k]);
+        if (node.lo[k] > b.lo[k]) node.lo[k] = std::nextafter(node.lo[k], -std::numeric_limits<float>::infinity());
+        if (node.hi[k] < b.hi[k]) node.hi[k] = std::nextafter(node.hi[k], std::numeric_limits<float>::infinity());
+    }
+}
+
+template<class Node>
+static void build_node(BuildState& state, std::vector<Node>& nodes, const int index, const int first, const int last, const int depth) {
+    Box bounds, centroid_bounds;
+    for (int i=first; i<last; i++) {
+        bounds.grow(state.boxes[state.faces[i]]);
+        centroid_bounds.grow(state.centroids[state.faces[i]]);
+    }
+    Node& node = nodes[index];
+    set_bounds(node, bounds);
+    node.first = first;
+    node.count = last - first;
+    if (node.count <= 2) return;
+
+    // Binned SAH over the three axes: cost of a split relative to intersecting every triangle here
+    int best_axis = -1, best_bin = 0;
+    double best_cost = std::numeric_limits<double>::max();
+    if (depth < max_depth)
+        for (int axis : {0,1,2}) {
+            const double lo = centroid_bounds.lo[axis], extent = centroid_bounds.hi[axis] - lo;
+            if (extent <= 0) continue;
+            Box bin_box[nbins];
+            int bin_count[nbins] = {};
+            for (int i=first; i<last; i++) {
+                const int f = state.faces[i];
+                const int b = std::min(nbins-1, int((state.centroids[f][axis] - lo) / extent * nbins));
+                bin_box[b].grow(state.boxes[f]);
+                bin_count[b]++;
+            }
+            double right_area[nbins];
+            int right_count[nbins];
+            Box right;
+            for (int b=nbins-1, n=0; b>0; b--) {
+                right.grow(bin_box[b]);
+                n += bin_count[b];
+                right_area[b] = right.area();
+                right_count[b] = n;
+            }
+            Box left;
+            for (int b=1, n=0; b<nbins; b++) { // split between bins b-1 and b
+                left.grow(bin_box[b-1]);
+                n += bin_count[b-1];
+                if (!n || !right_count[b]) continue;
+                const double cost = left.area()*n + right_area[b]*right_count[b];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = b;
+                }
+            }
+        }
+
+    const double leaf_cost = node.count, split_cost = 1 + best_cost / std::max(bounds.area(), 1e-300);
+    if (node.count <= max_leaf && (best_axis < 0 || leaf_cost <= split_cost)) return;
+
+    int mid = (first + last) / 2; // identical centroids or too deep: split the list in half
+    if (best_axis >= 0) {
+        const double lo = centroid_bounds.lo[best_axis], extent = centroid_bounds.hi[best_axis] - lo;
+        mid = std::partition(state.faces.begin()+first, state.faces.begin()+last, [&](const int f) {
+            return std::min(nbins-1, int((state.centroids[f][best_axis] - lo) / extent * nbins)) < best_bin;
+        }) - state.faces.begin();
+    }
+    const int children = state.used.fetch_add(2);
+    node.first = children;
+    node.count = 0;
+    const int ranges[2][2] = {{first, mid}, {mid, last}};
+    if (last - first > parallel_faces) {
+        scheduler.parallel_for(0, 2, 1, [&](const int a, const int b) {
+            for (int c=a; c<b; c++) build_node(state, nodes, children+c, ranges[c][0], ranges[c][1], depth+1);
+        });
+    } else {
+        for (int c : {0,1}) build_node(state, nodes, children+c, ranges[c][0], ranges[c][1], depth+1);
+    }
+}
+
+void BVH::build(const Model& model, const vec3* positions) {
+    const int n = model.nfaces();
+    nodes.clear();
+    faces.resize(n);
+    if (!n) return;
+    std::vector<Box> boxes(n);
+    std::vector<vec3> centroids(n);
+    scheduler.parallel_for(0, n, 1024, [&](const int first, const int last) {
+        for (int f=first; f<last; f++) {
+            boxes[f] = face_box(model, positions, f);
+            centroids[f] = (boxes[f].lo + boxes[f].hi) / 2.;
+            faces[f] = f;
+        }
+    });
+    nodes.resize(2*n - 1); // a binary tree with at most n leaves
+    std::atomic<int> used{1};
+    BuildState state = {boxes, centroids, faces, used};
+    build_node(state, nodes, 0, 0, n, 0);
+    nodes.resize(used);
+    nodes.shrink_to_fit();
+}
+
+void BVH::refit(const Model& model, const vec3* positions) {
+    scheduler.parallel_for(0, nodes.size(), 1024, [&](const int first, const int last) {
+        for (int i=first; i<last; i++) {
+            if (!nodes[i].count) continue;
+            Box b;
+            for (int k=nodes[i].first; k<nodes[i].first+nodes[i].count; k++) b.grow(face_box(model, positions, faces[k]));
+            set_bounds(nodes[i], b);
+        }
+    });
+    // Children come after their parent: a backward sweep sees them updated
+    for (int i=nodes.size()-1; i>=0; i--) {
+        Node& node = nodes[i];
+        if (node.count) continue;
+        const Node& a = nodes[node.first];
+        const Node& b = nodes[node.first+1];
+        for (int k : {0,1,2}) {
+            node.lo[k] = std::min(a.lo[k], b.lo[k]);
+            node.hi[k] = std::max(a.hi[k], b.hi[k]);
+        }
+    }
+}
+
+// Slab test, tnear is where the ray enters the box
+template<class Node> static bool hit_box(const Node& node, const float origin[3], const float inv_dir[3], const float tmax, float& tnear) {
+    float t0 = 0, t1 = tmax;
+    for (int k : {0,1,2}) {
+        float a = (node.lo[k] - origin[k]) * inv_dir[k];
+        float b = (node.hi[k] - origin[k]) * inv_dir[k];
+        if (a > b) std::swap(a, b);
+        b *= 1.0000004f; // covers the rounding of the float operations, so that no ray slips between two boxes
+        t0 = a > t0 ? a : t0; // NaN (origin on a slab of a flat box) keeps the previous bound
+        t1 = b < t1 ? b : t1;
+    }
+    tnear = t0;
+    return t0 <= t1;
+}
+
+bool BVH::intersect(const Model& model, const vec3& origin, const vec3& dir, RayHit& hit, const vec3* positions) const {
+    if (nodes.empty()) return false;
+    const float org[3] = {float(origin.x), float(origin.y), float(origin.z)};
+    const float inv_dir[3] = {1/float(dir.x), 1/float(dir.y), 1/float(dir.z)};
+    const auto tmax = [&hit] { return hit.t < std::numeric_limits<float>::max() ? std::nextafter(float(hit.t), std::numeric_limits<float>::infinity()) : std::numeric_limits<float>::max(); };
+    struct Entry { int node; float tnear; };
+    Entry stack[128]; // one entry per level at most, plus the sibling
+    int top = 0;
+    float tnear;
+    if (hit_box(nodes[0], org, inv_dir, tmax(), tnear)) stack[top++] = {0, tnear};
+    int found = -1;
+    while (top) {
+        const Entry e = stack[--top];
+        if (e.tnear > tmax()) continue; // a closer hit was found since it was pushed
+        const Node& node = nodes[e.node];
+        if (!node.count) {
+            float t[2];
+            const bool h0 = hit_box(nodes[node.first], org, inv_dir, tmax(), t[0]);
+            const bool h1 = hit_box(nodes[node.first+1], org, inv_dir, tmax(), t[1]);
+            const int near = h1 && (!h0 || t[1] < t[0]); // the nearer child is visited first
+            if (near == 0 ? h1 : h0) stack[top++] = {node.first + 1-near, t[1-near]};
+            if (near == 0 ? h0 : h1) stack[top++] = {node.first + near, t[near]};
+            continue;
+        }
+        // Moller-Trumbore, both sides of the triangles
+        for (int k=node.first; k<node.first+node.count; k++) {
+            const int f = faces[k];
+            const vec3 v0 = corner(model, positions, f, 0);
+            const vec3 e1 = corner(model, positions, f, 1) - v0, e2 = corner(model, positions, f, 2) - v0;
+            const vec3 p = cross(dir, e2);
+            const double det = e1*p;
+            if (det == 0) continue;
+            const vec3 s = origin - v0;
+            const double u = (s*p) / det;
+            if (u < 0 || u > 1) continue;
+            const vec3 q = cross(s, e1);
+            const double v = (dir*q) / det;
+            if (v < 0 || u + v > 1) continue;
+            const double t = (e2*q) / det;
+            if (t <= 0 || t >= hit.t) continue;
+            hit.t = t;
+            hit.bary = {1-u-v, u, v};
+            found = f;
+        }
+    }
+    if (found < 0) return false;
+    hit.face = found;
+    hit.uv = model.tex_coord(found, 0)*hit.bary.x + model.tex_coord(found, 1)*hit.bary.y + model.tex_coord(found, 2)*hit.bary.z;
+    return true;
+}
+
+bool raycast(const RenderContext& ctx, const std::vector<Model>& models, const vec3& origin, const vec3& dir, RayHit& hit) {
+    bool found = false;
+    for (size_t m=0; m<models.size(); m++) {
+        const Model& model = models[m];
+        bool model_hit;
+        if (model.animation()) {
+            const FrameVector<vec3> posed = pose_vertices(ctx, model);
+            BVH bvh = model.bvh();
+            bvh.refit(model, posed.data());
+            model_hit = bvh.intersect(model, origin, dir, hit, posed.data());
+        } else {
+            model_hit = model.bvh().intersect(model, origin, dir, hit);
+        }
+        if (model_hit) hit.model = m;
+        found |= model_hit;
+    }
+    return found;
+}
+
+bool pick(const RenderContext& ctx, const std::vector<Model>& models, const mat<4,4>& Model, const double x, const double y, RayHit& hit) {
+    // From the centre of projection (see ClusterCuller) through the point of the pixel at w = 1
+    const mat<4,4> MVP = ctx.MVP(Model);
+    mat<3,3> A = {{{MVP[0][0], MVP[0][1], MVP[0][2]}, {MVP[1][0], MVP[1][1], MVP[1][2]}, {MVP[3][0], MVP[3][1], MVP[3][2]}}};
+    const vec3 eye = A.invert() * vec3{-MVP[0][3], -MVP[1][3], -MVP[3][3]};
+    const vec4 p = affine_product(ctx.Viewport, MVP).invert() * vec4{x, y, 0, 1};
+    return raycast(ctx, models, eye, vec3{p.x, p.y, p.z}/p.w - eye, hit);
+}
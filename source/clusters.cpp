@@ -0,0 +1,85 @@
+#include <algorithm>
+#include <cmath>
+#include "model.h"
+
+// Greedy region growing over the faces sharing a vertex: each cluster starts from the first
+// unassigned face and keeps adding the neighbouring face whose normal is closest to the
+// cluster's average normal, which keeps both the bounding spheres and the normal cones tight.
+// A cluster also stops growing when its best candidate is more than ~45 degrees off its axis:
+// smaller clusters with narrow cones are rejected far more often than full but wide ones.
+void Model::build_clusters(const int max_faces) {
+    const int nf = nfaces();
+    face_clusters.clear();
+    if (!nf) return;
+
+    std::vector<vec3> face_normal(nf);
+    std::vector<std::vector<int>> vert_faces(nverts());
+    for (int f=0; f<nf; f++) {
+        vec3 n = cross(vert(f, 1) - vert(f, 0), vert(f, 2) - vert(f, 0));
+        face_normal[f] = norm(n) > 0 ? normalized(n) : n;
+        for (int k : {0,1,2}) vert_faces[facet_vrt[f*3+k]].push_back(f);
+    }
+
+    std::vector<bool> assigned(nf, false);
+    std::vector<int> order;          // faces in cluster order
+    std::vector<int> frontier;
+    order.reserve(nf);
+    for (int seed=0; seed<nf; seed++) {
+        if (assigned[seed]) continue;
+        Cluster cluster;
+        cluster.first_face = order.size();
+        vec3 normal_sum = {0, 0, 0};
+        frontier.assign(1, seed);
+        while (!frontier.empty() && cluster.nfaces<max_faces) {
+            int best = 0;
+            const vec3 axis = norm(normal_sum) > 0 ? normalized(normal_sum) : normal_sum;
+            for (int i=1; i<(int)frontier.size(); i++)
+                if (face_normal[frontier[i]]*axis > face_normal[frontier[best]]*axis) best = i;
+            if (cluster.nfaces && face_normal[frontier[best]]*axis < .7) break;
+            const int f = frontier[best];
+            frontier[best] = frontier.back();
+            frontier.pop_back();
+            if (assigned[f]) continue;
+            assigned[f] = true;
+            order.push_back(f);
+            cluster.nfaces++;
+            normal_sum = normal_sum + face_normal[f];
+            for (int k : {0,1,2})
+                for (const int g : vert_faces[facet_vrt[f*3+k]])
+                    if (!assigned[g] && std::find(frontier.begin(), frontier.end(), g)==frontier.end()) frontier.push_back(g);
+        }
+
+        // Bounding sphere centred on the bounding box of the corners
+        vec3 lo = vert(order[cluster.first_face], 0), hi = lo;
+        for (int i=cluster.first_face; i<(int)order.size(); i++)
+            for (int k : {0,1,2})
+                for (int d : {0,1,2}) {
+                    lo[d] = std::min(lo[d], vert(order[i], k)[d]);
+                    hi[d] = std::max(hi[d], vert(order[i], k)[d]);
+                }
+        cluster.center = (lo + hi) / 2.;
+        for (int i=cluster.first_face; i<(int)order.size(); i++)
+            for (int k : {0,1,2})
+                cluster.radius = std::max(cluster.radius, norm(vert(order[i], k) - cluster.center));
+
+        // Normal cone, too wide cones (or degenerate clusters) keep cone_cutoff = 1 and are never cone culled
+        if (norm(normal_sum) > 0) {
+            cluster.cone_axis = normalized(normal_sum);
+            double min_dot = 1;
+            for (int i=cluster.first_face; i<(int)order.size(); i++)
+                min_dot = std::min(min_dot, face_normal[order[i]]*cluster.cone_axis);
+            if (min_dot > 0.1) cluster.cone_cutoff = std::sqrt(1 - min_dot*min_dot);
+        }
+        face_clusters.push_back(cluster);
+    }
+
+    // Reorder the faces to make the clusters contiguous
+    std::vector<int> vrt(nf*3), tex(nf*3);
+    for (int i=0; i<nf; i++)
+        for (int k : {0,1,2}) {
+            vrt[i*3+k] = facet_vrt[order[i]*3+k];
+            tex[i*3+k] = facet_tex[order[i]*3+k];
+        }
+    facet_vrt.swap(vrt);
+    facet_tex.swap(tex);
+}
@@ -0,0 +1,621 @@
+#include "encoder.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include "scheduler.h"
+
+bool parse_image_format(const std::string& name, ImageFormat& format) {
+    if (name == "tga") format = IMAGE_TGA;
+    else if (name == "qoi") format = IMAGE_QOI;
+    else if (name == "png") format = IMAGE_PNG;
+    else return false;
+    return true;
+}
+
+const char* image_format_extension(const ImageFormat format) {
+    switch (format) {
+        case IMAGE_QOI: return ".qoi";
+        case IMAGE_PNG: return ".png";
+        default:        return ".tga";
+    }
+}
+
+static void put_u32_be(std::vector<std::uint8_t>& bytes, const std::uint32_t v) {
+    bytes.push_back(v >> 24); bytes.push_back(v >> 16); bytes.push_back(v >> 8); bytes.push_back(v);
+}
+
+// Pixel row y of the picture, counted from the top
+static const std::uint8_t* image_row(const TGAImage& img, const int y, const bool vflip) {
+    return img.buffer() + size_t(vflip ? img.height()-1-y : y) * img.width() * img.bytespp();
+}
+
+// Converts a row from BGR(A) to the RGB(A) order of QOI and PNG
+static void row_to_rgb(const std::uint8_t* src, std::uint8_t* dst, const int width, const int bpp) {
+    if (bpp < 3) {
+        std::memcpy(dst, src, width);
+        return;
+    }
+    for (int x=0; x<width; x++, src+=bpp, dst+=bpp) {
+        dst[0] = src[2]; dst[1] = src[1]; dst[2] = src[0];
+        if (bpp == 4) dst[3] = src[3];
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// QOI, see https://qoiformat.org/qoi-specification.pdf
+
+void encode_qoi(const TGAImage& img, std::vector<std::uint8_t>& bytes, const bool vflip) {
+    const int w = img.width(), h = img.height(), bpp = img.bytespp();
+    const int channels = bpp==4 ? 4 : 3;
+    bytes.reserve(bytes.size() + 22 + size_t(w)*h*(channels+1)/2);
+    bytes.insert(bytes.end(), {'q', 'o', 'i', 'f'});
+    put_u32_be(bytes, w);
+    put_u32_be(bytes, h);
+    bytes.push_back(channels);
+    bytes.push_back(0); // sRGB with linear alpha
+
+    std::uint8_t index[64][4] = {};
+    std::uint8_t prev[4] = {0, 0, 0, 255};
+    int run = 0;
+    for (int y=0; y<h; y++) {
+        const std::uint8_t* row = image_row(img, y, vflip);
+        for (int x=0; x<w; x++, row+=bpp) {
+            std::uint8_t px[4];
+            if (bpp == 1) px[0] = px[1] = px[2] = row[0];
+            else { px[0] = row[2]; px[1] = row[1]; px[2] = row[0]; }
+            px[3] = bpp==4 ? row[3] : 255;
+            const bool last = y==h-1 && x==w-1;
+
+            if (std::memcmp(px, prev, 4) == 0) {
+                if (++run == 62 || last) {
+                    bytes.push_back(0xc0 | (run-1)); // QOI_OP_RUN
+                    run = 0;
+                }
+                continue;
+            }
+            if (run) {
+                bytes.push_back(0xc0 | (run-1));
+                run = 0;
+            }
+            const int hash = (px[0]*3 + px[1]*5 + px[2]*7 + px[3]*11) % 64;
+            if (std::memcmp(index[hash], px, 4) == 0) {
+                bytes.push_back(hash); // QOI_OP_INDEX
+            } else {
+                std::memcpy(index[hash], px, 4);
+                if (px[3] == prev[3]) {
+                    const int dr = std::int8_t(px[0]-prev[0]), dg = std::int8_t(px[1]-prev[1]), db = std::int8_t(px[2]-prev[2]);
+                    const int dr_dg = dr-dg, db_dg = db-dg;
+                    if (dr>=-2 && dr<=1 && dg>=-2 && dg<=1 && db>=-2 && db<=1) {
+                        bytes.push_back(0x40 | (dr+2)<<4 | (dg+2)<<2 | (db+2)); // QOI_OP_DIFF
+                    } else if (dg>=-32 && dg<=31 && dr_dg>=-8 && dr_dg<=7 && db_dg>=-8 && db_dg<=7) {
+                        bytes.push_back(0x80 | (dg+32)); // QOI_OP_LUMA
+                        bytes.push_back((dr_dg+8)<<4 | (db_dg+8));
+                    } else {
+                        bytes.insert(bytes.end(), {0xfe, px[0], px[1], px[2]}); // QOI_OP_RGB
+                    }
+                } else {
+                    bytes.insert(bytes.end(), {0xff, px[0], px[1], px[2], px[3]}); // QOI_OP_RGBA
+                }
+            }
+            std::memcpy(prev, px, 4);
+        }
+    }
+    bytes.insert(bytes.end(), {0, 0, 0, 0, 0, 0, 0, 1});
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// PNG. The rows are cut into bands that are filtered and deflated independently, each one ending
+// on a byte boundary, so that the compressed bands simply follow each other in the zlib stream.
+// Matches do not reach across bands, which costs little on bands of this size.
+
+static const std::uint32_t* crc_table() {
+    static const auto table = [] {
+        std::vector<std::uint32_t> t(256);
+        for (std::uint32_t n=0; n<256; n++) {
+            std::uint32_t c = n;
+            for (int k=0; k<8; k++) c = c&1 ? 0xedb88320u ^ (c>>1) : c>>1;
+            t[n] = c;
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+static std::uint32_t crc32(std::uint32_t crc, const std::uint8_t* p, const size_t n) {
+    const std::uint32_t* table = crc_table();
+    crc = ~crc;
+    for (size_t i=0; i<n; i++) crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static constexpr std::uint32_t ADLER_MOD = 65521;
+
+static std::uint32_t adler32(const std::uint8_t* p, size_t n) {
+    std::uint32_t a = 1, b = 0;
+    while (n) {
+        const size_t chunk = std::min<size_t>(n, 5552); // largest block without overflow of b
+        for (size_t i=0; i<chunk; i++) {
+            a += p[i];
+            b += a;
+        }
+        a %= ADLER_MOD;
+        b %= ADLER_MOD;
+        p += chunk;
+        n -= chunk;
+    }
+    return b<<16 | a;
+}
+
+// Checksum of the concatenation of two blocks, the second one of length len2
+static std::uint32_t adler32_combine(const std::uint32_t adler1, const std::uint32_t adler2, const size_t len2) {
+    const std::uint32_t rem = len2 % ADLER_MOD;
+    std::uint32_t a = adler1 & 0xffff;
+    std::uint32_t b = (rem * a) % ADLER_MOD;
+    a += (adler2 & 0xffff) + ADLER_MOD - 1;
+    b += (adler1 >> 16) + (adler2 >> 16) + ADLER_MOD - rem;
+    a %= ADLER_MOD;
+    b %= ADLER_MOD;
+    return b<<16 | a;
+}
+
+struct BitWriter {
+    std::vector<std::uint8_t>& out;
+    std::uint64_t bits = 0;
+    int count = 0;
+    void put(const std::uint32_t value, const int n) { // least significant bit first
+        bits |= std::uint64_t(value) << count;
+        count += n;
+        while (count >= 8) {
+            out.push_back(bits);
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+    void flush() {
+        if (count) out.push_back(bits);
+        bits = 0;
+        count = 0;
+    }
+};
+
+// Canonical Huffman code of a symbol, bit-reversed for the writer since deflate sends codes from
+// their most significant bit
+struct HuffmanCode {
+    std::uint16_t code[288];
+    std::uint8_t  length[288];
+    int n = 0; // symbols
+
+    void assign_codes() {
+        int count[16] = {}, next[16] = {};
+        for (int s=0; s<n; s++) count[length[s]]++;
+        count[0] = 0;
+        for (int bits=1; bits<16; bits++) next[bits] = (next[bits-1] + count[bits-1]) << 1;
+        for (int s=0; s<n; s++) {
+            const int len = length[s];
+            if (!len) continue;
+            const int c = next[len]++;
+            int r = 0;
+            for (int i=0; i<len; i++) r |= ((c >> i) & 1) << (len-1-i);
+            code[s] = r;
+        }
+    }
+
+    // Code lengths of a Huffman tree over freq, limited to max_bits by halving the frequencies
+    // until the tree fits; at least two symbols get a code, as inflaters expect
+    void build(const std::uint32_t* freq, const int nsymbols, const int max_bits) {
+        n = nsymbols;
+        std::vector<std::uint32_t> f(freq, freq+n);
+        for (int s=0, used=std::count_if(f.begin(), f.end(), [](std::uint32_t v) { return v>0; }); used<2; s++)
+            if (!f[s]) { f[s] = 1; used++; }
+        std::vector<int> parent(2*n);
+        using Node = std::pair<std::uint64_t, int>;
+        for (;;) {
+            std::priority_queue<Node, std::vector<Node>, std::greater<Node>> heap;
+            for (int s=0; s<n; s++) if (f[s]) heap.push({f[s], s});
+            int next = n;
+            while (heap.size() > 1) {
+                const Node x = heap.top(); heap.pop();
+                const Node y = heap.top(); heap.pop();
+                parent[x.second] = parent[y.second] = next;
+                heap.push({x.first + y.first, next++});
+            }
+            parent[next-1] = -1; // root
+            int longest = 0;
+            for (int s=0; s<n; s++) {
+                int depth = 0;
+                if (f[s]) for (int i=s; parent[i]>=0; i=parent[i]) depth++;
+                length[s] = depth;
+                longest = std::max(longest, depth);
+            }
+            if (longest <= max_bits) break;
+            for (std::uint32_t& v : f) if (v) v = (v+1)/2;
+        }
+        assign_codes();
+    }
+
+    void fixed_literals() { // RFC 1951, 3.2.6
+        n = 288;
+        for (int s=0; s<288; s++) length[s] = s<144 ? 8 : s<256 ? 9 : s<280 ? 7 : 8;
+        assign_codes();
+    }
+
+    void fixed_distances() {
+        n = 30;
+        for (int s=0; s<30; s++) length[s] = 5;
+        assign_codes();
+    }
+
+    std::uint64_t cost(const std::uint32_t* freq, const int nsymbols) const {
+        std::uint64_t bits = 0;
+        for (int s=0; s<nsymbols; s++) bits += std::uint64_t(freq[s]) * length[s];
+        return bits;
+    }
+
+    void put(BitWriter& bw, const int symbol) const { bw.put(code[symbol], length[symbol]); }
+};
+
+static int floor_log2(unsigned v) {
+    int n = 0;
+    while (v >>= 1) n++;
+    return n;
+}
+
+// Symbol and extra bits of a match length (3..258) and of a distance (1..32768)
+static void length_symbol(const int length, int& symbol, int& extra_bits, int& extra) {
+    const unsigned l = length - 3;
+    extra_bits = extra = 0;
+    if (length == 258) symbol = 285;
+    else if (l < 8) symbol = 257 + l;
+    else {
+        const int n = floor_log2(l);
+        symbol = 257 + 4*(n-1) + ((l >> (n-2)) & 3);
+        extra_bits = n-2;
+        extra = l & ((1u << extra_bits) - 1);
+    }
+}
+
+static void distance_symbol(const int distance, int& symbol, int& extra_bits, int& extra) {
+    const unsigned d = distance - 1;
+    extra_bits = extra = 0;
+    if (d < 4) symbol = d;
+    else {
+        const int n = floor_log2(d);
+        symbol = 2*n + ((d >> (n-1)) & 1);
+        extra_bits = n-1;
+        extra = d & ((1u << extra_bits) - 1);
+    }
+}
+
+// Greedy LZ77 over data following a short hash chain. A token is a literal byte, or a match
+// with its length in the high bits and its distance in the low 16 bits (stored minus one).
+static void lz77(const std::uint8_t* data, const int n, std::vector<std::uint32_t>& tokens) {
+    constexpr int HASH_BITS = 15, WINDOW = 32768, MAX_CHAIN = 8, MIN_MATCH = 4, MAX_MATCH = 258;
+    std::vector<int> head(1 << HASH_BITS, -1), prev(std::min(n, WINDOW));
+    auto hash = [&](const int i) {
+        std::uint32_t v;
+        std::memcpy(&v, data+i, 4);
+        return (v * 2654435761u) >> (32 - HASH_BITS);
+    };
+    auto insert = [&](const int i) {
+        const std::uint32_t h = hash(i);
+        prev[i % WINDOW] = head[h];
+        head[h] = i;
+    };
+    int i = 0;
+    while (i < n) {
+        int best_len = 0, best_dist = 0;
+        if (i + MIN_MATCH <= n) {
+            const int max_len = std::min(MAX_MATCH, n - i);
+            int candidate = head[hash(i)];
+            for (int chain=0; chain<MAX_CHAIN && candidate>=0 && i-candidate<=WINDOW; chain++) {
+                if (data[candidate+best_len] == data[i+best_len]) {
+                    int len = 0;
+                    while (len < max_len && data[candidate+len] == data[i+len]) len++;
+                    if (len > best_len) {
+                        best_len = len;
+                        best_dist = i - candidate;
+                        if (len == max_len) break;
+                    }
+                }
+                candidate = prev[candidate % WINDOW];
+            }
+            insert(i);
+        }
+        if (best_len >= MIN_MATCH) {
+            tokens.push_back(std::uint32_t(best_len) << 16 | (best_dist - 1));
+            const int end = i + best_len;
+            for (i++; i < end; i++)
+                if (i + MIN_MATCH <= n) insert(i);
+        } else {
+            tokens.push_back(data[i]);
+            i++;
+        }
+    }
+}
+
+// Code lengths of both trees, run-length encoded with the symbols 16 (repeat the previous length),
+// 17 and 18 (runs of zeros). Each entry is a symbol in the low byte and its extra bits above.
+static void encode_code_lengths(const std::uint8_t* lengths, const int n, std::vector<int>& out) {
+    for (int i=0; i<n; ) {
+        const int v = lengths[i];
+        int run = 1;
+        while (i+run < n && lengths[i+run] == v) run++;
+        i += run;
+        if (v == 0) {
+            for (; run >= 11; ) {
+                const int r = std::min(run, 138);
+                out.push_back(18 | (r-11) << 8);
+                run -= r;
+            }
+            if (run >= 3) {
+                out.push_back(17 | (run-3) << 8);
+                run = 0;
+            }
+        } else {
+            out.push_back(v);
+            run--;
+            for (; run >= 3; ) {
+                const int r = std::min(run, 6);
+                out.push_back(16 | (r-3) << 8);
+                run -= r;
+            }
+        }
+        for (; run > 0; run--) out.push_back(v);
+    }
+}
+
+// One deflate block over data, with the fixed or dynamic Huffman codes, whichever is smaller.
+// final sets BFINAL; otherwise an empty stored block brings the stream back to a byte boundary.
+static void deflate_band(const std::uint8_t* data, const int n, const bool final, std::vector<std::uint8_t>& out) {
+    std::vector<std::uint32_t> tokens;
+    tokens.reserve(n/2);
+    lz77(data, n, tokens);
+
+    std::uint32_t lit_freq[288] = {}, dist_freq[30] = {};
+    for (const std::uint32_t t : tokens) {
+        if (t < 256) {
+            lit_freq[t]++;
+            continue;
+        }
+        int symbol, extra_bits, extra;
+        length_symbol(t >> 16, symbol, extra_bits, extra);
+        lit_freq[symbol]++;
+        distance_symbol((t & 0xffff) + 1, symbol, extra_bits, extra);
+        dist_freq[symbol]++;
+    }
+    lit_freq[256] = 1; // end of block
+
+    static const HuffmanCode fixed_lit = [] { HuffmanCode c; c.fixed_literals(); return c; }();
+    static const HuffmanCode fixed_dist = [] { HuffmanCode c; c.fixed_distances(); return c; }();
+    HuffmanCode lit, dist, lengths_code;
+    lit.build(lit_freq, 286, 15);
+    dist.build(dist_freq, 30, 15);
+
+    // Header of the dynamic block: trailing unused codes are dropped from both trees
+    int nlit = 286, ndist = 30;
+    while (nlit > 257 && !lit.length[nlit-1]) nlit--;
+    while (ndist > 1 && !dist.length[ndist-1]) ndist--;
+    std::uint8_t all_lengths[286+30];
+    std::copy(lit.length, lit.length+nlit, all_lengths);
+    std::copy(dist.length, dist.length+ndist, all_lengths+nlit);
+    std::vector<int> rle;
+    encode_code_lengths(all_lengths, nlit+ndist, rle);
+    std::uint32_t length_freq[19] = {};
+    for (const int e : rle) length_freq[e & 0xff]++;
+    lengths_code.build(length_freq, 19, 7);
+    static constexpr int order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    int nlengths = 19;
+    while (nlengths > 4 && !lengths_code.length[order[nlengths-1]]) nlengths--;
+
+    // Extra bits are the same with both codes and left out of the comparison
+    std::uint64_t dynamic_cost = 14 + 3*nlengths + lengths_code.cost(length_freq, 19) + lit.cost(lit_freq, 286) + dist.cost(dist_freq, 30);
+    for (const int e : rle) dynamic_cost += (e & 0xff)==16 ? 2 : (e & 0xff)==17 ? 3 : (e & 0xff)==18 ? 7 : 0;
+    const bool dynamic = dynamic_cost < fixed_lit.cost(lit_freq, 286) + fixed_dist.cost(dist_freq, 30);
+
+    BitWriter bw{out};
+    bw.put(final ? 1 : 0, 1);
+    bw.put(dynamic ? 2 : 1, 2);
+    if (dynamic) {
+        bw.put(nlit - 257, 5);
+        bw.put(ndist - 1, 5);
+        bw.put(nlengths - 4, 4);
+        for (int i=0; i<nlengths; i++) bw.put(lengths_code.length[order[i]], 3);
+        for (const int e : rle) {
+            const int symbol = e & 0xff;
+            lengths_code.put(bw, symbol);
+            if (symbol >= 16) bw.put(e >> 8, symbol==16 ? 2 : symbol==17 ? 3 : 7);
+        }
+    }
+    const HuffmanCode& lit_code = dynamic ? lit : fixed_lit;
+    const HuffmanCode& dist_code = dynamic ? dist : fixed_dist;
+    for (const std::uint32_t t : tokens) {
+        if (t < 256) {
+            lit_code.put(bw, t);
+            continue;
+        }
+        int symbol, extra_bits, extra;
+        length_symbol(t >> 16, symbol, extra_bits, extra);
+        lit_code.put(bw, symbol);
+        if (extra_bits) bw.put(extra, extra_bits);
+        distance_symbol((t & 0xffff) + 1, symbol, extra_bits, extra);
+        dist_code.put(bw, symbol);
+        if (extra_bits) bw.put(extra, extra_bits);
+    }
+    lit_code.put(bw, 256); // end of block
+    if (!final) {
+        bw.put(0, 3); // stored block: BFINAL=0, BTYPE=00, padded to the byte, then LEN=0 and NLEN=0xffff
+        bw.flush();
+        out.insert(out.end(), {0x00, 0x00, 0xff, 0xff});
+    }
+    bw.flush();
+}
+
+static inline int paeth(const int a, const int b, const int c) {
+    const int pa = std::abs(b-c), pb = std::abs(a-c), pc = std::abs(a+b-2*c); // distances of a+b-c to a, b and c
+    return pa<=pb && pa<=pc ? a : pb<=pc ? b : c;
+}
+
+static inline int filter_cost(const int v) { return std::abs(int(std::int8_t(v))); }
+
+// Picks among None/Sub/Up/Paeth the filter with the smallest sum of absolute differences, the
+// usual heuristic, then writes the filter byte followed by the filtered row. up is a row of zeros
+// for the first row of the image. The costs are summed in one pass and only the chosen filter is
+// applied, both loops have the bytes of the left pixel (a, c) outside the first pixel.
+static void filter_row(const std::uint8_t* cur, const std::uint8_t* up, const int stride, const int bpp, std::uint8_t* out) {
+    int cost[4] = {0, 0, 0, 0};
+    for (int i=0; i<bpp; i++) {
+        cost[0] += filter_cost(cur[i]);
+        cost[1] += filter_cost(cur[i]);
+        cost[2] += filter_cost(cur[i] - up[i]);
+        cost[3] += filter_cost(cur[i] - up[i]); // paeth(0, b, 0) is b
+    }
+    for (int i=bpp; i<stride; i++) {
+        const int x = cur[i], a = cur[i-bpp], b = up[i], c = up[i-bpp];
+        cost[0] += filter_cost(x);
+        cost[1] += filter_cost(x - a);
+        cost[2] += filter_cost(x - b);
+        cost[3] += filter_cost(x - paeth(a, b, c));
+    }
+    static constexpr std::uint8_t filter_type[4] = {0, 1, 2, 4}; // None, Sub, Up, Paeth
+    const int best = std::min_element(cost, cost+4) - cost;
+    *out++ = filter_type[best];
+    switch (best) {
+        case 0: std::memcpy(out, cur, stride); break;
+        case 1:
+            std::memcpy(out, cur, bpp);
+            for (int i=bpp; i<stride; i++) out[i] = cur[i] - cur[i-bpp];
+            break;
+        case 2:
+            for (int i=0; i<stride; i++) out[i] = cur[i] - up[i];
+            break;
+        default:
+            for (int i=0; i<bpp; i++) out[i] = cur[i] - up[i];
+            for (int i=bpp; i<stride; i++) out[i] = cur[i] - paeth(cur[i-bpp], up[i], up[i-bpp]);
+            break;
+    }
+}
+
+static void put_chunk(std::vector<std::uint8_t>& bytes, const char* type, const std::uint8_t* data, const size_t n) {
+    put_u32_be(bytes, n);
+    const size_t start = bytes.size();
+    bytes.insert(bytes.end(), type, type+4);
+    bytes.insert(bytes.end(), data, data+n);
+    put_u32_be(bytes, crc32(0, bytes.data()+start, n+4));
+}
+
+void encode_png(const TGAImage& img, std::vector<std::uint8_t>& bytes, const bool vflip) {
+    const int w = img.width(), h = img.height(), bpp = img.bytespp();
+    const int stride = w * bpp;
+    const int rows_per_band = std::max(1, (256 << 10) / (stride + 1));
+    const int nbands = (h + rows_per_band - 1) / rows_per_band;
+
+    struct Band {
+        std::vector<std::uint8_t> deflated;
+        std::uint32_t adler;
+        size_t length;
+    };
+    std::vector<Band> bands(nbands);
+    scheduler.parallel_for(0, nbands, 1, [&](const int first, const int last) {
+        std::vector<std::uint8_t> rgb(3*stride), filtered; // current row, row above and a row of zeros
+        for (int b=first; b<last; b++) {
+            const int y0 = b*rows_per_band, y1 = std::min(h, y0 + rows_per_band);
+            filtered.resize(size_t(y1-y0) * (stride+1));
+            std::uint8_t *cur = rgb.data(), *up = rgb.data() + stride;
+            if (y0 > 0) row_to_rgb(image_row(img, y0-1, vflip), up, w, bpp); // the filters see the row above the band
+            for (int y=y0; y<y1; y++) {
+                row_to_rgb(image_row(img, y, vflip), cur, w, bpp);
+                filter_row(cur, y ? up : rgb.data() + 2*stride, stride, bpp, filtered.data() + size_t(y-y0)*(stride+1));
+                std::swap(cur, up);
+            }
+            bands[b].deflated.clear();
+            deflate_band(filtered.data(), filtered.size(), b==nbands-1, bands[b].deflated);
+            bands[b].adler = adler32(filtered.data(), filtered.size());
+            bands[b].length = filtered.size();
+        }
+    });
+
+    static constexpr std::uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    bytes.insert(bytes.end(), signature, signature+8);
+    std::vector<std::uint8_t> ihdr;
+    put_u32_be(ihdr, w);
+    put_u32_be(ihdr, h);
+    static constexpr std::uint8_t color_type[5] = {0, 0, 0, 2, 6}; // by bytes per pixel: gray, RGB, RGBA
+    ihdr.insert(ihdr.end(), {8, color_type[bpp], 0, 0, 0}); // 8 bits, deflate, adaptive filters, no interlace
+    put_chunk(bytes, "IHDR", ihdr.data(), ihdr.size());
+
+    // One IDAT per band, the zlib header goes in front of the first one and the checksum after the last
+    std::uint32_t adler = 1;
+    for (int b=0; b<nbands; b++) {
+        std::vector<std::uint8_t>& data = bands[b].deflated;
+        if (b == 0) data.insert(data.begin(), {0x78, 0x01});
+        adler = adler32_combine(adler, bands[b].adler, bands[b].length);
+        if (b == nbands-1) put_u32_be(data, adler);
+        put_chunk(bytes, "IDAT", data.data(), data.size());
+    }
+    put_chunk(bytes, "IEND", nullptr, 0);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+void encode_image(const TGAImage& img, const ImageFormat format, std::vector<std::uint8_t>& bytes, const bool vflip) {
+    switch (format) {
+        case IMAGE_QOI: encode_qoi(img, bytes, vflip); break;
+        case IMAGE_PNG: encode_png(img, bytes, vflip); break;
+        default:        img.encode_tga(bytes, vflip); break;
+    }
+}
+
+bool write_image(const TGAImage& img, const std::string& filename, const ImageFormat format, const bool vflip) {
+    std::vector<std::uint8_t> bytes;
+    encode_image(img, format, bytes, vflip);
+    std::ofstream out(filename, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    if (!out.good()) {
+        std::cerr << "can't write " << filename << "\n";
+        return false;
+    }
+    return true;
+}
+
+void ImageWriter::write(TGAImage&& image, const std::string& filename) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // Drop the writes that are done, keeping their status
+        pending.erase(std::remove_if(pending.begin(), pending.end(), [&](const std::shared_future<bool>& f) {
+            if (f.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return false;
+            failed |= !f.get();
+            return true;
+        }), pending.end());
+        if (int(pending.size()) < max_pending) {
+            auto img = std::make_shared<TGAImage>(std::move(image));
+            const ImageFormat fmt = format;
+            pending.push_back(scheduler.background<bool>([img, filename, fmt] { return write_image(*img, filename, fmt); }));
+            return;
+        }
+    }
+    const bool ok = write_image(image, filename, format);
+    std::lock_guard<std::mutex> lock(mutex);
+    failed |= !ok;
+}
+
+bool ImageWriter::finish() {
+    std::vector<std::shared_future<bool>> waiting;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        waiting.swap(pending);
+    }
+    bool ok = true;
+    for (auto& f : waiting) ok &= f.get();
+    std::lock_guard<std::mutex> lock(mutex);
+    ok &= !failed;
+    failed = false;
+    return ok;
+}
@@ -0,0 +1,61 @@
+#include "heatmap.h"
+#include "arena.h"
+#include <algorithm>
+
+void Heatmap::reset(const int width, const int height) {
+    w = width;
+    h = height;
+    depth_tests.assign(w*h, 0);
+    shaded_count.assign(w*h, 0);
+    ticks.assign(w*h, 0);
+}
+
+HeatmapStats Heatmap::stats() {
+    return {w, depth_tests.data(), shaded_count.data(), ticks.data()};
+}
+
+// black -> blue -> cyan -> green -> yellow -> red
+static TGAColor heat_color(double t) {
+    constexpr double ramp[6][3] = {{0,0,0}, {0,0,1}, {0,1,1}, {0,1,0}, {1,1,0}, {1,0,0}};
+    t = std::clamp(t, 0., 1.) * 5;
+    const int i = std::min<int>(t, 4);
+    const double f = t - i;
+    TGAColor c;
+    for (int k : {0,1,2}) // rgb ramp into bgr storage
+        c[2-k] = (std::uint8_t)(255 * (ramp[i][k] + (ramp[i+1][k] - ramp[i][k]) * f));
+    c[3] = 255;
+    c.bytespp = 3;
+    return c;
+}
+
+double Heatmap::render(const HeatmapView view, TGAImage& img) const {
+    if (view == HEATMAP_TILE_COST) {
+        const int tiles_x = (w + tile_size - 1) / tile_size;
+        const int tiles_y = (h + tile_size - 1) / tile_size;
+        FrameVector<double> cost(tiles_x*tiles_y, 0);
+        for (int y=0; y<h; y++)
+            for (int x=0; x<w; x++)
+                cost[x/tile_size + (y/tile_size)*tiles_x] += ticks[x+y*w];
+        const double max_cost = std::max(1., *std::max_element(cost.begin(), cost.end()));
+        for (int y=0; y<h; y++)
+            for (int x=0; x<w; x++)
+                img.set(x, y, heat_color(cost[x/tile_size + (y/tile_size)*tiles_x] / max_cost));
+        return max_cost;
+    }
+    // Counts use a fixed minimum scale so that a single layer of fragments stays cold
+    const std::vector<std::uint16_t>& counts = view == HEATMAP_DEPTH_TESTS ? depth_tests : shaded_count;
+    const double max_count = std::max<double>(8, *std::max_element(counts.begin(), counts.end()));
+    for (int y=0; y<h; y++)
+        for (int x=0; x<w; x++)
+            img.set(x, y, heat_color(counts[x+y*w] / max_count));
+    return max_count;
+}
+
+const char* heatmap_view_name(const HeatmapView view) {
+    switch (view) {
+        case HEATMAP_DEPTH_TESTS: return "depth tests";
+        case HEATMAP_SHADED:      return "shaded fragments";
+        case HEATMAP_TILE_COST:   return "tile cost";
+        default:                  return "";
+    }
+}
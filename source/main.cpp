@@ -1,256 +1,301 @@
-#include <limits>
 #include <algorithm>
 #include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
-#include "geometry.h"
-#include "model.h"
-#include "tgaimage.h"
+#include <string>
+#include <thread>
+#include <vector>
+#include "sw_renderer.h"
 #include "viewer.h"
-#include "rasterizer.h"
 
-mat<4,4> ModelView, Viewport, Perspective;
-
-// Rendering modes
-enum RenderingMode {
-    PHONG_LIGHTING,
-    COLORED_TRIANGLES
-};
-
-enum ShadingMode {
-    FLAT_SHADING,
-    SMOOTH_SHADING,
-    NORMAL_MAPPING,
-    COLOR_TEXTURE,
-    NORMAL_AND_COLOR
+// Command line description of a model, its maps and its animation
+struct ModelArgs {
+    std::string mesh, normal_map, color_texture, animation;
 };
 
-RenderingMode current_mode = PHONG_LIGHTING;
-ShadingMode current_shading = SMOOTH_SHADING;
-
-
-void lookat(const vec3 eye, const vec3 center, const vec3 up) {
-    vec3 z = normalized(eye - center);          // forward (camera space +Z points backward)
-    vec3 x = normalized(cross(up, z));          // right
-    vec3 y = cross(z, x);                       // true up
-
-    mat<4,4> rotation = {{{x.x, x.y, x.z, 0}, {y.x, y.y, y.z, 0}, {z.x, z.y, z.z, 0}, {0, 0, 0, 1}}};
-    mat<4,4> translation = {{{1, 0, 0, -eye.x}, {0, 1, 0, -eye.y}, {0, 0, 1, -eye.z}, {0, 0, 0, 1}}};
-    ModelView = rotation * translation;
-}
-
-void perspective_fov(const double fov_degrees) {
-    constexpr double Pi = 3.14159265358979323846;
-    const double f = 1.0 / std::tan((fov_degrees * Pi / 180.0) * 0.5);
-    Perspective = {{{1,0,0,0}, {0,1,0,0}, {0,0,1,0}, {0,0,-1.0/f,1}}};
+static const char* optional(const std::string& filename) {
+    return filename.empty() ? nullptr : filename.c_str();
 }
 
-void viewport(const int x, const int y, const int w, const int h) {
-    Viewport = {{{w/2., 0, 0, x+w/2.}, {0, h/2., 0, y+h/2.}, {0,0,1,0}, {0,0,0,1}}};
-}
-
-TGAColor hsv_to_rgb(double hue, double saturation = 1.0, double value = 1.0) {
-    // Normalize hue to [0, 360)
-    hue = fmod(hue, 360.0);
-    if (hue < 0) hue += 360.0;
-    
-    // HSV to RGB conversion
-    double h = hue / 60.0;
-    int sector = (int)h;
-    double f = h - sector;
-    double p = 0.0, q = 1.0 - f, t = f;
-    
-    double r, g, b;
-    switch (sector % 6) {
-        case 0: r = 1.0; g = t; b = 0.0; break;
-        case 1: r = q; g = 1.0; b = 0.0; break;
-        case 2: r = 0.0; g = 1.0; b = t; break;
-        case 3: r = 0.0; g = q; b = 1.0; break;
-        case 4: r = t; g = 0.0; b = 1.0; break;
-        case 5: r = 1.0; g = 0.0; b = q; break;
-        default: r = 1.0; g = 0.0; b = 0.0; break;
+void print_hit(const SwHit& hit) {
+    if (hit.model < 0) {
+        std::cout << "nothing" << std::endl;
+        return;
     }
-    
-    // Apply saturation and value
-    r = r * saturation * value;
-    g = g * saturation * value;
-    b = b * saturation * value;
-    
-    TGAColor color;
-    color[0] = (unsigned char)(r * 255);  // Red
-    color[1] = (unsigned char)(g * 255);  // Green  
-    color[2] = (unsigned char)(b * 255);  // Blue
-    color.bytespp = 3;
-    
-    return color;
+    std::cout << "model " << hit.model << ", triangle " << hit.face << ", barycentric (" << hit.bary[0] << ", " << hit.bary[1] << ", " << hit.bary[2]
+              << "), uv (" << hit.uv[0] << ", " << hit.uv[1] << "), distance " << hit.distance << std::endl;
 }
 
-
-void cpu_rasterize_colored_triangles(const std::vector<Model>& models, TGAImage& framebuffer, 
-                                    std::vector<double>& zbuffer, const mat<4,4>& Model) {
-    // -- CPU rasterization with simple colored triangles
-    for (const auto &model : models) {
-        for (int i=0; i<model.nfaces(); i++) {
-            vec4 clip[3];
-            
-            for (int d : {0,1,2}) {
-                vec3 v = model.vert(i, d);
-                clip[d] = Perspective * ModelView * Model * vec4{v.x, v.y, v.z, 1.};
-            }
-            
-            // Use simple HSV color cycling for each triangle
-            double hue = (i * 0.618033988749895) * 360.0; // Golden ratio for good distribution
-            TGAColor triangle_color = hsv_to_rgb(hue);
-            
-            // Simple rasterization without lighting
-            rasterize_simple(clip, zbuffer, framebuffer, triangle_color);
-        }
-    }
-}
-
-void render_frame(const std::vector<Model>& models, TGAImage& framebuffer, std::vector<double>& zbuffer, 
-                 std::vector<unsigned char>& rgba, double angleX, double angleY, 
-                 double& render_time_ms) {
-    // Start timing
-    auto start_time = std::chrono::high_resolution_clock::now();
-    
-    const int width = framebuffer.width();
-    const int height = framebuffer.height();
-    
-    // -- Update rotation from input, then build model rotation matrices (Y then X)
-    const double cy = std::cos(angleY), sy = std::sin(angleY);
-    const double cx = std::cos(angleX), sx = std::sin(angleX);
-    mat<4,4> RotY = {{{ cy, 0, sy, 0}, {0, 1, 0, 0}, {-sy, 0, cy, 0}, {0, 0, 0, 1}}};
-    mat<4,4> RotX = {{{ 1, 0, 0, 0}, {0, cx, -sx, 0}, {0, sx, cx, 0}, {0, 0, 0, 1}}};
-    mat<4,4> Model = RotY * RotX;
-
-    // -- Clear CPU framebuffer and z-buffer
-    std::fill(zbuffer.begin(), zbuffer.end(), -std::numeric_limits<double>::max());
-    for (int y=0; y<height; ++y) for (int x=0; x<width; ++x) framebuffer.set(x,y,TGAColor{{30,30,30,255}, 4});
-
-    // -- CPU rasterization of all loaded models
-    if (current_mode == PHONG_LIGHTING) {
-        bool use_smooth_shading = (current_shading == SMOOTH_SHADING || current_shading == NORMAL_MAPPING || current_shading == COLOR_TEXTURE || current_shading == NORMAL_AND_COLOR);
-        bool use_normal_mapping = (current_shading == NORMAL_MAPPING || current_shading == NORMAL_AND_COLOR);
-        bool use_color_texture = (current_shading == COLOR_TEXTURE || current_shading == NORMAL_AND_COLOR);
-        cpu_rasterize_models(models, framebuffer, zbuffer, Model, use_smooth_shading, use_normal_mapping, use_color_texture);
+void present_frame(const SwRenderer* renderer, std::vector<unsigned char>& rgba, const SwMode mode, const SwShading shading, const SwHeatmapView heatmap_view,
+                   const double angleX, const double angleY, const bool image_changed) {
+    char mode_name[64];
+    if (mode == SW_MODE_HEATMAP) {
+        snprintf(mode_name, sizeof(mode_name), "Heatmap, %s (red = %.0f)", sw_renderer_heatmap_view_name(heatmap_view), sw_renderer_heatmap_scale(renderer));
     } else {
-        cpu_rasterize_colored_triangles(models, framebuffer, zbuffer, Model);
+        snprintf(mode_name, sizeof(mode_name), "%s", mode == SW_MODE_PHONG ? "Phong Lighting" : "Colored Triangles");
     }
-
-    // End timing
-    auto end_time = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
-    render_time_ms = duration.count() / 1000.0;
-
-    // Present with timing information
-    const char* mode_name = (current_mode == PHONG_LIGHTING) ? "Phong Lighting" : "Colored Triangles";
     const char* shading_name;
-    switch (current_shading) {
-        case FLAT_SHADING: shading_name = "Flat"; break;
-        case SMOOTH_SHADING: shading_name = "Smooth"; break;
-        case NORMAL_MAPPING: shading_name = "Normal Mapping"; break;
-        case COLOR_TEXTURE: shading_name = "Color Texture"; break;
-        case NORMAL_AND_COLOR: shading_name = "Normal + Color"; break;
+    switch (shading) {
+        case SW_SHADING_FLAT: shading_name = "Flat"; break;
+        case SW_SHADING_SMOOTH: shading_name = "Smooth"; break;
+        case SW_SHADING_NORMAL_MAP: shading_name = "Normal Mapping"; break;
+        case SW_SHADING_COLOR_TEXTURE: shading_name = "Color Texture"; break;
+        default: shading_name = "Normal + Color"; break;
     }
-    const char* normal_mapping_status = (current_shading == NORMAL_MAPPING || current_shading == NORMAL_AND_COLOR) ? "ON" : "OFF";
-    viewer_present_with_timing(framebuffer, rgba, render_time_ms, angleX, angleY, mode_name, shading_name, normal_mapping_status);
+    const char* normal_mapping_status = (shading == SW_SHADING_NORMAL_MAP || shading == SW_SHADING_NORMAL_AND_COLOR) ? "ON" : "OFF";
+    if (image_changed) sw_renderer_read_pixels(renderer, rgba.data(), rgba.size());
+    viewer_present_with_timing(rgba, sw_renderer_render_time(renderer), angleX, angleY, mode_name, shading_name, normal_mapping_status,
+                               sw_renderer_render_scale(renderer), image_changed);
 }
 
 int main(int argc, char** argv) {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " obj/model.obj [normal_map.tga] [color_texture.tga]" << std::endl;
+    // Split the command line into --options and positional arguments
+    std::vector<std::string> args;
+    int extra_lights = 0;
+    int lod_levels = 4;
+    double lod_triangle_area = 4.0;
+    bool compress_textures = false;
+    bool quantize_meshes = false;
+    int nthreads = 0;
+    bool pin_threads = false;
+    int turntable_views = 0, view_size = 512;
+    bool turntable_atlas = false;
+    std::string image_format = "tga";
+    std::string stream_path;
+    std::string stream_format = "rgb24";
+    int stream_queue = 4;
+    double frame_rate = 30;
+    double frame_budget = 15;
+    bool temporal_reuse = false;
+    double shading_rate = 0;
+    bool ssao = false, ssao_half = false;
+    double ssao_radius = .1;
+    int pick_x = -1, pick_y = -1;
+    std::string trace_filename, csv_filename;
+    for (int i=1; i<argc; i++) {
+        std::string arg = argv[i];
+        if (!arg.compare(0, 9, "--lights=")) extra_lights = std::max(0, std::atoi(arg.c_str()+9));
+        else if (!arg.compare(0, 7, "--lods=")) lod_levels = std::max(0, std::atoi(arg.c_str()+7));
+        else if (!arg.compare(0, 11, "--lod-area=")) lod_triangle_area = std::atof(arg.c_str()+11);
+        else if (arg == "--compress") compress_textures = true;
+        else if (arg == "--quantize") quantize_meshes = true;
+        else if (!arg.compare(0, 10, "--threads=")) nthreads = std::max(0, std::atoi(arg.c_str()+10));
+        else if (arg == "--pin") pin_threads = true;
+        else if (!arg.compare(0, 12, "--turntable=")) turntable_views = std::max(0, std::atoi(arg.c_str()+12));
+        else if (!arg.compare(0, 12, "--view-size=")) view_size = std::max(16, std::atoi(arg.c_str()+12));
+        else if (arg == "--atlas") turntable_atlas = true;
+        else if (!arg.compare(0, 9, "--format=")) image_format = arg.substr(9);
+        else if (!arg.compare(0, 9, "--stream=")) stream_path = arg.substr(9);
+        else if (!arg.compare(0, 16, "--stream-format=")) stream_format = arg.substr(16);
+        else if (!arg.compare(0, 15, "--stream-queue=")) stream_queue = std::max(1, std::atoi(arg.c_str()+15));
+        else if (!arg.compare(0, 13, "--frame-rate=")) frame_rate = std::max(1., std::atof(arg.c_str()+13));
+        else if (!arg.compare(0, 15, "--frame-budget=")) frame_budget = std::max(0., std::atof(arg.c_str()+15));
+        else if (arg == "--temporal") temporal_reuse = true;
+        else if (!arg.compare(0, 15, "--shading-rate=")) shading_rate = std::max(0., std::atof(arg.c_str()+15));
+        else if (arg == "--ssao" || arg == "--ssao=full") ssao = true;
+        else if (arg == "--ssao=half") ssao = ssao_half = true;
+        else if (!arg.compare(0, 14, "--ssao-radius=")) ssao_radius = std::max(1e-3, std::atof(arg.c_str()+14));
+        else if (!arg.compare(0, 7, "--pick=")) {
+            if (std::sscanf(arg.c_str()+7, "%d,%d", &pick_x, &pick_y) != 2) std::cerr << "Expected --pick=X,Y" << std::endl;
+        }
+        else if (!arg.compare(0, 8, "--trace=")) trace_filename = arg.substr(8);
+        else if (!arg.compare(0, 6, "--csv=")) csv_filename = arg.substr(6);
+        else args.push_back(arg);
+    }
+    // Each .obj starts a model, the files following it are its normal map and color texture, and
+    // a .anim file its animation
+    std::vector<ModelArgs> model_args;
+    for (const std::string& arg : args) {
+        if (model_args.empty() || (arg.size()>4 && !arg.compare(arg.size()-4, 4, ".obj"))) {
+            ModelArgs model;
+            model.mesh = arg;
+            model_args.push_back(model);
+        }
+        else if (arg.size()>5 && !arg.compare(arg.size()-5, 5, ".anim")) model_args.back().animation = arg;
+        else if (model_args.back().normal_map.empty()) model_args.back().normal_map = arg;
+        else if (model_args.back().color_texture.empty()) model_args.back().color_texture = arg;
+        else std::cerr << "Ignoring extra texture " << arg << std::endl;
+    }
+    if (temporal_reuse && shading_rate > 0) {
+        std::cerr << "--shading-rate does not combine with --temporal, shading every pixel" << std::endl;
+        shading_rate = 0;
+    }
+    if (model_args.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [--lights=N] [--lods=N] [--lod-area=A] [--compress] [--quantize] [--threads=N] [--pin] [--turntable=N [--view-size=S] [--atlas]] [--format=tga|qoi|png] [--stream=-|path [--stream-format=rgb24|rgba] [--stream-queue=N]] [--frame-rate=F] [--frame-budget=MS] [--temporal] [--shading-rate=T] [--ssao[=half] [--ssao-radius=R]] [--pick=X,Y] [--trace=trace.json] [--csv=frames.csv] obj/model.obj [normal_map.tga] [color_texture.tga] [model.anim] [obj/other.obj [...]]" << std::endl;
         return 1;
     }
 
     constexpr int width  = 800;    // output image size
     constexpr int height = 800;
-    constexpr vec3    eye{-1,0,2}; // camera position
-    constexpr vec3 center{0,0,0};  // camera look-at target
-    constexpr vec3     up{0,1,0};  // camera up vector
+    SwRenderer* renderer = sw_renderer_create(width, height);
+    sw_renderer_set_image_format(renderer, image_format.c_str());
 
-    lookat(eye, center, up);                              // build the ModelView   matrix
-    perspective_fov(60.0);                                // build the Perspective matrix (FOV-based)
-    viewport(width/16, height/16, width*7/8, height*7/8); // build the Viewport    matrix
+    // The stream takes stdout before anything is printed
+    if (!stream_path.empty()) {
+        const int stream_width = turntable_views > 0 ? view_size : width, stream_height = turntable_views > 0 ? view_size : height;
+        if (!sw_renderer_open_stream(renderer, stream_path.c_str(), stream_width, stream_height, stream_format.c_str(), stream_queue)) {
+            sw_renderer_destroy(renderer);
+            return 1;
+        }
+    }
+    sw_renderer_add_light_ring(renderer, extra_lights);
+    sw_renderer_set_lod_area(renderer, lod_triangle_area);
+    sw_renderer_set_ssao(renderer, ssao, ssao_half, ssao_radius);
+    sw_renderer_set_temporal_reuse(renderer, temporal_reuse);
+    sw_renderer_set_shading_rate(renderer, shading_rate);
+    sw_renderer_set_frame_budget(renderer, frame_budget);
+    sw_renderer_set_load_options(renderer, lod_levels, compress_textures, quantize_meshes);
+    sw_renderer_start_threads(nthreads, pin_threads);
+    if (!trace_filename.empty() || !csv_filename.empty())
+        sw_renderer_open_profile(trace_filename.c_str(), csv_filename.c_str());
 
-    // Load models once
-    std::vector<Model> models;
-    models.reserve(argc-1);
-    if (argc >= 4) {
-        // Load model with normal map and color texture
-        models.emplace_back(argv[1], argv[2], argv[3]);
-        std::cout << "Loading model with normal map and color texture: " << argv[1] << " + " << argv[2] << " + " << argv[3] << std::endl;
-    } else if (argc >= 3) {
-        // Load model with normal map
-        models.emplace_back(argv[1], argv[2]);
-        std::cout << "Loading model with normal map: " << argv[1] << " + " << argv[2] << std::endl;
-    } else {
-        // Load model without textures
-        models.emplace_back(argv[1]);
-        std::cout << "Loading model without textures: " << argv[1] << std::endl;
+    // Request every asset up front, they load in the background while the window opens
+    for (const ModelArgs& m : model_args) {
+        sw_renderer_request_model(renderer, m.mesh.c_str(), optional(m.normal_map), optional(m.color_texture), optional(m.animation));
+        std::cout << "Loading model: " << m.mesh;
+        if (!m.normal_map.empty()) std::cout << " + " << m.normal_map;
+        if (!m.color_texture.empty()) std::cout << " + " << m.color_texture;
+        if (!m.animation.empty()) std::cout << " + " << m.animation;
+        std::cout << std::endl;
     }
-    
-    // Check if any model has normal mapping
-    bool any_model_has_normal = false;
-    for (const auto& model : models) {
-        if (model.has_normal()) {
-            any_model_has_normal = true;
-            break;
+
+    // Batch mode: wait for every asset, render the views and exit without a window
+    if (turntable_views > 0) {
+        while (sw_renderer_poll_models(renderer))
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        bool ok = sw_renderer_model_count(renderer) > 0;
+        if (ok && !stream_path.empty())
+            ok = sw_renderer_stream_turntable(renderer, turntable_views, view_size, frame_rate);
+        else if (ok)
+            ok = sw_renderer_turntable(renderer, turntable_views, view_size, turntable_atlas, frame_rate);
+        if (ok && pick_x >= 0 && pick_y >= 0) {
+            std::vector<SwHit> hits(turntable_views);
+            sw_renderer_pick_turntable(renderer, turntable_views, view_size, frame_rate, pick_x, pick_y, hits.data());
+            for (int i=0; i<turntable_views; i++) {
+                std::cout << "View " << i << " at " << pick_x << "," << pick_y << ": ";
+                print_hit(hits[i]);
+            }
         }
+        sw_renderer_destroy(renderer);
+        sw_renderer_close_profile();
+        sw_renderer_stop_threads();
+        return ok ? 0 : 1;
     }
 
     // Initialize viewer
     if (!viewer_init(width, height, "sw_renderer - interactive")) {
         std::cerr << "Viewer not available. Rebuild with USE_RAYLIB enabled." << std::endl;
+        sw_renderer_destroy(renderer);
+        sw_renderer_stop_threads();
         return 1;
     }
 
-    // Persistent CPU framebuffer and staging buffer
-    TGAImage framebuffer(width, height, TGAImage::RGB);
-    std::vector<double> zbuffer(width*height, -std::numeric_limits<double>::max());
+    // Staging buffer of the window's texture
     std::vector<unsigned char> rgba(width*height*4, 255);
+    bool streaming = !stream_path.empty();
+    bool loading = true;
 
     double angleY = 0.0;
     double angleX = 0.0;
-    
+    SwMode mode = SW_MODE_PHONG;
+    SwShading shading = SW_SHADING_SMOOTH;
+    SwHeatmapView heatmap_view = SW_HEATMAP_DEPTH_TESTS;
+
     // Timing variables
-    double render_time_ms = 0.0;
-    
+    auto last_frame_time = std::chrono::steady_clock::now();
+
     // ==== Main render loop ====
     while (!viewer_should_close()) {
-        const double dt = 1.0/60.0; // viewer is vsynced to 60 FPS; keys sampled each loop
+        if (loading && !sw_renderer_poll_models(renderer)) {
+            loading = false;
+            std::cout << "All assets loaded" << std::endl;
+        }
+
+        // Measured time step, so that rotation and animation speeds do not depend on the frame
+        // rate; a stall (window dragged, assets arriving) counts as 1/10 s at most
+        const auto frame_time = std::chrono::steady_clock::now();
+        const double dt = std::min(0.1, std::chrono::duration<double>(frame_time - last_frame_time).count());
+        last_frame_time = frame_time;
         const double speed = 1.5; // radians/sec
-        
-        bool rotation_occurred = false;
-        if (viewer_key_down(ViewerKey_Right)) { angleY += speed*dt; rotation_occurred = true; }
-        if (viewer_key_down(ViewerKey_Left))  { angleY -= speed*dt; rotation_occurred = true; }
-        if (viewer_key_down(ViewerKey_Up))    { angleX += speed*dt; rotation_occurred = true; }
-        if (viewer_key_down(ViewerKey_Down))  { angleX -= speed*dt; rotation_occurred = true; }
-        
+
+        if (viewer_key_down(ViewerKey_Right)) angleY += speed*dt;
+        if (viewer_key_down(ViewerKey_Left))  angleY -= speed*dt;
+        if (viewer_key_down(ViewerKey_Up))    angleX += speed*dt;
+        if (viewer_key_down(ViewerKey_Down))  angleX -= speed*dt;
+        sw_renderer_set_rotation(renderer, angleX, angleY);
+        sw_renderer_advance_time(renderer, dt);
+
+        // Report what is under the mouse on a click
+        int mouse_x, mouse_y;
+        if (viewer_mouse_clicked(mouse_x, mouse_y)) {
+            SwHit hit;
+            sw_renderer_pick(renderer, mouse_x, mouse_y, &hit);
+            std::cout << "Picked ";
+            print_hit(hit);
+        }
+
         // Check for mode switching (Space key)
         static bool space_pressed = false;
         if (viewer_key_down(ViewerKey_Space)) {
             if (!space_pressed) {
-                current_mode = (current_mode == PHONG_LIGHTING) ? COLORED_TRIANGLES : PHONG_LIGHTING;
+                mode = (SwMode)((mode + 1) % SW_MODE_COUNT);
                 space_pressed = true;
             }
         } else {
             space_pressed = false;
         }
-        
+
         // Check for shading mode cycling (S key)
         static bool s_pressed = false;
         if (viewer_key_down(ViewerKey_S)) {
             if (!s_pressed) {
-                current_shading = (ShadingMode)((current_shading + 1) % 5);
+                shading = (SwShading)((shading + 1) % SW_SHADING_COUNT);
                 s_pressed = true;
             }
         } else {
             s_pressed = false;
         }
 
-        render_frame(models, framebuffer, zbuffer, rgba, angleX, angleY, render_time_ms);
+        // Check for heatmap view cycling (H key)
+        static bool h_pressed = false;
+        if (viewer_key_down(ViewerKey_H)) {
+            if (!h_pressed) {
+                heatmap_view = (SwHeatmapView)((heatmap_view + 1) % SW_HEATMAP_VIEW_COUNT);
+                h_pressed = true;
+            }
+        } else {
+            h_pressed = false;
+        }
+        sw_renderer_set_mode(renderer, mode);
+        sw_renderer_set_shading(renderer, shading);
+        sw_renderer_set_heatmap_view(renderer, heatmap_view);
+
+        // The renderer draws only what changed since the last frame
+        const bool image_changed = sw_renderer_update(renderer);
+        present_frame(renderer, rgba, mode, shading, heatmap_view, angleX, angleY, image_changed);
+        // Every presented frame goes to the stream, at the 60 FPS of the window
+        if (streaming && !sw_renderer_stream_frame(renderer)) streaming = false;
+
+        // Export the heatmap of the frame just rendered (E key)
+        static bool e_pressed = false;
+        static int heatmap_exports = 0;
+        if (viewer_key_down(ViewerKey_E)) {
+            if (!e_pressed && mode == SW_MODE_HEATMAP) {
+                std::string filename = "heatmap_" + std::to_string(heatmap_exports++) + sw_renderer_image_extension(renderer);
+                sw_renderer_write_image(renderer, filename.c_str()); // encoded while the next frames render
+                std::cout << "Heatmap written to " << filename << std::endl;
+            }
+            e_pressed = true;
+        } else {
+            e_pressed = false;
+        }
+        sw_renderer_end_frame();
     }
+    sw_renderer_destroy(renderer);
+    sw_renderer_close_profile();
     viewer_shutdown();
+    sw_renderer_stop_threads();
     return 0;
     
 }
@@ -3,6 +3,7 @@
 #include "model.h"
 #include <algorithm>
 #include "tgaimage.h"
+#include "rasterizer.h"
 
 Model::Model(const std::string& filename) {
     std::ifstream in;
@@ -40,11 +41,33 @@ Model::Model(const std::string& filename) {
         }
     }
     std::cerr << "# v# " << nverts() << " f# "  << nfaces() << " vt# " << tex_coords.size() << std::endl;
+    compute_bounds();
+    build_clusters();
+}
+
+void Model::compute_bounds() {
+    if (verts.empty()) return;
+    vec3 lo = verts[0], hi = verts[0];
+    for (const vec3& v : verts)
+        for (int i : {0,1,2}) {
+            lo[i] = std::min(lo[i], v[i]);
+            hi[i] = std::max(hi[i], v[i]);
+        }
+    bound_center = (lo + hi) / 2.;
+    bound_radius = 0;
+    for (const vec3& v : verts)
+        bound_radius = std::max(bound_radius, norm(v - bound_center));
+}
+
+// Decoded bottom to top, as sampled below
+static std::shared_ptr<const Texture> load_texture(const std::string& filename) {
+    TGAImage image;
+    if (!image.read_tga_file(filename, true)) return nullptr;
+    return std::make_shared<Texture>(std::move(image));
 }
 
 Model::Model(const std::string& filename, const std::string& normal_map_filename) : Model(filename) {
-    if (normal_map.read_tga_file(normal_map_filename.c_str())) {
-        normal_map.flip_vertically();
+    if ((normal_map = load_texture(normal_map_filename))) {
         has_normal_map = true;
         std::cerr << "Normal map loaded: " << normal_map_filename << std::endl;
     } else {
@@ -52,17 +75,8 @@ Model::Model(const std::string& filename, const std::string& normal_map_filename
     }
 }
 
-Model::Model(const std::string& filename, const std::string& normal_map_filename, const std::string& color_texture_filename) : Model(filename) {
-    if (normal_map.read_tga_file(normal_map_filename.c_str())) {
-        normal_map.flip_vertically();
-        has_normal_map = true;
-        std::cerr << "Normal map loaded: " << normal_map_filename << std::endl;
-    } else {
-        std::cerr << "Failed to load normal map: " << normal_map_filename << std::endl;
-    }
-    
-    if (color_texture.read_tga_file(color_texture_filename.c_str())) {
-        color_texture.flip_vertically();
+Model::Model(const std::string& filename, const std::string& normal_map_filename, const std::string& color_texture_filename) : Model(filename, normal_map_filename) {
+    if ((color_texture = load_texture(color_texture_filename))) {
         has_color_texture = true;
         std::cerr << "Color texture loaded: " << color_texture_filename << std::endl;
     } else {
@@ -70,39 +84,89 @@ Model::Model(const std::string& filename, const std::string& normal_map_filename
     }
 }
 
-int Model::nverts() const { return verts.size(); }
-int Model::nfaces() const { return facet_vrt.size()/3; }
+void Model::set_normal_map(const std::shared_ptr<const Texture>& map) {
+    normal_map = map;
+    has_normal_map = true;
+    for (Model& lod : lods) lod.set_normal_map(map);
+}
 
-vec3 Model::vert(const int i) const {
-    return verts[i];
+void Model::set_color_texture(const std::shared_ptr<const Texture>& texture) {
+    color_texture = texture;
+    has_color_texture = true;
+    for (Model& lod : lods) lod.set_color_texture(texture);
 }
 
-vec3 Model::vert(const int iface, const int nthvert) const {
-    return verts[facet_vrt[iface*3+nthvert]];
+// Coordinates are rounded to 1/65535 of their bounding box, 15 micrometres on a 1 m model
+template<int n> static void quantize_coords(const std::vector<vec<n>>& in, std::vector<std::array<std::uint16_t,n>>& out, vec<n>& origin, vec<n>& step) {
+    vec<n> lo = in[0], hi = in[0];
+    for (const vec<n>& v : in)
+        for (int k=0; k<n; k++) {
+            lo[k] = std::min(lo[k], v[k]);
+            hi[k] = std::max(hi[k], v[k]);
+        }
+    origin = lo;
+    for (int k=0; k<n; k++) step[k] = (hi[k] - lo[k]) / 65535;
+    out.resize(in.size());
+    for (size_t i=0; i<in.size(); i++)
+        for (int k=0; k<n; k++)
+            out[i][k] = step[k] > 0 ? std::lround((in[i][k] - lo[k]) / step[k]) : 0;
 }
 
-int Model::get_vertex_index(const int iface, const int nthvert) const {
-    return facet_vrt[iface*3+nthvert];
+void Model::quantize() {
+    if (is_quantized || verts.empty()) return;
+    for (Model& lod : lods) lod.quantize();
+
+    // Normals and tangents from the full precision data, as the shaders would compute them
+    std::vector<vec3> normals(verts.size(), {0, 0, 0});
+    packed_tangents.resize(tex_coords.empty() ? 0 : nfaces());
+    for (int f=0; f<nfaces(); f++) {
+        const vec3 n = normalized(cross(vert(f, 1) - vert(f, 0), vert(f, 2) - vert(f, 0)));
+        for (int k : {0,1,2}) normals[facet_vrt[f*3+k]] = normals[facet_vrt[f*3+k]] + n;
+        if (tex_coords.empty()) continue;
+        vec3 tangent, bitangent;
+        calculate_tangent_space(*this, f, tangent, bitangent);
+        packed_tangents[f] = octahedral_encode(std::isfinite(tangent.x) ? tangent : vec3{1, 0, 0}); // degenerate UVs
+    }
+    packed_normals.resize(verts.size());
+    for (size_t i=0; i<verts.size(); i++)
+        packed_normals[i] = octahedral_encode(norm(normals[i]) > 0 ? normalized(normals[i]) : vec3{0, 0, 1});
+
+    quantize_coords<3>(verts, qverts, vert_origin, vert_step);
+    if (!tex_coords.empty()) quantize_coords<2>(tex_coords, qtex_coords, tex_origin, tex_step);
+    std::vector<vec3>().swap(verts);
+    std::vector<vec2>().swap(tex_coords);
+    is_quantized = true;
+
+    // Rounding moves a vertex by up to half a step: keep the culling spheres conservative
+    const double slack = norm(vert_step) / 2;
+    bound_radius += slack;
+    for (Cluster& c : face_clusters) c.radius += slack;
 }
 
-vec2 Model::tex_coord(const int iface, const int nthvert) const {
-    int idx = facet_tex[iface*3+nthvert];
-    return tex_coords[idx];
+size_t Model::size_bytes() const {
+    size_t bytes = verts.size()*sizeof(vec3) + tex_coords.size()*sizeof(vec2)
+                 + qverts.size()*sizeof(qverts[0]) + qtex_coords.size()*sizeof(qtex_coords[0])
+                 + (packed_normals.size() + packed_tangents.size())*sizeof(std::uint32_t)
+                 + (facet_vrt.size() + facet_tex.size())*sizeof(int) + face_clusters.size()*sizeof(Cluster);
+    for (const Model& lod : lods) bytes += lod.size_bytes();
+    return bytes;
 }
 
 vec3 Model::normal(const vec2& uv) const {
     if (!has_normal_map) return {0, 0, 1};
     
-    int x = (int)(uv.x * normal_map.width());
-    int y = (int)(uv.y * normal_map.height());
-    x = std::max(0, std::min(x, (int)normal_map.width() - 1));
-    y = std::max(0, std::min(y, (int)normal_map.height() - 1));
+    int x = (int)(uv.x * normal_map->width());
+    int y = (int)(uv.y * normal_map->height());
+    x = std::max(0, std::min(x, (int)normal_map->width() - 1));
+    y = std::max(0, std::min(y, (int)normal_map->height() - 1));
     
-    TGAColor c = normal_map.get(x, y);
+    TGAColor c = normal_map->fetch(x, y);
     vec3 n;
     n.x = (c[2] / 255.0) * 2.0 - 1.0; // Red -> X
     n.y = (c[1] / 255.0) * 2.0 - 1.0; // Green -> Y  
     n.z = (c[0] / 255.0) * 2.0 - 1.0; // Blue -> Z
+    if (normal_map->compression() == TEXTURE_BC5) // only X and Y are stored, Z is positive in tangent space
+        n.z = std::sqrt(std::max(0., 1 - n.x*n.x - n.y*n.y));
     
     
     return normalized(n);
@@ -111,12 +175,12 @@ vec3 Model::normal(const vec2& uv) const {
 vec3 Model::color(const vec2& uv) const {
     if (!has_color_texture) return {1, 1, 1}; // Default white color
     
-    int x = (int)(uv.x * color_texture.width());
-    int y = (int)(uv.y * color_texture.height());
-    x = std::max(0, std::min(x, (int)color_texture.width() - 1));
-    y = std::max(0, std::min(y, (int)color_texture.height() - 1));
+    int x = (int)(uv.x * color_texture->width());
+    int y = (int)(uv.y * color_texture->height());
+    x = std::max(0, std::min(x, (int)color_texture->width() - 1));
+    y = std::max(0, std::min(y, (int)color_texture->height() - 1));
     
-    TGAColor c = color_texture.get(x, y);
+    TGAColor c = color_texture->fetch(x, y);
     vec3 color;
     // Try swapping red and blue channels
     color.x = c[0] / 255.0; // Red (from blue channel)
@@ -0,0 +1,192 @@
+#include "profiler.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <vector>
+
+struct TraceEvent {
+    ProfileStage stage;
+    double ts, dur; // microseconds since profiler_open()
+    int tid;
+};
+
+static const char* g_stage_names[STAGE_COUNT] = {
+    "frame", "clear", "skinning", "vertex", "normals", "setup", "binning", "raster", "shading", "ssao", "upscale", "convert", "present"
+};
+static const char* g_counter_names[COUNTER_COUNT] = {
+    "triangles_submitted", "triangles_culled", "triangles_backfaced", "pixels_tested", "pixels_passed", "pixels_covered", "pixels_reused", "pixels_coarse",
+    "heap_allocations", "frame_arena_bytes"
+};
+
+static bool g_open = false;
+static std::ofstream g_trace, g_csv;
+static bool g_first_event = true;
+static int g_frame = 0;
+static std::chrono::steady_clock::time_point g_open_time;
+static std::uint64_t g_open_ticks = 0;
+
+static std::mutex g_mutex;                  // guards the scoped events of the current frame
+static std::vector<TraceEvent> g_events;
+static double g_scoped_us[STAGE_COUNT] = {};
+static std::atomic<std::uint64_t> g_stage_ticks[STAGE_COUNT];
+static std::atomic<std::uint64_t> g_counters[COUNTER_COUNT];
+
+static double elapsed_us(const std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration<double, std::micro>(t - g_open_time).count();
+}
+
+static int thread_index() {
+    static std::atomic<int> next{0};
+    thread_local int index = next++;
+    return index;
+}
+
+static void write_event(const char* json) {
+    g_trace << (g_first_event ? "\n" : ",\n") << json;
+    g_first_event = false;
+}
+
+bool profiler_open(const std::string& trace_filename, const std::string& csv_filename) {
+#ifndef SW_PROFILE
+    (void)trace_filename; (void)csv_filename;
+    std::cerr << "Profiling is not compiled in, reconfigure with -DSW_PROFILE=ON" << std::endl;
+    return false;
+#else
+    if (!trace_filename.empty()) {
+        g_trace.open(trace_filename);
+        if (!g_trace.is_open()) {
+            std::cerr << "can't open trace file " << trace_filename << std::endl;
+            return false;
+        }
+        g_trace << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    }
+    if (!csv_filename.empty()) {
+        g_csv.open(csv_filename);
+        if (!g_csv.is_open()) {
+            std::cerr << "can't open csv file " << csv_filename << std::endl;
+            return false;
+        }
+        g_csv << "frame";
+        for (int s=0; s<STAGE_COUNT; s++) g_csv << "," << g_stage_names[s] << "_ms";
+        for (int c=0; c<COUNTER_COUNT; c++) g_csv << "," << g_counter_names[c];
+        g_csv << ",overdraw\n";
+    }
+    for (auto& t : g_stage_ticks) t = 0;
+    for (auto& c : g_counters) c = 0;
+    g_open_time = std::chrono::steady_clock::now();
+    g_open_ticks = profile_ticks();
+    g_open = true;
+    return true;
+#endif
+}
+
+void profiler_close() {
+    if (!g_open) return;
+    if (g_trace.is_open()) {
+        g_trace << "\n]}\n";
+        g_trace.close();
+    }
+    if (g_csv.is_open()) g_csv.close();
+    g_open = false;
+}
+
+void profiler_add_ticks(const ProfileStage stage, const std::uint64_t ticks) {
+    g_stage_ticks[stage].fetch_add(ticks, std::memory_order_relaxed);
+}
+
+void profiler_count(const ProfileCounter counter, const std::uint64_t n) {
+    g_counters[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+void profiler_record(const ProfileStage stage, const std::chrono::steady_clock::time_point start, const std::chrono::steady_clock::time_point end) {
+    if (!g_open) return;
+    TraceEvent event = {stage, elapsed_us(start), elapsed_us(end) - elapsed_us(start), thread_index()};
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_events.push_back(event);
+    g_scoped_us[stage] += event.dur;
+}
+
+void profiler_end_frame() {
+    if (!g_open) return;
+    const double now_us = elapsed_us(std::chrono::steady_clock::now());
+    const double ticks_per_us = (profile_ticks() - g_open_ticks) / std::max(now_us, 1.0); // calibrated over the whole run
+
+    static std::vector<TraceEvent> events; // swapped with g_events, both keep their capacity across frames
+    events.clear();
+    double stage_ms[STAGE_COUNT];
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        events.swap(g_events);
+        for (int s=0; s<STAGE_COUNT; s++) {
+            stage_ms[s] = (g_scoped_us[s] + g_stage_ticks[s].exchange(0)/ticks_per_us) / 1000.0;
+            g_scoped_us[s] = 0;
+        }
+    }
+    std::uint64_t counts[COUNTER_COUNT];
+    for (int c=0; c<COUNTER_COUNT; c++) counts[c] = g_counters[c].exchange(0);
+    const double overdraw = counts[COUNTER_PIXELS_COVERED] ? double(counts[COUNTER_PIXELS_PASSED])/counts[COUNTER_PIXELS_COVERED] : 0.;
+
+    if (g_trace.is_open()) {
+        // Scoped stages as complete events, the accumulated hot-path stages (summed over threads) and counters as counter tracks
+        // Formatted into fixed buffers so that tracing does not allocate either
+        char buf[1024];
+        for (const TraceEvent& e : events) {
+            snprintf(buf, sizeof(buf), "{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%d,\"args\":{\"frame\":%d}}",
+                     g_stage_names[e.stage], e.ts, e.dur, e.tid, g_frame);
+            write_event(buf);
+        }
+        int n = snprintf(buf, sizeof(buf), "{\"name\":\"hot path ms\",\"ph\":\"C\",\"ts\":%f,\"pid\":0,\"args\":{", now_us);
+        for (ProfileStage s : {STAGE_VERTEX, STAGE_SETUP, STAGE_RASTER, STAGE_SHADING})
+            n += snprintf(buf+n, sizeof(buf)-n, "%s\"%s\":%f", s==STAGE_VERTEX ? "" : ",", g_stage_names[s], stage_ms[s]);
+        snprintf(buf+n, sizeof(buf)-n, "}}");
+        write_event(buf);
+        n = snprintf(buf, sizeof(buf), "{\"name\":\"counters\",\"ph\":\"C\",\"ts\":%f,\"pid\":0,\"args\":{", now_us);
+        for (int c=0; c<COUNTER_COUNT; c++)
+            n += snprintf(buf+n, sizeof(buf)-n, "%s\"%s\":%llu", c ? "," : "", g_counter_names[c], (unsigned long long)counts[c]);
+        snprintf(buf+n, sizeof(buf)-n, ",\"overdraw\":%f}}", overdraw);
+        write_event(buf);
+    }
+    if (g_csv.is_open()) {
+        g_csv << g_frame;
+        for (int s=0; s<STAGE_COUNT; s++) g_csv << "," << stage_ms[s];
+        for (int c=0; c<COUNTER_COUNT; c++) g_csv << "," << counts[c];
+        g_csv << "," << overdraw << "\n";
+    }
+    g_frame++;
+}
+
+#ifdef SW_PROFILE
+// Replacement of the global allocation functions that counts the calls, so that the trace and CSV
+// show which frames still touch the heap. The array forms and nothrow variants forward to these.
+void* operator new(std::size_t size) {
+    g_counters[COUNTER_HEAP_ALLOCATIONS].fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, std::align_val_t align) {
+    g_counters[COUNTER_HEAP_ALLOCATIONS].fetch_add(1, std::memory_order_relaxed);
+    const std::size_t a = static_cast<std::size_t>(align);
+#ifdef _WIN32
+    if (void* p = _aligned_malloc(size ? size : 1, a)) return p;
+#else
+    if (void* p = std::aligned_alloc(a, (std::max<std::size_t>(size, 1) + a - 1) / a * a)) return p;
+#endif
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+#ifdef _WIN32
+void operator delete(void* p, std::align_val_t) noexcept { _aligned_free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { _aligned_free(p); }
+#else
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+#endif
+#endif
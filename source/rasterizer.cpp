@@ -1,47 +1,71 @@
 #include "rasterizer.h"
+#include "shader.h"
+#include "heatmap.h"
+#include "animation.h"
+#include "temporal.h"
 #include <algorithm>
 #include <cmath>
+#include <limits>
+#include <type_traits>
 
-// External matrix variables from main.cpp
-extern mat<4,4> ModelView, Viewport, Perspective;
-
-// Global lighting setup
-const Material material = {
-    {0.1f, 0.1f, 0.1f},    // ambient
-    {0.7f, 0.7f, 0.7f},    // diffuse
-    {1.0f, 1.0f, 1.0f},     // specular
-    32.0f                   // shininess
-};
-
-const Light light = {
-    {1.0f, 1.0f, 1.0f},     // position
-    {0.2f, 0.2f, 0.2f},     // ambient
-    {0.8f, 0.8f, 0.8f},     // diffuse
-    {1.0f, 1.0f, 1.0f}       // specular
+// Lights live in the same (object) space as the vertices handed to rasterize()
+const Lighting default_lighting = {
+    {
+        {
+            {1.0f, 1.0f, 1.0f},     // position
+            {0.2f, 0.2f, 0.2f},     // ambient
+            {0.8f, 0.8f, 0.8f},     // diffuse
+            {1.0f, 1.0f, 1.0f}      // specular
+        }
+    },
+    {
+        {0.1f, 0.1f, 0.1f},    // ambient
+        {0.7f, 0.7f, 0.7f},    // diffuse
+        {1.0f, 1.0f, 1.0f},    // specular
+        32.0f                  // shininess
+    },
+    {0.0f, 0.0f, 2.0f}         // view position for the specular term
 };
 
-const vec3 viewPos = {0.0f, 0.0f, 2.0f};  // camera position for specular calculation
-
-vec3 calculate_phong_lighting(const vec3& worldPos, const vec3& normal, const Material& mat, const Light& light, const vec3& viewPos) {
+vec3 calculate_phong_lighting(const vec3& worldPos, const vec3& normal, const Material& mat, const std::vector<Light>& lights,
+                              const int* light_ids, const int nlights, const vec3& viewPos) {
     // Normalize vectors
     vec3 norm = normalized(normal);
-    vec3 lightDir = normalized(light.position - worldPos);
     vec3 viewDir = normalized(viewPos - worldPos);
-    vec3 reflectDir = normalized(2.0f * dot(norm, lightDir) * norm - lightDir);
-    
-    // Ambient component
-    vec3 ambient = {mat.ambient.x * light.ambient.x, mat.ambient.y * light.ambient.y, mat.ambient.z * light.ambient.z};
-    
-    // Diffuse component
-    float diff = std::max(0.0f, (float)dot(norm, lightDir));
-    vec3 diffuse = {mat.diffuse.x * light.diffuse.x * diff, mat.diffuse.y * light.diffuse.y * diff, mat.diffuse.z * light.diffuse.z * diff};
-    
-    // Specular component
-    float spec = std::pow(std::max(0.0f, (float)dot(viewDir, reflectDir)), mat.shininess);
-    vec3 specular = {mat.specular.x * light.specular.x * spec, mat.specular.y * light.specular.y * spec, mat.specular.z * light.specular.z * spec};
-    
-    // Combine all components
-    vec3 result = ambient + diffuse + specular;
+    vec3 result = {0, 0, 0};
+
+    for (int i=0; i<nlights; i++) {
+        const Light& light = lights[light_ids[i]];
+        vec3 lightDir;
+        double attenuation = 1.0;
+        if (light.type == DIRECTIONAL_LIGHT) {
+            lightDir = normalized(light.position);
+        } else {
+            vec3 toLight = light.position - worldPos;
+            if (light.range > 0) {
+                // windowed falloff that reaches exactly zero at the range, so tiles outside it can skip the light
+                double k = (toLight*toLight)/(light.range*light.range);
+                if (k >= 1) continue;
+                attenuation = (1-k)*(1-k);
+            }
+            lightDir = normalized(toLight);
+        }
+        vec3 reflectDir = normalized(2.0f * dot(norm, lightDir) * norm - lightDir);
+
+        // Ambient component
+        vec3 ambient = {mat.ambient.x * light.ambient.x * attenuation, mat.ambient.y * light.ambient.y * attenuation, mat.ambient.z * light.ambient.z * attenuation};
+
+        // Diffuse component
+        float diff = std::max(0.0f, (float)dot(norm, lightDir)) * attenuation;
+        vec3 diffuse = {mat.diffuse.x * light.diffuse.x * diff, mat.diffuse.y * light.diffuse.y * diff, mat.diffuse.z * light.diffuse.z * diff};
+
+        // Specular component
+        float spec = std::pow(std::max(0.0f, (float)dot(viewDir, reflectDir)), mat.shininess) * attenuation;
+        vec3 specular = {mat.specular.x * light.specular.x * spec, mat.specular.y * light.specular.y * spec, mat.specular.z * light.specular.z * spec};
+
+        // Accumulate all components
+        result = result + ambient + diffuse + specular;
+    }
     
     // Clamp values to [0,1]
     result.x = std::min(1.0f, std::max(0.0f, (float)result.x));
@@ -51,118 +75,246 @@ vec3 calculate_phong_lighting(const vec3& worldPos, const vec3& normal, const Ma
     return result;
 }
 
-void rasterize(const vec4 clip[3], const vec3 worldPos[3], const vec3 normals[3], 
-               const vec2 texCoords[3], const Model& model, std::vector<double> &zbuffer, TGAImage &framebuffer, bool use_normal_mapping, bool use_color_texture) {
-    vec4 ndc[3]    = { clip[0]/clip[0].w, clip[1]/clip[1].w, clip[2]/clip[2].w };                // normalized device coordinates
-    vec2 screen[3] = { (Viewport*ndc[0]).xy(), (Viewport*ndc[1]).xy(), (Viewport*ndc[2]).xy() }; // screen coordinates
-
-    mat<3,3> ABC = {{ {screen[0].x, screen[0].y, 1.}, {screen[1].x, screen[1].y, 1.}, {screen[2].x, screen[2].y, 1.} }};
-    if (ABC.det()<1) return; // backface culling + discarding triangles that cover less than a pixel
-
-    auto [bbminx,bbmaxx] = std::minmax({screen[0].x, screen[1].x, screen[2].x}); // bounding box for the triangle
-    auto [bbminy,bbmaxy] = std::minmax({screen[0].y, screen[1].y, screen[2].y}); // defined by its top left and bottom right corners
-
-    #pragma omp parallel for
-    for (int y=std::max<int>(bbminy, 0); y<=std::min<int>(bbmaxy, framebuffer.height()-1); y++) { // clip the bounding box by the screen
-        for (int x=std::max<int>(bbminx, 0); x<=std::min<int>(bbmaxx, framebuffer.width()-1); x++) {
-            vec3 bc = ABC.invert_transpose() * vec3{static_cast<double>(x), static_cast<double>(y), 1.}; // barycentric coordinates of {x,y} w.r.t the triangle
-            if (bc.x<0 || bc.y<0 || bc.z<0) continue;                                                    // negative barycentric coordinate => the pixel is outside the triangle
-            double z = bc * vec3{ ndc[0].z, ndc[1].z, ndc[2].z };
-            if (z <= zbuffer[x+y*framebuffer.width()]) continue;
-            zbuffer[x+y*framebuffer.width()] = z;
-            
-            // Interpolate world position, normal, and UV coordinates using barycentric coordinates
-            vec3 worldPos_interp = bc.x * worldPos[0] + bc.y * worldPos[1] + bc.z * worldPos[2];
-            vec3 normal_interp = bc.x * normals[0] + bc.y * normals[1] + bc.z * normals[2];
-            vec2 uv_interp = bc.x * texCoords[0] + bc.y * texCoords[1] + bc.z * texCoords[2];
-            
-            // Sample normal map if available and enabled
-            vec3 final_normal = normal_interp;
-            if (use_normal_mapping && model.has_normal()) {
-                vec3 normal_map_sample = model.normal(uv_interp);
-                
-                // Calculate tangent space
-                vec3 tangent, bitangent;
-                // For simplicity, we'll use a basic tangent space calculation
-                // In a full implementation, you'd want to pre-calculate these
-                vec3 edge1 = worldPos[1] - worldPos[0];
-                vec3 edge2 = worldPos[2] - worldPos[0];
-                vec2 deltaUV1 = texCoords[1] - texCoords[0];
-                vec2 deltaUV2 = texCoords[2] - texCoords[0];
-                
-                double f = 1.0 / (deltaUV1.x * deltaUV2.y - deltaUV2.x * deltaUV1.y);
-                tangent.x = f * (deltaUV2.y * edge1.x - deltaUV1.y * edge2.x);
-                tangent.y = f * (deltaUV2.y * edge1.y - deltaUV1.y * edge2.y);
-                tangent.z = f * (deltaUV2.y * edge1.z - deltaUV1.y * edge2.z);
-                tangent = normalized(tangent);
-                
-                bitangent = normalized(cross(normal_interp, tangent));
-                
-                // Transform normal from tangent space to world space
-                // TBN matrix: [T, B, N] where T=tangent, B=bitangent, N=normal
-                mat<3,3> TBN = {{{tangent.x, bitangent.x, normal_interp.x},
-                                {tangent.y, bitangent.y, normal_interp.y},
-                                {tangent.z, bitangent.z, normal_interp.z}}};
-                final_normal = normalized(TBN * normal_map_sample);
+void RenderContext::lookat(const vec3 eye, const vec3 center, const vec3 up) {
+    vec3 z = normalized(eye - center);          // forward (camera space +Z points backward)
+    vec3 x = normalized(cross(up, z));          // right
+    vec3 y = cross(z, x);                       // true up
+
+    mat<4,4> rotation = {{{x.x, x.y, x.z, 0}, {y.x, y.y, y.z, 0}, {z.x, z.y, z.z, 0}, {0, 0, 0, 1}}};
+    mat<4,4> translation = {{{1, 0, 0, -eye.x}, {0, 1, 0, -eye.y}, {0, 0, 1, -eye.z}, {0, 0, 0, 1}}};
+    ModelView = rotation * translation;
+}
+
+void RenderContext::perspective_fov(const double fov_degrees) {
+    constexpr double Pi = 3.14159265358979323846;
+    const double f = 1.0 / std::tan((fov_degrees * Pi / 180.0) * 0.5);
+    Perspective = {{{1,0,0,0}, {0,1,0,0}, {0,0,1,0}, {0,0,-1.0/f,1}}};
+}
+
+void RenderContext::viewport(const int x, const int y, const int w, const int h) {
+    Viewport = {{{w/2., 0, 0, x+w/2.}, {0, h/2., 0, y+h/2.}, {0,0,1,0}, {0,0,0,1}}};
+}
+
+mat<4,4> model_rotation(const double angleX, const double angleY) {
+    const double cy = std::cos(angleY), sy = std::sin(angleY);
+    const double cx = std::cos(angleX), sx = std::sin(angleX);
+    mat<4,4> RotY = {{{ cy, 0, sy, 0}, {0, 1, 0, 0}, {-sy, 0, cy, 0}, {0, 0, 0, 1}}};
+    mat<4,4> RotX = {{{ 1, 0, 0, 0}, {0, cx, -sx, 0}, {0, sx, cx, 0}, {0, 0, 0, 1}}};
+    return RotY * RotX;
+}
+
+ClusterCuller::ClusterCuller(const RenderContext& ctx, const mat<4,4>& MVP, const double x0, const double y0, const double x1, const double y1) {
+    // Centre of projection: the point mapped to x = y = w = 0
+    mat<3,3> A = {{{MVP[0][0], MVP[0][1], MVP[0][2]}, {MVP[1][0], MVP[1][1], MVP[1][2]}, {MVP[3][0], MVP[3][1], MVP[3][2]}}};
+    eye = A.invert() * vec3{-MVP[0][3], -MVP[1][3], -MVP[3][3]};
+
+    // A point is inside when x0 <= x/w <= x1, y0 <= y/w <= y1 (screen coordinates) and w > 0
+    const mat<4,4> M = affine_product(ctx.Viewport, MVP);
+    planes[0] = M[0] - M[3]*x0;
+    planes[1] = M[3]*x1 - M[0];
+    planes[2] = M[1] - M[3]*y0;
+    planes[3] = M[3]*y1 - M[1];
+    planes[4] = M[3];
+    for (vec4& p : planes)
+        p = p / norm(p.xyz());
+}
+
+bool ClusterCuller::backfacing(const Cluster& cluster) const {
+    // Every normal is within the cone and every triangle within the sphere, see
+    // "Optimizing the graphics pipeline with compute" (Wihlidal) and meshoptimizer's cone test
+    const vec3 view = cluster.center - eye;
+    return view*cluster.cone_axis >= cluster.cone_cutoff*norm(view) + cluster.radius;
+}
+
+bool ClusterCuller::outside(const Cluster& cluster) const {
+    const vec4 c = {cluster.center.x, cluster.center.y, cluster.center.z, 1.};
+    for (const vec4& p : planes)
+        if (p*c < -cluster.radius) return true;
+    return false;
+}
+
+// Picks the level of detail from the projected size of the model's bounding sphere
+int select_lod(const RenderContext& ctx, const Model& model, const mat<4,4>& MVP) {
+    if (ctx.lod_triangle_area <= 0 || model.nlods() == 1 || model.animation()) return 0;
+    const vec3 c = model.center();
+    const double w = (MVP * vec4{c.x, c.y, c.z, 1.}).w;
+    if (w <= 0) return 0; // the camera is inside the bounding sphere
+    const double r = model.radius() * ctx.Viewport[0][0] * ctx.Perspective[0][0] / w; // projected radius in pixels
+    const double area = 3.14159265358979323846 * r * r;
+
+    // Finest level whose front-facing triangles (about half of them) are not smaller than the target area
+    int level = 0;
+    while (level+1 < model.nlods() && area / (model.lod(level).nfaces()/2.) < ctx.lod_triangle_area) level++;
+    return level;
+}
+
+bool project_sphere(const RenderContext& ctx, const vec3& center, const double radius, const mat<4,4>& MVP, double& minx, double& miny, double& maxx, double& maxy) {
+    // Project the corners of the box around the sphere
+    minx = miny = std::numeric_limits<double>::max();
+    maxx = maxy = -minx;
+    for (int c=0; c<8; c++) {
+        vec3 corner = center + vec3{c&1 ? radius : -radius, c&2 ? radius : -radius, c&4 ? radius : -radius};
+        vec4 clip = MVP * vec4{corner.x, corner.y, corner.z, 1.};
+        if (clip.w <= 0) return false;
+        vec2 screen = (ctx.Viewport * (clip/clip.w)).xy();
+        minx = std::min(minx, screen.x); maxx = std::max(maxx, screen.x);
+        miny = std::min(miny, screen.y); maxy = std::max(maxy, screen.y);
+    }
+    return true;
+}
+
+void DirtyTiles::reset(const int w, const int h) {
+    width = w;
+    height = h;
+    tiles_x = (width  + TileBins::tile_size - 1) / TileBins::tile_size;
+    tiles_y = (height + TileBins::tile_size - 1) / TileBins::tile_size;
+    tiles.assign(tiles_x*tiles_y, 0);
+    xmin = ymin = 0;
+    xmax = ymax = -1;
+}
+
+void DirtyTiles::add(const int x0, const int y0, const int x1, const int y1) {
+    const int tx0 = std::max(x0, 0) / TileBins::tile_size, tx1 = std::min(x1, width-1)  / TileBins::tile_size;
+    const int ty0 = std::max(y0, 0) / TileBins::tile_size, ty1 = std::min(y1, height-1) / TileBins::tile_size;
+    if (tx0 > tx1 || ty0 > ty1) return;
+    for (int ty=ty0; ty<=ty1; ty++)
+        for (int tx=tx0; tx<=tx1; tx++)
+            tiles[tx + ty*tiles_x] = 1;
+    const bool first = empty();
+    xmin = first ? tx0*TileBins::tile_size : std::min(xmin, tx0*TileBins::tile_size);
+    ymin = first ? ty0*TileBins::tile_size : std::min(ymin, ty0*TileBins::tile_size);
+    xmax = std::max(xmax, std::min((tx1+1)*TileBins::tile_size, width)  - 1);
+    ymax = std::max(ymax, std::min((ty1+1)*TileBins::tile_size, height) - 1);
+}
+
+bool DirtyTiles::misses(const RenderContext& ctx, const Model& model, const mat<4,4>& MVP) const {
+    double minx, miny, maxx, maxy;
+    if (model.animation()) return false; // the bounding sphere is the bind pose's
+    if (!project_sphere(ctx, model.center(), model.radius(), MVP, minx, miny, maxx, maxy)) return false;
+    return maxx < xmin || minx > xmax+1 || maxy < ymin || miny > ymax+1;
+}
+
+// Largest step of a channel between the pixels of [x0,x1)x[y0,y1) and their upper and right
+// neighbours on the same surface, that is without a jump in depth. The background is at -max, a
+// jump from everything.
+static int surface_step(const TGAImage& frame, const std::vector<double>& zbuffer, const int x0, const int y0, const int x1, const int y1) {
+    constexpr double depth_jump = 1e-2; // NDC, larger steps are silhouettes that per-pixel coverage resolves anyway
+    const int w = frame.width(), h = frame.height(), bpp = frame.bytespp();
+    int step = 0;
+    for (int y=y0; y<y1; y++)
+        for (int x=x0; x<x1; x++) {
+            const std::uint8_t* p = frame.buffer() + (size_t(y)*w + x)*bpp;
+            const double z = zbuffer[x + size_t(y)*w];
+            if (y+1 < h && std::abs(zbuffer[x + size_t(y+1)*w] - z) <= depth_jump)
+                for (int k=0; k<bpp; k++) step = std::max(step, std::abs(p[w*bpp + k] - p[k]));
+            if (x+1 < w && std::abs(zbuffer[x+1 + size_t(y)*w] - z) <= depth_jump)
+                for (int k=0; k<bpp; k++) step = std::max(step, std::abs(p[bpp + k] - p[k]));
+        }
+    return step;
+}
+
+void ShadingRates::update(const TGAImage& frame, const std::vector<double>& zbuffer, const bool shaded_at_rates) {
+    constexpr int S = tile_size;
+    const bool rescale = shaded_at_rates && fits(frame.width(), frame.height());
+    width = frame.width();
+    height = frame.height();
+    tiles_x = (width + S - 1) / S;
+    tiles_y = (height + S - 1) / S;
+    rates.resize(tiles_x*tiles_y);
+    const int w = width, h = height, bpp = frame.bytespp(), n = w*bpp; // locals, the row buffers below could alias the members
+    const std::uint8_t* pixels = frame.buffer();
+    // Between the blocks of a coarse square the steps add up over the block, the division by half
+    // of it keeps the rate from oscillating on smooth gradients
+    auto pick = [&](double step, const int previous) {
+        if (previous > 1) step /= previous/2;
+        return step*2 <= threshold ? 4 : step <= threshold ? 2 : 1;
+    };
+    scheduler.parallel_for(0, tiles_y, 1, [&](const int first, const int last) {
+        // Largest step of every byte column of the square's rows to the upper and right neighbours,
+        // so that the squares' borders count too. Masking the steps across depth jumps only lowers
+        // them, so only the squares these steps keep from the coarsest rate are looked at again.
+        FrameVector<std::uint8_t> column_step(n);
+        for (int ty=first; ty<last; ty++) {
+            std::fill(column_step.begin(), column_step.end(), 0);
+            const int y0 = ty*S, y1 = std::min((ty+1)*S, h);
+            for (int y=y0; y<y1; y++) {
+                const std::uint8_t* row = pixels + size_t(y)*n;
+                const std::uint8_t* up = y+1 < h ? row + n : row;
+                std::uint8_t* step = column_step.data();
+                int i = 0;
+#ifdef RASTER_SSE2
+                auto absdiff = [](const __m128i a, const __m128i b) { return _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a)); };
+                for (; i+16+bpp<=n; i+=16) {
+                    const __m128i c = _mm_loadu_si128((const __m128i*)(row+i));
+                    const __m128i s = _mm_max_epu8(absdiff(_mm_loadu_si128((const __m128i*)(up+i)), c), absdiff(_mm_loadu_si128((const __m128i*)(row+i+bpp)), c));
+                    _mm_storeu_si128((__m128i*)(step+i), _mm_max_epu8(_mm_loadu_si128((const __m128i*)(step+i)), s));
+                }
+#endif
+                for (; i<n; i++) {
+                    const int s = std::max(std::abs(up[i] - row[i]), i+bpp < n ? std::abs(row[i+bpp] - row[i]) : 0);
+                    step[i] = std::max<int>(step[i], s);
+                }
             }
-            
-            // Calculate Phong lighting with final normal
-            vec3 lighting = calculate_phong_lighting(worldPos_interp, final_normal, material, light, viewPos);
-            
-            // Apply color texture if enabled
-            vec3 final_color = lighting;
-            if (use_color_texture && model.has_color()) {
-                vec3 texture_color = model.color(uv_interp);
-                // Use texture color as base material color, then apply lighting
-                final_color.x = texture_color.x * lighting.x;
-                final_color.y = texture_color.y * lighting.y;
-                final_color.z = texture_color.z * lighting.z;
+            for (int tx=0; tx<tiles_x; tx++) {
+                const int x0 = tx*S, x1 = std::min((tx+1)*S, w);
+                std::uint8_t& rate = rates[tx + ty*tiles_x];
+                const int previous = rescale ? rate : 1;
+                rate = pick(*std::max_element(column_step.begin() + x0*bpp, column_step.begin() + x1*bpp), previous);
+                if (rate < 4) rate = pick(surface_step(frame, zbuffer, x0, y0, x1, y1), previous);
             }
-            
-            // Convert to TGAColor
-            TGAColor color;
-            color[0] = (unsigned char)(final_color.x * 255);
-            color[1] = (unsigned char)(final_color.y * 255);
-            color[2] = (unsigned char)(final_color.z * 255);
-            color.bytespp = 3;
-            
-            framebuffer.set(x, y, color);
         }
-    }
+    });
 }
 
-void rasterize_simple(const vec4 clip[3], std::vector<double> &zbuffer, TGAImage &framebuffer, const TGAColor color) {
-    vec4 ndc[3]    = { clip[0]/clip[0].w, clip[1]/clip[1].w, clip[2]/clip[2].w };                // normalized device coordinates
-    vec2 screen[3] = { (Viewport*ndc[0]).xy(), (Viewport*ndc[1]).xy(), (Viewport*ndc[2]).xy() }; // screen coordinates
-
-    mat<3,3> ABC = {{ {screen[0].x, screen[0].y, 1.}, {screen[1].x, screen[1].y, 1.}, {screen[2].x, screen[2].y, 1.} }};
-    if (ABC.det()<1) return; // backface culling + discarding triangles that cover less than a pixel
-
-    auto [bbminx,bbmaxx] = std::minmax({screen[0].x, screen[1].x, screen[2].x}); // bounding box for the triangle
-    auto [bbminy,bbmaxy] = std::minmax({screen[0].y, screen[1].y, screen[2].y}); // defined by its top left and bottom right corners
-#pragma omp parallel for
-    for (int x=std::max<int>(bbminx, 0); x<=std::min<int>(bbmaxx, framebuffer.width()-1); x++) { // clip the bounding box by the screen
-        for (int y=std::max<int>(bbminy, 0); y<=std::min<int>(bbmaxy, framebuffer.height()-1); y++) {
-            vec3 bc = ABC.invert_transpose() * vec3{static_cast<double>(x), static_cast<double>(y), 1.}; // barycentric coordinates of {x,y} w.r.t the triangle
-            if (bc.x<0 || bc.y<0 || bc.z<0) continue;                                                    // negative barycentric coordinate => the pixel is outside the triangle
-            double z = bc * vec3{ ndc[0].z, ndc[1].z, ndc[2].z };
-            if (z <= zbuffer[x+y*framebuffer.width()]) continue;
-            zbuffer[x+y*framebuffer.width()] = z;
-            
-            framebuffer.set(x, y, color);
-        }
+void build_light_grid(const RenderContext& ctx, LightGrid& grid, const std::vector<Light>& lights, const mat<4,4>& Model, const int width, const int height) {
+    PROFILE_SCOPE(STAGE_BINNING);
+    grid.tiles_x = (width  + LightGrid::tile_size - 1) / LightGrid::tile_size;
+    grid.tiles_y = (height + LightGrid::tile_size - 1) / LightGrid::tile_size;
+    const int nlights = lights.size();
+    const mat<4,4> MVP = ctx.MVP(Model);
+
+    // Tile rectangle [x0,x1)x[y0,y1) covered by every light: project the corners of the box around
+    // the sphere of influence, unbounded lights (and spheres crossing the camera plane) cover everything
+    FrameVector<int> rects(nlights*4);
+    for (int l=0; l<nlights; l++) {
+        const Light& light = lights[l];
+        int* rect = &rects[l*4];
+        rect[0] = 0; rect[1] = 0; rect[2] = grid.tiles_x; rect[3] = grid.tiles_y;
+        if (light.type == DIRECTIONAL_LIGHT || light.range <= 0) continue;
+
+        double minx, miny, maxx, maxy;
+        if (!project_sphere(ctx, light.position, light.range, MVP, minx, miny, maxx, maxy)) continue;
+        rect[0] = std::clamp<int>(std::floor(minx/LightGrid::tile_size), 0, grid.tiles_x);
+        rect[1] = std::clamp<int>(std::floor(miny/LightGrid::tile_size), 0, grid.tiles_y);
+        rect[2] = std::clamp<int>(std::floor(maxx/LightGrid::tile_size)+1, 0, grid.tiles_x);
+        rect[3] = std::clamp<int>(std::floor(maxy/LightGrid::tile_size)+1, 0, grid.tiles_y);
     }
+
+    // Counting sort of the light indices into the tiles
+    grid.offsets.assign(grid.tiles_x*grid.tiles_y+1, 0);
+    for (int l=0; l<nlights; l++)
+        for (int ty=rects[l*4+1]; ty<rects[l*4+3]; ty++)
+            for (int tx=rects[l*4]; tx<rects[l*4+2]; tx++)
+                grid.offsets[tx+ty*grid.tiles_x+1]++;
+    for (int t=0; t<grid.tiles_x*grid.tiles_y; t++)
+        grid.offsets[t+1] += grid.offsets[t];
+    grid.indices.resize(grid.offsets.back());
+    FrameVector<int> fill(grid.offsets.begin(), grid.offsets.end()-1);
+    for (int l=0; l<nlights; l++)
+        for (int ty=rects[l*4+1]; ty<rects[l*4+3]; ty++)
+            for (int tx=rects[l*4]; tx<rects[l*4+2]; tx++)
+                grid.indices[fill[tx+ty*grid.tiles_x]++] = l;
 }
 
-std::vector<vec3> calculate_vertex_normals(const Model& model) {
-    std::vector<vec3> vertex_normals(model.nverts(), {0, 0, 0});
-    std::vector<int> vertex_face_count(model.nverts(), 0);
+FrameVector<vec3> calculate_vertex_normals(const Model& model, const vec3* positions) {
+    FrameVector<vec3> vertex_normals(model.nverts(), {0, 0, 0});
+    FrameVector<int> vertex_face_count(model.nverts(), 0);
     
     // Calculate face normals and accumulate to vertex normals
     for (int i = 0; i < model.nfaces(); i++) {
-        vec3 v0 = model.vert(i, 0);
-        vec3 v1 = model.vert(i, 1);
-        vec3 v2 = model.vert(i, 2);
+        vec3 v0 = positions ? positions[model.get_vertex_index(i, 0)] : model.vert(i, 0);
+        vec3 v1 = positions ? positions[model.get_vertex_index(i, 1)] : model.vert(i, 1);
+        vec3 v2 = positions ? positions[model.get_vertex_index(i, 2)] : model.vert(i, 2);
         
         vec3 edge1 = v1 - v0;
         vec3 edge2 = v2 - v0;
@@ -186,10 +338,10 @@ std::vector<vec3> calculate_vertex_normals(const Model& model) {
     return vertex_normals;
 }
 
-void calculate_tangent_space(const Model& model, int face_idx, vec3& tangent, vec3& bitangent) {
-    vec3 v0 = model.vert(face_idx, 0);
-    vec3 v1 = model.vert(face_idx, 1);
-    vec3 v2 = model.vert(face_idx, 2);
+void calculate_tangent_space(const Model& model, int face_idx, vec3& tangent, vec3& bitangent, const vec3* positions) {
+    vec3 v0 = positions ? positions[model.get_vertex_index(face_idx, 0)] : model.vert(face_idx, 0);
+    vec3 v1 = positions ? positions[model.get_vertex_index(face_idx, 1)] : model.vert(face_idx, 1);
+    vec3 v2 = positions ? positions[model.get_vertex_index(face_idx, 2)] : model.vert(face_idx, 2);
     
     vec2 uv0 = model.tex_coord(face_idx, 0);
     vec2 uv1 = model.tex_coord(face_idx, 1);
@@ -213,49 +365,75 @@ void calculate_tangent_space(const Model& model, int face_idx, vec3& tangent, ve
     bitangent = normalized(bitangent);
 }
 
-void cpu_rasterize_models(const std::vector<Model>& models, TGAImage& framebuffer, 
-                         std::vector<double>& zbuffer, const mat<4,4>& Model, 
-                         bool smooth_shading, bool use_normal_mapping, bool use_color_texture) {
+FrameVector<vec3> pose_vertices(const RenderContext& ctx, const Model& model) {
+    FrameVector<vec3> positions;
+    if (const Animation* animation = model.animation()) {
+        PROFILE_SCOPE(STAGE_SKINNING);
+        FrameVector<float> palette;
+        animation->palette(ctx.time, palette);
+        animation->skin(model, palette, positions);
+    }
+    return positions;
+}
+
+template<bool smooth_shading, bool normal_mapping, bool color_texture, class Stats>
+static void draw_phong(const RenderContext& ctx, const Model& model, const mat<4,4>& MVP, const LightGrid& light_grid,
+                       std::vector<double>& zbuffer, TGAImage& framebuffer, const Stats& stats, const DirtyTiles* dirty,
+                       TemporalCache* temporal, const std::uint32_t first_id, const ShadingRates* rates) {
+    // The pipeline is chosen once per model: fall back to a variant without the maps the model lacks
+    if constexpr (normal_mapping)
+        if (!model.has_normal()) return draw_phong<smooth_shading, false, color_texture>(ctx, model, MVP, light_grid, zbuffer, framebuffer, stats, dirty, temporal, first_id, rates);
+    if constexpr (color_texture)
+        if (!model.has_color()) return draw_phong<smooth_shading, normal_mapping, false>(ctx, model, MVP, light_grid, zbuffer, framebuffer, stats, dirty, temporal, first_id, rates);
+
+    // Skinned positions of an animated model, in place of the bind pose for everything below
+    const FrameVector<vec3> posed = pose_vertices(ctx, model);
+    const vec3* positions = posed.empty() ? nullptr : posed.data();
+
+    // Calculate vertex normals for smooth shading, quantized models store them (for the bind pose)
+    FrameVector<vec3> vertex_normals;
+    if (smooth_shading && (positions || !model.quantized())) {
+        PROFILE_SCOPE(STAGE_NORMALS);
+        vertex_normals = calculate_vertex_normals(model, positions);
+    }
+
+    PhongShader<smooth_shading, normal_mapping, color_texture> shader = {model, MVP, vertex_normals, light_grid, *ctx.lighting, positions};
+    if constexpr (std::is_same_v<Stats, NoFragmentStats>)
+        if (temporal) // the skinned surface moves on its own, animated models are always shaded
+            return draw_clustered(ctx, TemporalShader<decltype(shader)>{shader, *temporal, positions ? 0 : first_id}, model, MVP, zbuffer, framebuffer, stats, dirty);
+    draw_clustered(ctx, shader, model, MVP, zbuffer, framebuffer, stats, dirty, rates);
+}
+
+template<bool smooth_shading, bool normal_mapping, bool color_texture, class Stats>
+void cpu_rasterize_models(const RenderContext& ctx, const std::vector<Model>& models, TGAImage& framebuffer, 
+                         std::vector<double>& zbuffer, const mat<4,4>& Model, const Stats& stats, const DirtyTiles* dirty,
+                         TemporalCache* temporal, const ShadingRates* rates) {
+    // -- Light culling: bin the lights into screen tiles once per frame
+    LightGrid light_grid;
+    build_light_grid(ctx, light_grid, ctx.lighting->lights, Model, framebuffer.width(), framebuffer.height());
+
     // -- CPU rasterization of all loaded models
+    const mat<4,4> MVP = ctx.MVP(Model);
+    std::uint32_t first_id = 1; // triangle ids for the temporal cache: every level of every model gets its own range
     for (const auto &model : models) {
-        // Calculate vertex normals for smooth shading
-        std::vector<vec3> vertex_normals;
-        if (smooth_shading) {
-            vertex_normals = calculate_vertex_normals(model);
-        }
-        
-        for (int i=0; i<model.nfaces(); i++) {
-            vec4 clip[3];
-            vec3 worldPos[3];
-            vec3 normals[3];
-            vec2 texCoords[3];
-            
-            for (int d : {0,1,2}) {
-                vec3 v = model.vert(i, d);
-                worldPos[d] = v;  // Store world position before transformation
-                clip[d] = Perspective * ModelView * Model * vec4{v.x, v.y, v.z, 1.};
-                texCoords[d] = model.tex_coord(i, d);
-            }
-            
-            if (smooth_shading) {
-                // Use vertex normals for smooth shading
-                for (int d : {0,1,2}) {
-                    int vertex_idx = model.get_vertex_index(i, d);
-                    normals[d] = vertex_normals[vertex_idx];
-                }
-            } else {
-                // Calculate face normal for flat shading
-                vec3 edge1 = worldPos[1] - worldPos[0];
-                vec3 edge2 = worldPos[2] - worldPos[0];
-                vec3 faceNormal = normalized(cross(edge1, edge2));
-                
-                // Use the same normal for all vertices (flat shading)
-                for (int d : {0,1,2}) {
-                    normals[d] = faceNormal;
-                }
-            }
-            
-            rasterize(clip, worldPos, normals, texCoords, model, zbuffer, framebuffer, use_normal_mapping, use_color_texture);
+        const int level = select_lod(ctx, model, MVP);
+        std::uint32_t level_id = first_id;
+        for (int l=0; l<model.nlods(); l++) {
+            if (l == level) level_id = first_id;
+            first_id += model.lod(l).nfaces();
         }
+        if (dirty && dirty->misses(ctx, model, MVP)) continue; // nothing of it to redraw, skip even the vertex normals
+        draw_phong<smooth_shading, normal_mapping, color_texture>(ctx, model.lod(level), MVP, light_grid, zbuffer, framebuffer, stats, dirty, temporal, level_id, rates);
     }
 }
+
+// Pipelines used by the shading modes of the viewer, with and without heatmap statistics
+#define INSTANTIATE_PIPELINE(smooth, normal, color) \
+    template void cpu_rasterize_models<smooth, normal, color, NoFragmentStats>(const RenderContext&, const std::vector<Model>&, TGAImage&, std::vector<double>&, const mat<4,4>&, const NoFragmentStats&, const DirtyTiles*, TemporalCache*, const ShadingRates*); \
+    template void cpu_rasterize_models<smooth, normal, color, HeatmapStats>(const RenderContext&, const std::vector<Model>&, TGAImage&, std::vector<double>&, const mat<4,4>&, const HeatmapStats&, const DirtyTiles*, TemporalCache*, const ShadingRates*);
+INSTANTIATE_PIPELINE(false, false, false)
+INSTANTIATE_PIPELINE(true,  false, false)
+INSTANTIATE_PIPELINE(true,  true,  false)
+INSTANTIATE_PIPELINE(true,  false, true )
+INSTANTIATE_PIPELINE(true,  true,  true )
+#undef INSTANTIATE_PIPELINE
@@ -0,0 +1,88 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "resolution.h"
+#include "arena.h"
+#include "profiler.h"
+#include "scheduler.h"
+
+DynamicResolution::DynamicResolution(const int width, const int height, const double budget_ms)
+    : full_width(width), full_height(height), budget(budget_ms) {
+    steps = std::max(1, width / 16);
+    min_steps = (steps + 1) / 2;
+    level = steps;
+}
+
+int DynamicResolution::width() const {
+    return level == steps ? full_width : level*16;
+}
+
+int DynamicResolution::height() const {
+    if (level == steps) return full_height;
+    return std::max(16, int(std::lround(full_height * double(level) / steps / 16)) * 16);
+}
+
+void DynamicResolution::frame_rendered(const double render_time_ms) {
+    if (budget <= 0) return;
+    recent[nrecent++ % 4] = render_time_ms;
+    // The render time is taken as proportional to the pixel count, the next frames correct the
+    // part that is not (vertex stage, setup)
+    int next = level;
+    if (nrecent >= 2) {
+        const double t = std::min(recent[(nrecent-1) % 4], recent[(nrecent-2) % 4]);
+        if (t > budget) next = std::floor(level * std::sqrt(budget / t));
+    }
+    if (nrecent >= 4 && next == level) {
+        const double t = *std::max_element(recent, recent + 4);
+        if (t < budget*0.75) next = std::max(level + 1, int(std::floor(level * std::min(1.25, std::sqrt(budget*0.9 / t)))));
+    }
+    next = std::clamp(next, min_steps, steps);
+    if (next == level) return;
+    level = next;
+    nrecent = 0;
+}
+
+// One destination row: the two source rows are blended vertically first, then each
+// destination pixel horizontally. Exact in integers, so the order does not change the result.
+template<int bpp> static void upscale_row(const std::uint8_t* row0, const std::uint8_t* row1, const int wy, const int* left, const int* right,
+                                          const int* weight, const int src_width, const int width, int* blend, std::uint8_t* row) {
+    for (int i=0; i<src_width*bpp; i++) blend[i] = row0[i]*(256 - wy) + row1[i]*wy;
+    for (int x=0; x<width; x++) {
+        const int l = left[x], r = right[x], w = weight[x];
+        for (int k=0; k<bpp; k++) row[x*bpp + k] = (blend[l + k]*(256 - w) + blend[r + k]*w + (1 << 15)) >> 16;
+    }
+}
+
+void upscale_bilinear(const TGAImage& src, TGAImage& dst) {
+    PROFILE_SCOPE(STAGE_UPSCALE);
+    if (src.bytespp() != dst.bytespp()) return;
+    const int sw = src.width(), sh = src.height(), bpp = src.bytespp();
+    const int dw = dst.width(), dh = dst.height();
+    // Byte offsets of the two source pixels and 8-bit weight of every destination column, the
+    // same for all rows
+    FrameVector<int> x0(dw), x1(dw), wx(dw);
+    for (int x=0; x<dw; x++) {
+        const double u = std::min(double(sw - 1), x * double(sw) / dw);
+        const int left = int(u);
+        x0[x] = left*bpp;
+        x1[x] = std::min(left + 1, sw - 1)*bpp;
+        wx[x] = int((u - left) * 256);
+    }
+    const std::uint8_t* pixels = src.buffer();
+    std::uint8_t* out = dst.buffer();
+    scheduler.parallel_for(0, dh, 32, [&](const int first, const int last) {
+        FrameVector<int> blend(size_t(sw)*bpp);
+        for (int y=first; y<last; y++) {
+            const double v = std::min(double(sh - 1), y * double(sh) / dh);
+            const int y0 = int(v), y1 = std::min(y0 + 1, sh - 1), wy = int((v - y0) * 256);
+            const std::uint8_t* row0 = pixels + size_t(y0)*sw*bpp;
+            const std::uint8_t* row1 = pixels + size_t(y1)*sw*bpp;
+            std::uint8_t* row = out + size_t(y)*dw*bpp;
+            switch (bpp) {
+                case 1: upscale_row<1>(row0, row1, wy, x0.data(), x1.data(), wx.data(), sw, dw, blend.data(), row); break;
+                case 3: upscale_row<3>(row0, row1, wy, x0.data(), x1.data(), wx.data(), sw, dw, blend.data(), row); break;
+                case 4: upscale_row<4>(row0, row1, wy, x0.data(), x1.data(), wx.data(), sw, dw, blend.data(), row); break;
+            }
+        }
+    });
+}
@@ -0,0 +1,175 @@
+#include <iostream>
+#include "scheduler.h"
+#include "arena.h"
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+Scheduler scheduler;
+thread_local int Scheduler::slot = -1;
+thread_local bool Scheduler::in_background = false;
+
+static void pin_thread(const int index) {
+    const int cpu = index % std::max(1u, std::thread::hardware_concurrency());
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(_WIN32)
+    SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << (cpu % 64));
+#else
+    (void)cpu;
+#endif
+}
+
+void Scheduler::start(int nthreads, const bool pin) {
+    if (nthreads <= 0) nthreads = std::max(1u, std::thread::hardware_concurrency());
+    const int nworkers = std::max(1, nthreads-1);
+    stopping = false;
+    for (int i=0; i<=nworkers; i++) queues.push_back(std::make_unique<Queue>());
+    slot = 0;
+    if (pin) pin_thread(0);
+    for (int i=1; i<=nworkers; i++)
+        workers.emplace_back(&Scheduler::worker, this, i, pin);
+    std::cerr << "# scheduler: " << nworkers+1 << " threads" << (pin ? ", pinned" : "") << std::endl;
+}
+
+void Scheduler::stop() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stopping = true;
+        background_jobs = {};
+    }
+    wakeup.notify_all();
+    for (auto& thread : workers) thread.join();
+    workers.clear();
+    queues.clear();
+    slot = -1;
+}
+
+void Scheduler::Queue::push_back(const Task& task) {
+    if (count == ring.size()) { // full, unroll into a ring twice as large
+        std::vector<Task> grown(std::max<std::size_t>(64, ring.size()*2));
+        for (std::size_t i=0; i<count; i++) grown[i] = ring[(head+i) % ring.size()];
+        ring.swap(grown);
+        head = 0;
+    }
+    ring[(head+count++) % ring.size()] = task;
+}
+
+Scheduler::Task Scheduler::Queue::pop_back() {
+    return ring[(head + --count) % ring.size()];
+}
+
+Scheduler::Task Scheduler::Queue::pop_front() {
+    const Task task = ring[head];
+    head = (head+1) % ring.size();
+    count--;
+    return task;
+}
+
+void Scheduler::push(void (*run)(const void*, const int, const int), const void* body, const int begin, const int end, const int grain, std::atomic<int>& pending) {
+    Queue& queue = *queues[slot];
+    queued += pending.load();
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        for (int first=begin; first<end; first+=grain)
+            queue.push_back({run, body, first, std::min(first+grain, end), &pending, in_background});
+    }
+    { std::lock_guard<std::mutex> lock(sleep_mutex); } // a worker about to sleep either sees the chunks or gets the notification
+    wakeup.notify_all();
+}
+
+void Scheduler::push_background(std::function<void()> job) {
+    if (workers.empty()) { // not started, load synchronously
+        job();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        background_jobs.push(std::move(job));
+    }
+    wakeup.notify_one();
+}
+
+bool Scheduler::pop(Task& task, const bool frame_only) {
+    Queue& queue = *queues[slot];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.count || (frame_only && queue.ring[(queue.head + queue.count - 1) % queue.ring.size()].background)) return false;
+    task = queue.pop_back();
+    queued--;
+    return true;
+}
+
+bool Scheduler::steal(Task& task, const bool frame_only) {
+    if (!queued.load(std::memory_order_relaxed)) return false;
+    const int n = queues.size();
+    for (int i=1; i<n; i++) {
+        Queue& queue = *queues[(slot+i)%n];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.count || (frame_only && queue.ring[queue.head].background)) continue;
+        task = queue.pop_front();
+        queued--;
+        return true;
+    }
+    return false;
+}
+
+// The chunk runs as part of what pushed it, a frame or a background job
+void Scheduler::execute(const Task& task) {
+    const bool outer = in_background;
+    in_background = task.background;
+    task.run(task.body, task.first, task.last);
+    in_background = outer;
+    task.pending->fetch_sub(1, std::memory_order_release);
+}
+
+// The waiting thread keeps running chunks, its own first, until its loop is complete. A frame
+// waiting on its loop only helps with frame chunks, a background chunk could hold it up for long.
+void Scheduler::wait(std::atomic<int>& pending) {
+    Task task;
+    while (pending.load(std::memory_order_acquire) > 0) {
+        if (pop(task, !in_background) || steal(task, !in_background)) execute(task);
+        else std::this_thread::yield();
+    }
+}
+
+void Scheduler::worker(const int index, const bool pin) {
+    slot = index;
+    if (pin) pin_thread(index);
+    frame_arena_share();
+    int idle = 0;
+    for (;;) {
+        Task task;
+        if (pop(task, false) || steal(task, false)) {
+            execute(task);
+            idle = 0;
+            continue;
+        }
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            if (stopping) return;
+            if (!background_jobs.empty()) {
+                job = std::move(background_jobs.front());
+                background_jobs.pop();
+            } else if (++idle > 64) { // spin a little before sleeping, loops come in bursts during a frame
+                wakeup.wait(lock, [this] { return stopping || queued > 0 || !background_jobs.empty(); });
+                idle = 0;
+                continue;
+            }
+        }
+        if (job) {
+            in_background = true;
+            job();
+            in_background = false;
+        }
+        else std::this_thread::yield();
+    }
+}
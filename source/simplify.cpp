@@ -0,0 +1,201 @@
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <queue>
+#include "model.h"
+
+// Quadric error metric (Garland & Heckbert): symmetric 4x4 matrix stored as its upper triangle
+struct Quadric {
+    double q[10] = {0}; // aa ab ac ad bb bc bd cc cd dd
+
+    Quadric() = default;
+    Quadric(const vec3& n, const double d, const double weight) { // plane n.x + d = 0
+        const double p[4] = {n.x, n.y, n.z, d};
+        for (int i=0, k=0; i<4; i++)
+            for (int j=i; j<4; j++)
+                q[k++] = p[i]*p[j]*weight;
+    }
+    Quadric& operator+=(const Quadric& rhs) {
+        for (int i=10; i--; q[i]+=rhs.q[i]);
+        return *this;
+    }
+    double error(const vec3& v) const {
+        return      q[0]*v.x*v.x + 2*q[1]*v.x*v.y + 2*q[2]*v.x*v.z + 2*q[3]*v.x
+                  +   q[4]*v.y*v.y + 2*q[5]*v.y*v.z + 2*q[6]*v.y
+                  +   q[7]*v.z*v.z + 2*q[8]*v.z
+                  +   q[9];
+    }
+    bool minimizer(vec3& v) const { // point of minimal error, if the quadric is not singular
+        mat<3,3> A = {{{q[0], q[1], q[2]}, {q[1], q[4], q[5]}, {q[2], q[5], q[7]}}};
+        if (std::abs(A.det()) < 1e-12) return false;
+        v = A.invert() * vec3{-q[3], -q[6], -q[8]};
+        return true;
+    }
+};
+
+struct Collapse {
+    double cost;
+    int v0, v1;     // v1 is merged into v0
+    int stamp0, stamp1;
+    vec3 target;
+    bool operator<(const Collapse& rhs) const { return cost > rhs.cost; } // min-heap
+};
+
+Model Model::simplified(const int target_faces) const {
+    const int nv = nverts();
+    const int nf = nfaces();
+    std::vector<vec3> pos = verts;
+    std::vector<int> fv = facet_vrt;
+    std::vector<bool> face_alive(nf, true), vert_removed(nv, false);
+    std::vector<std::vector<int>> vert_faces(nv);
+    std::vector<Quadric> quadrics(nv);
+    std::vector<int> stamp(nv, 0);
+
+    auto face_normal = [&](const int f, const int moved, const vec3& p) { // normal of face f with vertex `moved` placed at p
+        vec3 c[3];
+        for (int k : {0,1,2}) c[k] = fv[f*3+k]==moved ? p : pos[fv[f*3+k]];
+        return cross(c[1]-c[0], c[2]-c[0]);
+    };
+
+    // Plane quadrics of the faces, area weighted
+    for (int f=0; f<nf; f++) {
+        vec3 n = face_normal(f, -1, {});
+        const double area = norm(n);
+        if (area <= 0) continue;
+        n = n / area;
+        Quadric Q(n, -(n*pos[fv[f*3]]), area);
+        for (int k : {0,1,2}) {
+            quadrics[fv[f*3+k]] += Q;
+            vert_faces[fv[f*3+k]].push_back(f);
+        }
+    }
+
+    // Unique edges; the ones with a single face are borders, kept in place with a perpendicular plane
+    std::vector<std::uint64_t> edges;
+    for (int f=0; f<nf; f++)
+        for (int k : {0,1,2}) {
+            const std::uint64_t a = fv[f*3+k], b = fv[f*3+(k+1)%3];
+            edges.push_back(std::min(a,b)<<32 | std::max(a,b));
+        }
+    std::sort(edges.begin(), edges.end());
+    for (size_t i=0; i<edges.size(); ) {
+        size_t j = i;
+        while (j<edges.size() && edges[j]==edges[i]) j++;
+        if (j-i == 1) {
+            const int a = edges[i]>>32, b = edges[i] & 0xffffffff;
+            for (const int f : vert_faces[a]) {
+                if (fv[f*3]!=b && fv[f*3+1]!=b && fv[f*3+2]!=b) continue;
+                vec3 n = cross(pos[b]-pos[a], face_normal(f, -1, {}));
+                if (norm(n) <= 0) break;
+                n = normalized(n);
+                const Quadric Q(n, -(n*pos[a]), 10*((pos[b]-pos[a])*(pos[b]-pos[a])));
+                quadrics[a] += Q;
+                quadrics[b] += Q;
+                break;
+            }
+        }
+        i = j;
+    }
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+    auto evaluate = [&](const int v0, const int v1) {
+        Quadric Q = quadrics[v0];
+        Q += quadrics[v1];
+        Collapse c = {0, v0, v1, stamp[v0], stamp[v1], {}};
+        if (!Q.minimizer(c.target)) { // singular quadric: best of the endpoints and the midpoint
+            const vec3 candidates[3] = {pos[v0], pos[v1], (pos[v0]+pos[v1])/2.};
+            c.target = *std::min_element(candidates, candidates+3, [&](const vec3& a, const vec3& b) { return Q.error(a) < Q.error(b); });
+        }
+        c.cost = Q.error(c.target);
+        return c;
+    };
+
+    // Rejects collapses that would flip one of the surviving faces around v
+    auto flips = [&](const int v, const int other, const vec3& p) {
+        for (const int f : vert_faces[v]) {
+            if (!face_alive[f] || fv[f*3]==other || fv[f*3+1]==other || fv[f*3+2]==other) continue;
+            const vec3 before = face_normal(f, -1, {});
+            const vec3 after = face_normal(f, v, p);
+            if (before*after < 0.2*norm(before)*norm(after)) return true;
+        }
+        return false;
+    };
+
+    std::priority_queue<Collapse> heap;
+    for (const std::uint64_t e : edges)
+        heap.push(evaluate(e>>32, e & 0xffffffff));
+
+    int alive_faces = nf;
+    while (alive_faces>target_faces && !heap.empty()) {
+        const Collapse c = heap.top();
+        heap.pop();
+        if (vert_removed[c.v0] || vert_removed[c.v1] || stamp[c.v0]!=c.stamp0 || stamp[c.v1]!=c.stamp1) continue; // stale
+        if (flips(c.v0, c.v1, c.target) || flips(c.v1, c.v0, c.target)) continue;
+
+        pos[c.v0] = c.target;
+        quadrics[c.v0] += quadrics[c.v1];
+        vert_removed[c.v1] = true;
+        stamp[c.v0]++;
+        for (const int f : vert_faces[c.v1]) {
+            if (!face_alive[f]) continue;
+            if (fv[f*3]==c.v0 || fv[f*3+1]==c.v0 || fv[f*3+2]==c.v0) { // the faces of the edge vanish
+                face_alive[f] = false;
+                alive_faces--;
+                continue;
+            }
+            for (int k : {0,1,2}) if (fv[f*3+k]==c.v1) fv[f*3+k] = c.v0;
+            vert_faces[c.v0].push_back(f);
+        }
+        vert_faces[c.v1].clear();
+        std::vector<int>& faces = vert_faces[c.v0];
+        faces.erase(std::remove_if(faces.begin(), faces.end(), [&](const int f) { return !face_alive[f]; }), faces.end());
+
+        // The edges around v0 changed their cost
+        std::vector<int> ring;
+        for (const int f : faces)
+            for (int k : {0,1,2}) if (fv[f*3+k]!=c.v0) ring.push_back(fv[f*3+k]);
+        std::sort(ring.begin(), ring.end());
+        ring.erase(std::unique(ring.begin(), ring.end()), ring.end());
+        for (const int n : ring)
+            heap.push(evaluate(c.v0, n));
+    }
+
+    // Compact the surviving vertices and faces, the texture coordinates are shared as is
+    Model lod;
+    lod.tex_coords = tex_coords;
+    lod.normal_map = normal_map;
+    lod.color_texture = color_texture;
+    lod.has_normal_map = has_normal_map;
+    lod.has_color_texture = has_color_texture;
+    std::vector<int> remap(nv, -1);
+    for (int f=0; f<nf; f++) {
+        if (!face_alive[f]) continue;
+        for (int k : {0,1,2}) {
+            int& v = remap[fv[f*3+k]];
+            if (v<0) {
+                v = lod.verts.size();
+                lod.verts.push_back(pos[fv[f*3+k]]);
+            }
+            lod.facet_vrt.push_back(v);
+            lod.facet_tex.push_back(facet_tex[f*3+k]);
+        }
+    }
+    lod.compute_bounds();
+    lod.build_clusters();
+    return lod;
+}
+
+void Model::build_lods(const int levels, const int min_faces) {
+    lods.clear();
+    lods.reserve(levels);
+    std::cerr << "# LOD f# " << nfaces();
+    for (int level=1; level<=levels; level++) {
+        const Model& prev = lod(level-1);
+        if (prev.nfaces()/2 < min_faces) break;
+        Model next = prev.simplified(prev.nfaces()/2);
+        if (next.nfaces() > prev.nfaces()*9/10) break; // no more collapses without flipping faces
+        lods.push_back(std::move(next));
+        std::cerr << " " << lods.back().nfaces();
+    }
+    std::cerr << std::endl;
+}
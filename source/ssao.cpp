@@ -0,0 +1,311 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "ssao.h"
+#include "arena.h"
+#include "profiler.h"
+#include "scheduler.h"
+
+static constexpr int pad = AmbientOcclusion::max_radius + 4; // the samples of a row's last group reach 3 pixels further
+static constexpr float background_z = -1e6f;                // view-space depth of the background, too far to occlude anything
+static constexpr float bias = .1f;                           // cosine below which a sample does not occlude, keeps flat surfaces clear
+static constexpr float depth_tolerance = .03f;               // depth step, relative to the depth, that the blur does not cross
+
+// View-space positions of the pixels 0, scale, 2*scale... of a z-buffer row at screen height sy,
+// given the rows of the screen to view space matrix. Screen x is the only term that changes along
+// the row, four pixels at a time. Returns the first and last covered ones, last < first if none.
+static void unproject_row(const double* zrow, const int scale, const int count, const float (&m)[4][4], const float sy,
+                          float* X, float* Y, float* Z, int& first, int& last) {
+    constexpr double background = -std::numeric_limits<double>::max();
+    float base[4]; // the terms of sy and of the homogeneous 1
+    for (int c=0; c<4; c++) base[c] = m[c][1]*sy + m[c][3];
+    first = count;
+    last = -1;
+    int x = 0;
+#ifdef RASTER_SSE2
+    for (; x+4<=count; x+=4) {
+        const double* z = zrow + x*scale;
+        const __m128d z01 = scale == 1 ? _mm_loadu_pd(z) : _mm_set_pd(z[2], z[0]);
+        const __m128d z23 = scale == 1 ? _mm_loadu_pd(z+2) : _mm_set_pd(z[6], z[4]);
+        const __m128d bg = _mm_set1_pd(background);
+        const int covered = _mm_movemask_pd(_mm_cmpneq_pd(z01, bg)) | _mm_movemask_pd(_mm_cmpneq_pd(z23, bg)) << 2;
+        if (!covered) {
+            _mm_storeu_ps(X+x, _mm_setzero_ps());
+            _mm_storeu_ps(Y+x, _mm_setzero_ps());
+            _mm_storeu_ps(Z+x, _mm_set1_ps(background_z));
+            continue;
+        }
+        for (int l=0; l<4; l++)
+            if (covered >> l & 1) {
+                first = std::min(first, x+l);
+                last = x+l;
+            }
+        const __m128 zf = _mm_movelh_ps(_mm_cvtpd_ps(z01), _mm_cvtpd_ps(z23)); // the background becomes -inf, replaced below
+        const __m128 sx = _mm_mul_ps(_mm_set_ps(x+3, x+2, x+1, x), _mm_set1_ps(scale));
+        __m128 p[4];
+        for (int c=0; c<4; c++)
+            p[c] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[c][0]), sx), _mm_mul_ps(_mm_set1_ps(m[c][2]), zf)), _mm_set1_ps(base[c]));
+        const __m128 inv_w = _mm_div_ps(_mm_set1_ps(1.f), p[3]);
+        const __m128 mask = _mm_cmpgt_ps(zf, _mm_set1_ps(-std::numeric_limits<float>::max()));
+        _mm_storeu_ps(X+x, _mm_and_ps(mask, _mm_mul_ps(p[0], inv_w)));
+        _mm_storeu_ps(Y+x, _mm_and_ps(mask, _mm_mul_ps(p[1], inv_w)));
+        _mm_storeu_ps(Z+x, _mm_or_ps(_mm_and_ps(mask, _mm_mul_ps(p[2], inv_w)), _mm_andnot_ps(mask, _mm_set1_ps(background_z))));
+    }
+#endif
+    for (; x<count; x++) {
+        const double z = zrow[x*scale];
+        if (z == background) {
+            X[x] = Y[x] = 0;
+            Z[x] = background_z;
+            continue;
+        }
+        first = std::min(first, x);
+        last = x;
+        const float sx = float(x*scale), zf = float(z);
+        float p[4];
+        for (int c=0; c<4; c++) p[c] = m[c][0]*sx + m[c][2]*zf + base[c];
+        X[x] = p[0]/p[3];
+        Y[x] = p[1]/p[3];
+        Z[x] = p[2]/p[3];
+    }
+}
+
+// Occlusion of the four pixels whose positions start at X, Y, Z, whose samples are at the given offsets from each of them.
+// The normal is rebuilt from the neighbours on the side of the smaller depth step, the same
+// surface unless the pixel is a one-pixel sliver.
+static void occlude(const float* X, const float* Y, const float* Z, const int stride, const int* offsets,
+                    const float inv_radius2, const float strength, float* out) {
+#ifdef RASTER_SSE2
+    const __m128 sign = _mm_set1_ps(-0.f), zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+    auto select = [](const __m128 mask, const __m128 a, const __m128 b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); };
+    const __m128 px = _mm_loadu_ps(X), py = _mm_loadu_ps(Y), pz = _mm_loadu_ps(Z);
+    __m128 d[2][3]; // tangents along x and y
+    for (int a=0; a<2; a++) {
+        const int step = a ? stride : 1;
+        const __m128 fx = _mm_sub_ps(_mm_loadu_ps(X+step), px), fy = _mm_sub_ps(_mm_loadu_ps(Y+step), py), fz = _mm_sub_ps(_mm_loadu_ps(Z+step), pz);
+        const __m128 bx = _mm_sub_ps(px, _mm_loadu_ps(X-step)), by = _mm_sub_ps(py, _mm_loadu_ps(Y-step)), bz = _mm_sub_ps(pz, _mm_loadu_ps(Z-step));
+        const __m128 forward = _mm_cmplt_ps(_mm_andnot_ps(sign, fz), _mm_andnot_ps(sign, bz));
+        d[a][0] = select(forward, fx, bx);
+        d[a][1] = select(forward, fy, by);
+        d[a][2] = select(forward, fz, bz);
+    }
+    __m128 nx = _mm_sub_ps(_mm_mul_ps(d[0][1], d[1][2]), _mm_mul_ps(d[0][2], d[1][1]));
+    __m128 ny = _mm_sub_ps(_mm_mul_ps(d[0][2], d[1][0]), _mm_mul_ps(d[0][0], d[1][2]));
+    __m128 nz = _mm_sub_ps(_mm_mul_ps(d[0][0], d[1][1]), _mm_mul_ps(d[0][1], d[1][0]));
+    const __m128 inv_len = _mm_rsqrt_ps(_mm_max_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz)), _mm_set1_ps(1e-30f)));
+    nx = _mm_mul_ps(nx, inv_len);
+    ny = _mm_mul_ps(ny, inv_len);
+    nz = _mm_mul_ps(nz, inv_len);
+
+    const __m128 r2 = _mm_set1_ps(inv_radius2), cutoff = _mm_set1_ps(bias), eps = _mm_set1_ps(1e-10f);
+    __m128 sum = zero;
+    for (int s=0; s<AmbientOcclusion::samples; s++) {
+        const int o = offsets[s];
+        const __m128 vx = _mm_sub_ps(_mm_loadu_ps(X+o), px), vy = _mm_sub_ps(_mm_loadu_ps(Y+o), py), vz = _mm_sub_ps(_mm_loadu_ps(Z+o), pz);
+        const __m128 vv = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz));
+        const __m128 vn = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, nx), _mm_mul_ps(vy, ny)), _mm_mul_ps(vz, nz));
+        const __m128 cosine = _mm_max_ps(_mm_sub_ps(_mm_mul_ps(vn, _mm_rsqrt_ps(_mm_add_ps(vv, eps))), cutoff), zero);
+        const __m128 falloff = _mm_max_ps(_mm_sub_ps(one, _mm_mul_ps(vv, r2)), zero);
+        sum = _mm_add_ps(sum, _mm_mul_ps(cosine, falloff));
+    }
+    const __m128 ao = _mm_max_ps(_mm_sub_ps(one, _mm_mul_ps(sum, _mm_set1_ps(strength))), zero);
+    _mm_storeu_ps(out, select(_mm_cmpgt_ps(pz, _mm_set1_ps(background_z/2)), ao, one));
+#else
+    for (int l=0; l<4; l++) {
+        const float* x = X+l; const float* y = Y+l; const float* z = Z+l;
+        float d[2][3];
+        for (int a=0; a<2; a++) {
+            const int step = a ? stride : 1;
+            const bool forward = std::abs(z[step] - z[0]) < std::abs(z[0] - z[-step]);
+            d[a][0] = forward ? x[step] - x[0] : x[0] - x[-step];
+            d[a][1] = forward ? y[step] - y[0] : y[0] - y[-step];
+            d[a][2] = forward ? z[step] - z[0] : z[0] - z[-step];
+        }
+        float nx = d[0][1]*d[1][2] - d[0][2]*d[1][1];
+        float ny = d[0][2]*d[1][0] - d[0][0]*d[1][2];
+        float nz = d[0][0]*d[1][1] - d[0][1]*d[1][0];
+        const float inv_len = 1/std::sqrt(std::max(nx*nx + ny*ny + nz*nz, 1e-30f));
+        nx *= inv_len; ny *= inv_len; nz *= inv_len;
+
+        float sum = 0;
+        for (int s=0; s<AmbientOcclusion::samples; s++) {
+            const int o = offsets[s];
+            const float vx = x[o] - x[0], vy = y[o] - y[0], vz = z[o] - z[0];
+            const float vv = vx*vx + vy*vy + vz*vz;
+            const float cosine = std::max((vx*nx + vy*ny + vz*nz)/std::sqrt(vv + 1e-10f) - bias, 0.f);
+            sum += cosine * std::max(1 - vv*inv_radius2, 0.f);
+        }
+        out[l] = z[0] > background_z/2 ? std::max(1 - sum*strength, 0.f) : 1.f;
+    }
+#endif
+}
+
+// Bilateral blur of the four pixels from in on, along the rows (step 1) or the columns (step =
+// stride). The weights fall to zero at a depth step of depth_tolerance, so the background and
+// the surfaces behind or in front do not bleed in. The background is left out.
+static void blur(const float* in, const float* Z, const int step, const float* gauss, float* out) {
+    constexpr int R = AmbientOcclusion::blur_radius;
+#ifdef RASTER_SSE2
+    const __m128 sign = _mm_set1_ps(-0.f), zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+    const __m128 z = _mm_loadu_ps(Z);
+    if (!_mm_movemask_ps(_mm_cmpgt_ps(z, _mm_set1_ps(background_z/2)))) return;
+    const __m128 inv_tolerance = _mm_div_ps(one, _mm_mul_ps(_mm_andnot_ps(sign, z), _mm_set1_ps(depth_tolerance)));
+    __m128 sum = zero, weights = zero;
+    for (int k=-R; k<=R; k++) {
+        const __m128 dz = _mm_andnot_ps(sign, _mm_sub_ps(_mm_loadu_ps(Z + k*step), z));
+        const __m128 w = _mm_mul_ps(_mm_set1_ps(gauss[std::abs(k)]), _mm_max_ps(_mm_sub_ps(one, _mm_mul_ps(dz, inv_tolerance)), zero));
+        sum = _mm_add_ps(sum, _mm_mul_ps(w, _mm_loadu_ps(in + k*step)));
+        weights = _mm_add_ps(weights, w);
+    }
+    _mm_storeu_ps(out, _mm_div_ps(sum, weights)); // the pixel's own weight is never zero
+#else
+    for (int l=0; l<4; l++) {
+        if (Z[l] <= background_z/2) continue;
+        const float inv_tolerance = 1/(std::abs(Z[l])*depth_tolerance);
+        float sum = 0, weights = 0;
+        for (int k=-R; k<=R; k++) {
+            const float w = gauss[std::abs(k)] * std::max(1 - std::abs(Z[l + k*step] - Z[l])*inv_tolerance, 0.f);
+            sum += w*in[l + k*step];
+            weights += w;
+        }
+        out[l] = sum/weights;
+    }
+#endif
+}
+
+void AmbientOcclusion::resize(const int w, const int h) {
+    if (w == width && h == height) return;
+    width = w;
+    height = h;
+    stride = (w + 2*pad + 3) / 4 * 4;
+    const size_t n = size_t(stride) * (h + 2*pad);
+    px.assign(n, 0.f);
+    py.assign(n, 0.f);
+    pz.assign(n, background_z);
+    occlusion.assign(n, 1.f);
+    blurred.assign(n, 1.f);
+}
+
+void AmbientOcclusion::apply(const RenderContext& ctx, const std::vector<double>& zbuffer, TGAImage& framebuffer, const DirtyTiles* dirty) {
+    PROFILE_SCOPE(STAGE_SSAO);
+    constexpr double Pi = 3.14159265358979323846;
+    constexpr double background = -std::numeric_limits<double>::max();
+    const int fw = framebuffer.width(), fh = framebuffer.height();
+    const int scale = half_resolution ? 2 : 1;
+    resize((fw + scale - 1) / scale, (fh + scale - 1) / scale);
+    // Locals, the stores below could alias the members
+    const int w = width, h = height, n = stride;
+    const size_t origin = size_t(pad)*n + pad;
+    float* const X = px.data() + origin;
+    float* const Y = py.data() + origin;
+    float* const Z = pz.data() + origin;
+    float* const O = occlusion.data() + origin;
+    float* const B = blurred.data() + origin;
+
+    // View-space positions, a pixel of the half-resolution buffer is the framebuffer's pixel 2x,2y.
+    // The passes after this one only run over the box around the covered pixels.
+    const mat<4,4> to_view = affine_product(ctx.Viewport, ctx.Perspective).invert(); // screen {x,y,z,1} to view space, homogeneous
+    float m[4][4];
+    for (int i=0; i<4; i++)
+        for (int j=0; j<4; j++) m[i][j] = float(to_view[i][j]);
+    FrameVector<int> row_min(h), row_max(h);
+    scheduler.parallel_for(0, h, 16, [&](const int first, const int last) {
+        for (int y=first; y<last; y++) {
+            const size_t row = size_t(y)*n;
+            unproject_row(zbuffer.data() + size_t(y*scale)*fw, scale, w, m, float(y*scale), X+row, Y+row, Z+row, row_min[y], row_max[y]);
+        }
+    });
+    int xmin = w, xmax = -1, ymin = h, ymax = -1;
+    for (int y=0; y<h; y++) {
+        if (row_max[y] < 0) continue;
+        xmin = std::min(xmin, row_min[y]);
+        xmax = std::max(xmax, row_max[y]);
+        ymin = std::min(ymin, y);
+        ymax = y;
+    }
+    if (xmax < 0) return;
+    xmin &= ~3; // groups of four pixels start on multiples of 4
+
+    // Buffer offsets of the samples for every rotation and whole radius in pixels: a spiral of 7
+    // turns over the radius, the rotations a golden angle apart
+    FrameVector<int> offsets(4*(max_radius+1)*samples);
+    for (int k=0; k<4; k++)
+        for (int r=0; r<=max_radius; r++)
+            for (int s=0; s<samples; s++) {
+                const double alpha = (s + .5) / samples, angle = 2*Pi*7*alpha + k*2.39996;
+                offsets[(k*(max_radius+1) + r)*samples + s] = int(std::lround(r*alpha*std::sin(angle)))*n + int(std::lround(r*alpha*std::cos(angle)));
+            }
+    const float pixels_per_unit = float(radius * ctx.Viewport[0][0] * ctx.Perspective[0][0] / scale); // of the radius, at clip w = 1
+    float clip_w[4];
+    for (int j=0; j<4; j++) clip_w[j] = float(ctx.Perspective[3][j]);
+    const float inv_radius2 = 1 / float(radius*radius);
+    const float strength = float(intensity) / (samples * (1 - bias));
+    const int tiles_x = (xmax - xmin + tile_size) / tile_size, tiles_y = (ymax - ymin + tile_size) / tile_size;
+    scheduler.parallel_for(0, tiles_x*tiles_y, 1, [&](const int first, const int last) {
+        for (int t=first; t<last; t++) {
+            const int x0 = xmin + (t % tiles_x)*tile_size, x1 = std::min(x0 + tile_size, xmax + 1);
+            const int y0 = ymin + (t / tiles_x)*tile_size, y1 = std::min(y0 + tile_size, ymax + 1);
+            for (int y=y0; y<y1; y++) {
+                for (int x=x0; x<x1; x+=4) {
+                    // The four pixels share the samples' offsets, scaled by the projected radius at
+                    // their mean clip w, so that every load is four contiguous floats
+                    // (the background's occlusion is never read)
+                    const size_t i = size_t(y)*n + x;
+                    float sum_w = 0;
+                    int covered = 0;
+                    for (int l=0; l<4; l++) {
+                        if (Z[i+l] <= background_z/2) continue;
+                        sum_w += clip_w[0]*X[i+l] + clip_w[1]*Y[i+l] + clip_w[2]*Z[i+l] + clip_w[3];
+                        covered++;
+                    }
+                    if (!covered) continue;
+                    const int r = int(std::clamp(pixels_per_unit * covered / sum_w + .5f, 1.f, float(max_radius)));
+                    const int k = ((x >> 2) & 1) | ((y & 1) << 1);
+                    occlude(X+i, Y+i, Z+i, n, &offsets[(k*(max_radius+1) + r)*samples], inv_radius2, strength, O+i);
+                }
+            }
+        }
+    });
+
+    // Separable blur, rows into the scratch buffer and columns back
+    float gauss[blur_radius+1];
+    for (int k=0; k<=blur_radius; k++) gauss[k] = float(std::exp(-k*k / 8.)); // sigma = 2 pixels
+    scheduler.parallel_for(ymin, ymax + 1, 16, [&](const int first, const int last) {
+        for (int y=first; y<last; y++)
+            for (int x=xmin; x<=xmax; x+=4) blur(O + size_t(y)*n + x, Z + size_t(y)*n + x, 1, gauss, B + size_t(y)*n + x);
+    });
+    scheduler.parallel_for(ymin, ymax + 1, 16, [&](const int first, const int last) {
+        for (int y=first; y<last; y++)
+            for (int x=xmin; x<=xmax; x+=4) blur(B + size_t(y)*n + x, Z + size_t(y)*n + x, n, gauss, O + size_t(y)*n + x);
+    });
+
+    // Darken the covered pixels. At half resolution a pixel takes the occlusion of the nearest in
+    // depth of the (up to four) buffer pixels around it, so that the edges stay sharp.
+    std::uint8_t* pixels = framebuffer.buffer();
+    const int bpp = framebuffer.bytespp();
+    const vec4 to_view_z = to_view[2], to_view_w = to_view[3];
+    scheduler.parallel_for(ymin*scale, std::min((ymax + 1)*scale, fh), 16, [&](const int first, const int last) {
+        for (int y=first; y<last; y++) {
+            for (int x=xmin*scale; x<std::min((xmax + 1)*scale, fw); x++) {
+                if (dirty && !dirty->tiles[x/TileBins::tile_size + (y/TileBins::tile_size)*dirty->tiles_x]) continue;
+                const double z = zbuffer[x + size_t(y)*fw];
+                if (z == background) continue;
+                float a;
+                if (scale == 1) {
+                    a = O[size_t(y)*n + x];
+                } else {
+                    const vec4 s = {double(x), double(y), z, 1.};
+                    const float view_z = float((to_view_z*s) / (to_view_w*s));
+                    const size_t c[4] = {size_t(y/2)*n + x/2, size_t(y/2)*n + (x+1)/2, size_t((y+1)/2)*n + x/2, size_t((y+1)/2)*n + (x+1)/2};
+                    size_t best = c[0];
+                    for (int j=1; j<4; j++)
+                        if (std::abs(Z[c[j]] - view_z) < std::abs(Z[best] - view_z)) best = c[j];
+                    a = Z[best] > background_z/2 ? O[best] : 1.f; // the occlusion of the background is stale
+                }
+                const int k = int(a*256 + .5f);
+                std::uint8_t* p = pixels + (x + size_t(y)*fw)*bpp;
+                for (int i=0; i<std::min(bpp, 3); i++) p[i] = (p[i]*k) >> 8;
+            }
+        }
+    });
+}
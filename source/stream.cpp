@@ -0,0 +1,129 @@
+#include <iostream>
+#include "stream.h"
+#include "scheduler.h"
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <csignal>
+#include <unistd.h>
+#endif
+
+bool parse_stream_format(const std::string& name, StreamFormat& format) {
+    if (name == "rgb24") format = STREAM_RGB24;
+    else if (name == "rgba") format = STREAM_RGBA;
+    else return false;
+    return true;
+}
+
+// Takes the process' stdout for the frames and points file descriptor 1 at stderr, so that the
+// text printed by the application or by libraries cannot end up in the video
+static std::FILE* take_stdout() {
+    std::cout.flush();
+    std::fflush(stdout);
+#ifdef _WIN32
+    const int fd = _dup(_fileno(stdout));
+    if (fd < 0) return nullptr;
+    _dup2(_fileno(stderr), _fileno(stdout));
+    _setmode(fd, _O_BINARY);
+    return _fdopen(fd, "wb");
+#else
+    const int fd = dup(STDOUT_FILENO);
+    if (fd < 0) return nullptr;
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    return fdopen(fd, "wb");
+#endif
+}
+
+bool FrameStream::open(const std::string& path, const int width, const int height, const StreamFormat format, const int max_queued) {
+    close();
+#ifndef _WIN32
+    std::signal(SIGPIPE, SIG_IGN); // a consumer that exits makes the writes fail instead of killing the process
+#endif
+    file = path == "-" ? take_stdout() : std::fopen(path.c_str(), "wb"); // opening a named pipe waits for its reader
+    if (!file) {
+        std::cerr << "can't open stream " << path << std::endl;
+        return false;
+    }
+    this->width = width;
+    this->height = height;
+    this->format = format;
+    buffers.assign(std::max(1, max_queued), std::vector<std::uint8_t>(size_t(width)*height*(format == STREAM_RGBA ? 4 : 3)));
+    head = count = 0;
+    closing = failed = false;
+    frames = waits = 0;
+    // A thread of its own rather than a scheduler job: a write can block for as long as the
+    // consumer does not read, which would take a worker away from the frames
+    thread = std::thread(&FrameStream::writer, this);
+    std::cerr << "Streaming " << width << "x" << height << " " << (format == STREAM_RGBA ? "rgba" : "rgb24") << " frames to "
+              << (path == "-" ? "stdout" : path) << std::endl;
+    return true;
+}
+
+bool FrameStream::push(const TGAImage& frame) {
+    if (!file) return false;
+    if (frame.width() != width || frame.height() != height) {
+        std::cerr << "stream frames must be " << width << "x" << height << std::endl;
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    if (count == int(buffers.size()) && !failed) {
+        waits++;
+        changed.wait(lock, [&] { return count < int(buffers.size()) || failed; });
+    }
+    if (failed) return false;
+    std::vector<std::uint8_t>& out = buffers[(head + count) % buffers.size()]; // free slot, the writer does not touch it
+    lock.unlock();
+
+    // Framebuffer rows are stored bottom to top in BGR(A) order
+    const int bpp = frame.bytespp(), channels = format == STREAM_RGBA ? 4 : 3;
+    scheduler.parallel_for(0, height, 32, [&](const int first, const int last) {
+        for (int y=first; y<last; y++) {
+            const std::uint8_t* src = frame.buffer() + size_t(height-1-y)*width*bpp;
+            std::uint8_t* dst = out.data() + size_t(y)*width*channels;
+            for (int x=0; x<width; x++, src+=bpp, dst+=channels) {
+                if (bpp == 1) dst[0] = dst[1] = dst[2] = src[0];
+                else { dst[0] = src[2]; dst[1] = src[1]; dst[2] = src[0]; }
+                if (channels == 4) dst[3] = bpp == 4 ? src[3] : 255;
+            }
+        }
+    });
+
+    lock.lock();
+    count++;
+    frames++;
+    lock.unlock();
+    changed.notify_all();
+    return true;
+}
+
+void FrameStream::writer() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        changed.wait(lock, [&] { return count > 0 || closing; });
+        if (!count) return; // closing with nothing left to write
+        const std::vector<std::uint8_t>& frame = buffers[head];
+        lock.unlock();
+        const bool ok = std::fwrite(frame.data(), 1, frame.size(), file) == frame.size() && std::fflush(file) == 0;
+        lock.lock();
+        head = (head + 1) % buffers.size();
+        count--;
+        if (!ok) failed = true;
+        changed.notify_all();
+        if (failed) return;
+    }
+}
+
+void FrameStream::close() {
+    if (!file) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    changed.notify_all();
+    thread.join();
+    std::fclose(file);
+    file = nullptr;
+    if (failed) std::cerr << "Stream consumer went away after " << frames << " frames" << std::endl;
+    else std::cerr << "Streamed " << frames << " frames, " << waits << " of them waited for the consumer" << std::endl;
+}
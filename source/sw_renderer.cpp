@@ -0,0 +1,771 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include "sw_renderer.h"
+#include "arena.h"
+#include "assets.h"
+#include "batch.h"
+#include "bvh.h"
+#include "encoder.h"
+#include "heatmap.h"
+#include "profiler.h"
+#include "rasterizer.h"
+#include "resolution.h"
+#include "scheduler.h"
+#include "ssao.h"
+#include "stream.h"
+#include "temporal.h"
+
+static_assert(int(SW_HEATMAP_DEPTH_TESTS) == HEATMAP_DEPTH_TESTS && int(SW_HEATMAP_SHADED) == HEATMAP_SHADED
+              && int(SW_HEATMAP_TILE_COST) == HEATMAP_TILE_COST && int(SW_HEATMAP_VIEW_COUNT) == HEATMAP_VIEW_COUNT, "heatmap views differ");
+
+// A requested model, moved into the scene as soon as its mesh is loaded. Its maps are attached
+// whenever they arrive; until then the model is drawn by the untextured pipelines.
+struct PendingModel {
+    AssetLoader::MeshFuture mesh;
+    AssetLoader::TextureFuture normal_map, color_texture; // invalid when not requested or already attached
+    AssetLoader::AnimationFuture animation;
+    int index = -1;                                       // position in the scene once the mesh is in
+};
+
+// Everything the image depends on apart from the scene contents, a frame is fully rendered only
+// when it differs from the last rendered one
+struct ViewState {
+    double angleX, angleY;
+    double time; // animation time, only advancing while an animated model is in the scene
+    SwMode mode;
+    SwShading shading;
+    SwHeatmapView heatmap_view;
+    bool operator==(const ViewState& other) const {
+        return angleX == other.angleX && angleY == other.angleY && time == other.time && mode == other.mode
+            && shading == other.shading && heatmap_view == other.heatmap_view;
+    }
+};
+
+// Everything a render reads or writes, the only state shared between renderers are the
+// read-only defaults of rasterizer.h, the scheduler and the profiler
+struct SwRenderer {
+    int width, height;
+    std::vector<Model> models;
+    Lighting lighting = default_lighting;
+    RenderContext ctx;
+    double angle_x = 0, angle_y = 0;
+    TGAColor background = {{30, 30, 30, 255}, 4};
+    TGAImage framebuffer;
+    std::vector<double> zbuffer;
+
+    // Settings of the frames
+    SwMode mode = SW_MODE_PHONG;
+    SwShading shading = SW_SHADING_NORMAL_AND_COLOR;
+    SwHeatmapView heatmap_view = SW_HEATMAP_DEPTH_TESTS;
+    Heatmap heatmap;          // fragment statistics of the heatmap mode
+    double heatmap_scale = 0; // value of the hottest colour in the last heatmap frame
+    bool ssao = false;
+    AmbientOcclusion occlusion;
+    bool temporal_reuse = false;
+    TemporalCache temporal;
+    ShadingRates shading_rates; // off while the threshold is 0
+    DynamicResolution resolution;
+
+    // Models being loaded
+    int lod_levels = 4;
+    bool compress_textures = false, quantize_meshes = false;
+    AssetLoader loader;
+    std::vector<PendingModel> pending;
+    std::vector<int> changed_models; // appeared or got a map since the last update
+
+    // Change tracking of sw_renderer_update: the last rendered view, and the buffers of the
+    // frames rendered below full size
+    bool rendered = false, rendered_exact = true;
+    int rendered_width = 0;
+    ViewState last_view = {};
+    DirtyTiles dirty;
+    TGAImage scaled_framebuffer;
+    std::vector<double> scaled_zbuffer;
+    double render_time_ms = 0, render_scale = 1;
+
+    // Output
+    ImageFormat image_format = IMAGE_TGA;
+    std::unique_ptr<ImageWriter> writer; // of the image format, created by the first write
+    bool write_failed = false;           // a writer of an earlier format failed
+    FrameStream stream;
+
+    SwRenderer(const int width, const int height) : width(width), height(height), resolution(width, height, 0) {}
+};
+
+// The viewer's framing: the models fill the middle 7/8 of a width x height image
+static void frame_viewport(RenderContext& ctx, const int width, const int height) {
+    ctx.viewport(width/16, height/16, width*7/8, height*7/8);
+}
+
+static TGAColor hsv_to_rgb(double hue, double saturation = 1.0, double value = 1.0) {
+    // Normalize hue to [0, 360)
+    hue = fmod(hue, 360.0);
+    if (hue < 0) hue += 360.0;
+
+    // HSV to RGB conversion
+    double h = hue / 60.0;
+    int sector = (int)h;
+    double f = h - sector;
+    double q = 1.0 - f, t = f;
+
+    double r, g, b;
+    switch (sector % 6) {
+        case 0: r = 1.0; g = t; b = 0.0; break;
+        case 1: r = q; g = 1.0; b = 0.0; break;
+        case 2: r = 0.0; g = 1.0; b = t; break;
+        case 3: r = 0.0; g = q; b = 1.0; break;
+        case 4: r = t; g = 0.0; b = 1.0; break;
+        case 5: r = 1.0; g = 0.0; b = q; break;
+        default: r = 1.0; g = 0.0; b = 0.0; break;
+    }
+
+    // Apply saturation and value
+    r = r * saturation * value;
+    g = g * saturation * value;
+    b = b * saturation * value;
+
+    TGAColor color;
+    color[0] = (unsigned char)(r * 255);  // Red
+    color[1] = (unsigned char)(g * 255);  // Green
+    color[2] = (unsigned char)(b * 255);  // Blue
+    color.bytespp = 3;
+
+    return color;
+}
+
+// Simple HSV colour per triangle without lighting, the colour bytes are passed as varyings
+struct ColoredTriangleShader {
+    static constexpr int nvaryings = 3;
+
+    const Model& model;
+    const mat<4,4>& MVP;
+    const vec3* positions = nullptr; // skinned positions of an animated model
+
+    vec4 vertex(const int iface, const int nthvert, vec<nvaryings>& varying) const {
+        double hue = (iface * 0.618033988749895) * 360.0; // Golden ratio for good distribution
+        TGAColor triangle_color = hsv_to_rgb(hue);
+        for (int i : {0,1,2}) varying[i] = triangle_color[i];
+        vec3 v = positions ? positions[model.get_vertex_index(iface, nthvert)] : model.vert(iface, nthvert);
+        return MVP * vec4{v.x, v.y, v.z, 1.};
+    }
+
+    void fragment(const int, const int, const vec<nvaryings>& varying, TGAColor& color) const {
+        for (int i : {0,1,2}) color[i] = (unsigned char)std::lround(varying[i]); // constant over the triangle
+        color.bytespp = 3;
+    }
+};
+
+static void cpu_rasterize_colored_triangles(const RenderContext& ctx, const std::vector<Model>& models, TGAImage& framebuffer,
+                                            std::vector<double>& zbuffer, const mat<4,4>& Model, const DirtyTiles* dirty) {
+    // -- CPU rasterization with simple colored triangles
+    const mat<4,4> MVP = ctx.MVP(Model);
+    for (const auto &model : models) {
+        if (dirty && dirty->misses(ctx, model, MVP)) continue;
+        const class Model& lod = model.lod(select_lod(ctx, model, MVP));
+        const FrameVector<vec3> posed = pose_vertices(ctx, lod);
+        draw_clustered(ctx, ColoredTriangleShader{lod, MVP, posed.empty() ? nullptr : posed.data()}, lod, MVP, zbuffer, framebuffer, NoFragmentStats{}, dirty);
+    }
+}
+
+template<class Stats>
+static void cpu_rasterize_shading_mode(const SwShading shading, const RenderContext& ctx, const std::vector<Model>& models, TGAImage& framebuffer,
+                                       std::vector<double>& zbuffer, const mat<4,4>& Model, const Stats& stats, const DirtyTiles* dirty,
+                                       TemporalCache* temporal = nullptr, const ShadingRates* rates = nullptr) {
+    // each shading mode maps to its own specialised pipeline
+    switch (shading) {
+        case SW_SHADING_FLAT:          cpu_rasterize_models<false, false, false>(ctx, models, framebuffer, zbuffer, Model, stats, dirty, temporal, rates); break;
+        case SW_SHADING_SMOOTH:        cpu_rasterize_models<true,  false, false>(ctx, models, framebuffer, zbuffer, Model, stats, dirty, temporal, rates); break;
+        case SW_SHADING_NORMAL_MAP:    cpu_rasterize_models<true,  true,  false>(ctx, models, framebuffer, zbuffer, Model, stats, dirty, temporal, rates); break;
+        case SW_SHADING_COLOR_TEXTURE: cpu_rasterize_models<true,  false, true >(ctx, models, framebuffer, zbuffer, Model, stats, dirty, temporal, rates); break;
+        default:                       cpu_rasterize_models<true,  true,  true >(ctx, models, framebuffer, zbuffer, Model, stats, dirty, temporal, rates); break;
+    }
+}
+
+// Marks the tiles a model can cover
+static void mark_dirty(const RenderContext& ctx, DirtyTiles& dirty, const Model& model, const mat<4,4>& MVP) {
+    double minx, miny, maxx, maxy;
+    if (!model.animation() && project_sphere(ctx, model.center(), model.radius(), MVP, minx, miny, maxx, maxy))
+        dirty.add(std::floor(minx), std::floor(miny), std::ceil(maxx), std::ceil(maxy));
+    else
+        dirty.add(0, 0, dirty.width-1, dirty.height-1);
+}
+
+// Renders the whole frame in the renderer's mode, or with dirty tiles only those (the rest of the
+// framebuffer and z-buffer still hold the previous frame), and returns its time in milliseconds.
+// Whole Phong frames go through the temporal cache when one is given, and Phong frames update the
+// shading rates when given. If approximate is set, the temporal cache reuses the previous frame's
+// colours and whole frames are shaded at the rates. Phong frames are darkened by their ambient
+// occlusion when given, after the cache and the rates took the unoccluded colours.
+static double render_frame(SwRenderer& renderer, const RenderContext& ctx, TGAImage& framebuffer, std::vector<double>& zbuffer,
+                           const DirtyTiles* dirty = nullptr, TemporalCache* temporal = nullptr, ShadingRates* rates = nullptr,
+                           const bool approximate = false, AmbientOcclusion* occlusion = nullptr) {
+    PROFILE_SCOPE(STAGE_FRAME);
+    // Start timing
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    const int width = framebuffer.width();
+    const int height = framebuffer.height();
+    const std::vector<class Model>& models = renderer.models;
+    const mat<4,4> Model = model_rotation(renderer.angle_x, renderer.angle_y);
+
+    // -- Clear CPU framebuffer and z-buffer
+    {
+        PROFILE_SCOPE(STAGE_CLEAR);
+        auto clear = [&](const int y, const int x0, const int x1) {
+            std::fill(zbuffer.begin() + y*width + x0, zbuffer.begin() + y*width + x1, -std::numeric_limits<double>::max());
+            for (int x=x0; x<x1; ++x) framebuffer.set(x,y,renderer.background);
+        };
+        scheduler.parallel_for(0, height, 32, [&](const int first, const int last) {
+            for (int y=first; y<last; ++y) {
+                if (!dirty) {
+                    clear(y, 0, width);
+                    continue;
+                }
+                for (int tx=0; tx<dirty->tiles_x; tx++)
+                    if (dirty->tiles[tx + (y/TileBins::tile_size)*dirty->tiles_x])
+                        clear(y, tx*TileBins::tile_size, std::min((tx+1)*TileBins::tile_size, width));
+            }
+        });
+    }
+
+    // -- CPU rasterization of all loaded models
+    if (temporal && (dirty || renderer.mode != SW_MODE_PHONG)) {
+        temporal->invalidate();
+        temporal = nullptr;
+    }
+    if (rates && renderer.mode != SW_MODE_PHONG) {
+        rates->invalidate();
+        rates = nullptr;
+    }
+    if (renderer.mode == SW_MODE_PHONG) {
+        if (temporal) temporal->begin_frame(ctx, Model, width, height, approximate);
+        const bool coarse = rates && approximate && !dirty && rates->fits(width, height);
+        cpu_rasterize_shading_mode(renderer.shading, ctx, models, framebuffer, zbuffer, Model, NoFragmentStats{}, dirty, temporal, coarse ? rates : nullptr);
+        if (temporal) temporal->end_frame(framebuffer, zbuffer);
+        if (rates) rates->update(framebuffer, zbuffer, coarse);
+        if (occlusion) occlusion->apply(ctx, zbuffer, framebuffer, dirty);
+    } else if (renderer.mode == SW_MODE_HEATMAP) {
+        // same pipeline as Phong lighting, with per-pixel statistics recorded
+        renderer.heatmap.reset(width, height);
+        cpu_rasterize_shading_mode(renderer.shading, ctx, models, framebuffer, zbuffer, Model, renderer.heatmap.stats(), dirty);
+    } else {
+        cpu_rasterize_colored_triangles(ctx, models, framebuffer, zbuffer, Model, dirty);
+    }
+
+    // End timing
+    auto end_time = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
+#ifdef SW_PROFILE
+    PROFILE_COUNT(COUNTER_PIXELS_COVERED, std::count_if(zbuffer.begin(), zbuffer.end(), [](double z) { return z > -std::numeric_limits<double>::max(); }));
+#endif
+
+    if (renderer.mode == SW_MODE_HEATMAP)
+        renderer.heatmap_scale = renderer.heatmap.render(HeatmapView(renderer.heatmap_view), framebuffer);
+    return duration.count() / 1000.0;
+}
+
+// On its own thread a call only allocated from this thread's arena, on the scheduler's the arenas
+// belong to the frames of the host, which rewinds them all
+static void end_call() {
+    if (!scheduler.on_scheduler_thread()) frame_arena().reset();
+}
+
+static SwHit to_hit(const RayHit& hit) {
+    return {hit.model, hit.face, {hit.bary.x, hit.bary.y, hit.bary.z}, {hit.uv.x, hit.uv.y}, hit.t};
+}
+
+void sw_renderer_start_threads(const int nthreads, const int pin) {
+    scheduler.start(std::max(0, nthreads), pin);
+}
+
+void sw_renderer_stop_threads() {
+    scheduler.stop();
+}
+
+void sw_renderer_end_frame() {
+    const std::size_t frame_bytes = frame_arena_reset(); // everything allocated from the frame arenas is dead now
+    PROFILE_COUNT(COUNTER_FRAME_ARENA_BYTES, frame_bytes);
+    profiler_end_frame();
+}
+
+int sw_renderer_open_profile(const char* trace_filename, const char* csv_filename) {
+    return profiler_open(trace_filename ? trace_filename : "", csv_filename ? csv_filename : "");
+}
+
+void sw_renderer_close_profile() {
+    profiler_close();
+}
+
+SwRenderer* sw_renderer_create(const int width, const int height) {
+    if (width <= 0 || height <= 0) {
+        std::cerr << "Invalid renderer size " << width << "x" << height << std::endl;
+        return nullptr;
+    }
+    SwRenderer* renderer = new SwRenderer(width, height);
+    renderer->ctx.lookat({-1, 0, 2}, {0, 0, 0}, {0, 1, 0});
+    renderer->ctx.perspective_fov(60.0);
+    frame_viewport(renderer->ctx, width, height);
+    renderer->ctx.lighting = &renderer->lighting;
+    renderer->framebuffer = TGAImage(width, height, TGAImage::RGB);
+    renderer->zbuffer.assign(size_t(width)*height, -std::numeric_limits<double>::max());
+    return renderer;
+}
+
+void sw_renderer_destroy(SwRenderer* renderer) {
+    if (!renderer) return;
+    sw_renderer_finish_writes(renderer);
+    renderer->stream.close();
+    delete renderer;
+}
+
+void sw_renderer_set_load_options(SwRenderer* renderer, const int lod_levels, const int compress_textures, const int quantize_meshes) {
+    renderer->lod_levels = std::max(0, lod_levels);
+    renderer->compress_textures = compress_textures;
+    renderer->quantize_meshes = quantize_meshes;
+}
+
+int sw_renderer_load_model(SwRenderer* renderer, const char* obj, const char* normal_map, const char* color_texture) {
+    const auto mesh = renderer->loader.load_mesh(obj, renderer->lod_levels, renderer->quantize_meshes).get();
+    if (!mesh) return -1;
+    Model model = *mesh;
+    if (normal_map) {
+        const auto texture = renderer->loader.load_texture(normal_map, renderer->compress_textures ? TEXTURE_BC5 : TEXTURE_UNCOMPRESSED).get();
+        if (!texture) return -1;
+        model.set_normal_map(texture);
+    }
+    if (color_texture) {
+        const auto texture = renderer->loader.load_texture(color_texture, renderer->compress_textures ? TEXTURE_BC1 : TEXTURE_UNCOMPRESSED).get();
+        if (!texture) return -1;
+        model.set_color_texture(texture);
+    }
+    renderer->models.push_back(std::move(model));
+    renderer->changed_models.push_back(renderer->models.size() - 1);
+    return renderer->models.size() - 1;
+}
+
+void sw_renderer_request_model(SwRenderer* renderer, const char* obj, const char* normal_map, const char* color_texture, const char* animation) {
+    PendingModel p;
+    p.mesh = renderer->loader.load_mesh(obj, renderer->lod_levels, renderer->quantize_meshes);
+    if (normal_map) p.normal_map = renderer->loader.load_texture(normal_map, renderer->compress_textures ? TEXTURE_BC5 : TEXTURE_UNCOMPRESSED);
+    if (color_texture) p.color_texture = renderer->loader.load_texture(color_texture, renderer->compress_textures ? TEXTURE_BC1 : TEXTURE_UNCOMPRESSED);
+    if (animation) p.animation = renderer->loader.load_animation(animation);
+    renderer->pending.push_back(p);
+}
+
+int sw_renderer_poll_models(SwRenderer* renderer) {
+    std::vector<PendingModel>& pending = renderer->pending;
+    std::vector<Model>& models = renderer->models;
+    std::vector<int>& changed = renderer->changed_models;
+    for (PendingModel& p : pending) {
+        if (p.index<0 && is_ready(p.mesh)) {
+            if (const auto mesh = p.mesh.get()) {
+                p.index = models.size();
+                models.push_back(*mesh);
+                changed.push_back(p.index);
+            } else {
+                p.normal_map = {};
+                p.color_texture = {};
+                p.animation = {};
+            }
+            p.mesh = {};
+        }
+        if (p.index<0) continue;
+        if (is_ready(p.normal_map)) {
+            if (const auto map = p.normal_map.get()) {
+                models[p.index].set_normal_map(map);
+                changed.push_back(p.index);
+            }
+            p.normal_map = {};
+        }
+        if (is_ready(p.color_texture)) {
+            if (const auto texture = p.color_texture.get()) {
+                models[p.index].set_color_texture(texture);
+                changed.push_back(p.index);
+            }
+            p.color_texture = {};
+        }
+        if (is_ready(p.animation)) {
+            const auto animation = p.animation.get();
+            if (animation && animation->nverts() != models[p.index].nverts()) {
+                std::cerr << "Animation of " << animation->nverts() << " vertices does not fit a mesh of " << models[p.index].nverts() << std::endl;
+            } else if (animation) {
+                models[p.index].set_animation(animation);
+                changed.push_back(p.index);
+            }
+            p.animation = {};
+        }
+    }
+    pending.erase(std::remove_if(pending.begin(), pending.end(), [](const PendingModel& p) {
+        return !p.mesh.valid() && !p.normal_map.valid() && !p.color_texture.valid() && !p.animation.valid();
+    }), pending.end());
+    return pending.size();
+}
+
+int sw_renderer_model_count(const SwRenderer* renderer) {
+    return renderer->models.size();
+}
+
+void sw_renderer_set_camera(SwRenderer* renderer, const double eye[3], const double center[3], const double up[3], const double fov_degrees) {
+    renderer->ctx.lookat({eye[0], eye[1], eye[2]}, {center[0], center[1], center[2]}, {up[0], up[1], up[2]});
+    renderer->ctx.perspective_fov(fov_degrees);
+    renderer->lighting.view_position = {eye[0], eye[1], eye[2]};
+    renderer->rendered = false; // the caches hold another view
+}
+
+void sw_renderer_set_rotation(SwRenderer* renderer, const double angle_x, const double angle_y) {
+    renderer->angle_x = angle_x;
+    renderer->angle_y = angle_y;
+}
+
+void sw_renderer_set_time(SwRenderer* renderer, const double seconds) {
+    renderer->ctx.time = seconds;
+}
+
+void sw_renderer_advance_time(SwRenderer* renderer, const double seconds) {
+    if (std::any_of(renderer->models.begin(), renderer->models.end(), [](const Model& m) { return m.animation(); })) renderer->ctx.time += seconds;
+}
+
+void sw_renderer_set_background(SwRenderer* renderer, const unsigned char r, const unsigned char g, const unsigned char b) {
+    renderer->background = {{b, g, r, 255}, 4};
+    renderer->rendered = false;
+}
+
+void sw_renderer_clear_lights(SwRenderer* renderer) {
+    renderer->lighting.lights.clear();
+    renderer->rendered = false;
+}
+
+void sw_renderer_add_point_light(SwRenderer* renderer, const double position[3], const double color[3], const double range) {
+    const vec3 c = {color[0], color[1], color[2]};
+    renderer->lighting.lights.push_back({{position[0], position[1], position[2]}, {0, 0, 0}, c, c, POINT_LIGHT, std::max(0., range)});
+    renderer->rendered = false;
+}
+
+void sw_renderer_add_directional_light(SwRenderer* renderer, const double direction[3], const double color[3]) {
+    const vec3 c = {color[0], color[1], color[2]};
+    renderer->lighting.lights.push_back({{direction[0], direction[1], direction[2]}, {0, 0, 0}, c, c, DIRECTIONAL_LIGHT});
+    renderer->rendered = false;
+}
+
+void sw_renderer_add_light_ring(SwRenderer* renderer, const int count) {
+    constexpr double Pi = 3.14159265358979323846;
+    for (int i=0; i<count; i++) {
+        const double a = 2*Pi*i/count;
+        TGAColor c = hsv_to_rgb(i * 0.618033988749895 * 360.0);
+        vec3 color = {c[0]/255., c[1]/255., c[2]/255.};
+        renderer->lighting.lights.push_back({{1.2*std::cos(a), 0.9*std::sin(3*a), 1.2*std::sin(a)}, {0, 0, 0}, color*0.8, color, POINT_LIGHT, 1.0});
+    }
+    renderer->rendered = false;
+}
+
+void sw_renderer_set_mode(SwRenderer* renderer, const SwMode mode) {
+    renderer->mode = mode;
+}
+
+void sw_renderer_set_shading(SwRenderer* renderer, const SwShading shading) {
+    renderer->shading = shading;
+}
+
+void sw_renderer_set_heatmap_view(SwRenderer* renderer, const SwHeatmapView view) {
+    renderer->heatmap_view = view;
+}
+
+const char* sw_renderer_heatmap_view_name(const SwHeatmapView view) {
+    return heatmap_view_name(HeatmapView(view));
+}
+
+double sw_renderer_heatmap_scale(const SwRenderer* renderer) {
+    return renderer->heatmap_scale;
+}
+
+void sw_renderer_set_lod_area(SwRenderer* renderer, const double pixels) {
+    renderer->ctx.lod_triangle_area = pixels;
+    renderer->rendered = false;
+}
+
+void sw_renderer_set_ssao(SwRenderer* renderer, const int enabled, const int half_resolution, const double radius) {
+    renderer->ssao = enabled;
+    renderer->occlusion.half_resolution = half_resolution;
+    renderer->occlusion.radius = std::max(1e-3, radius);
+    renderer->rendered = false;
+}
+
+void sw_renderer_set_temporal_reuse(SwRenderer* renderer, const int enabled) {
+    renderer->temporal_reuse = enabled;
+    renderer->temporal.invalidate();
+}
+
+void sw_renderer_set_shading_rate(SwRenderer* renderer, const double threshold) {
+    renderer->shading_rates.threshold = std::max(0., threshold);
+    renderer->shading_rates.invalidate();
+}
+
+void sw_renderer_set_frame_budget(SwRenderer* renderer, const double milliseconds) {
+    renderer->resolution = DynamicResolution(renderer->width, renderer->height, std::max(0., milliseconds));
+}
+
+int sw_renderer_render(SwRenderer* renderer) {
+    if (renderer->models.empty()) {
+        std::cerr << "Nothing to render, no model loaded" << std::endl;
+        return 0;
+    }
+    renderer->rendered = false; // a whole exact frame
+    sw_renderer_update(renderer);
+    return 1;
+}
+
+int sw_renderer_update(SwRenderer* renderer) {
+    SwRenderer& r = *renderer;
+    // Render only what changed: everything after a view change, the tiles of the streamed-in
+    // models after a scene change (the heatmap needs whole frames), nothing otherwise. A view
+    // that stopped moving after scaled frames is rendered once more at full size.
+    const ViewState view = {r.angle_x, r.angle_y, r.ctx.time, r.mode, r.shading, r.heatmap_view};
+    const bool moving = r.rendered && !(view == r.last_view);
+    const int render_width = moving ? r.resolution.width() : r.width, render_height = moving ? r.resolution.height() : r.height;
+    if (!r.changed_models.empty() || view.mode != r.last_view.mode || view.shading != r.last_view.shading) {
+        r.temporal.invalidate();
+        r.shading_rates.invalidate();
+    }
+    TemporalCache* cache = r.temporal_reuse ? &r.temporal : nullptr;
+    ShadingRates* rates = r.shading_rates.threshold > 0 && !r.temporal_reuse ? &r.shading_rates : nullptr;
+    AmbientOcclusion* occlusion = r.ssao ? &r.occlusion : nullptr;
+    bool changed = true;
+    if (!r.rendered || moving || render_width != r.rendered_width || !r.rendered_exact || (r.mode == SW_MODE_HEATMAP && !r.changed_models.empty())) {
+        if (render_width == r.width && render_height == r.height) {
+            r.render_time_ms = render_frame(r, r.ctx, r.framebuffer, r.zbuffer, nullptr, cache, rates, moving, occlusion);
+        } else {
+            RenderContext scaled_ctx = r.ctx;
+            frame_viewport(scaled_ctx, render_width, render_height);
+            if (r.scaled_framebuffer.width() != render_width || r.scaled_framebuffer.height() != render_height) {
+                r.scaled_framebuffer = TGAImage(render_width, render_height, TGAImage::RGB);
+                r.scaled_zbuffer.assign(render_width*render_height, -std::numeric_limits<double>::max());
+            }
+            r.render_time_ms = render_frame(r, scaled_ctx, r.scaled_framebuffer, r.scaled_zbuffer, nullptr, cache, rates, moving, occlusion);
+            upscale_bilinear(r.scaled_framebuffer, r.framebuffer);
+        }
+        if (moving) r.resolution.frame_rendered(r.render_time_ms);
+        r.render_scale = double(render_width)/r.width;
+        r.rendered = true;
+        r.rendered_width = render_width;
+        r.rendered_exact = !((cache || rates) && moving);
+        r.last_view = view;
+    } else if (!r.changed_models.empty()) {
+        const mat<4,4> MVP = r.ctx.MVP(model_rotation(r.angle_x, r.angle_y));
+        r.dirty.reset(r.width, r.height);
+        for (const int i : r.changed_models) mark_dirty(r.ctx, r.dirty, r.models[i], MVP);
+        r.render_time_ms = render_frame(r, r.ctx, r.framebuffer, r.zbuffer, &r.dirty, cache, rates, false, occlusion);
+        r.render_scale = 1;
+    } else {
+        r.render_scale = 1;
+        changed = false;
+    }
+    r.changed_models.clear();
+    end_call();
+    return changed;
+}
+
+double sw_renderer_render_time(const SwRenderer* renderer) {
+    return renderer->render_time_ms;
+}
+
+double sw_renderer_render_scale(const SwRenderer* renderer) {
+    return renderer->render_scale;
+}
+
+int sw_renderer_pick(SwRenderer* renderer, const int x, const int y, SwHit* hit) {
+    RayHit ray_hit;
+    pick(renderer->ctx, renderer->models, model_rotation(renderer->angle_x, renderer->angle_y), x, renderer->height-1-y, ray_hit);
+    *hit = to_hit(ray_hit);
+    end_call();
+    return 1;
+}
+
+int sw_renderer_read_pixels(const SwRenderer* renderer, unsigned char* rgba, const size_t size) {
+    if (size < size_t(renderer->width)*renderer->height*4) {
+        std::cerr << "Pixel buffer of " << size << " bytes too small for " << renderer->width << "x" << renderer->height << " RGBA" << std::endl;
+        return 0;
+    }
+    PROFILE_SCOPE(STAGE_CONVERT);
+    const int width = renderer->width, height = renderer->height;
+    const std::uint8_t* bgr = renderer->framebuffer.buffer();
+    scheduler.parallel_for(0, height, 32, [&](const int first, const int last) {
+        for (int y=first; y<last; y++) {
+            const std::uint8_t* src = bgr + size_t(height-1-y)*width*3;
+            unsigned char* dst = rgba + size_t(y)*width*4;
+            for (int x=0; x<width; x++, src+=3, dst+=4) {
+                dst[0] = src[2];
+                dst[1] = src[1];
+                dst[2] = src[0];
+                dst[3] = 255;
+            }
+        }
+    });
+    return 1;
+}
+
+int sw_renderer_width(const SwRenderer* renderer) {
+    return renderer->width;
+}
+
+int sw_renderer_height(const SwRenderer* renderer) {
+    return renderer->height;
+}
+
+int sw_renderer_set_image_format(SwRenderer* renderer, const char* name) {
+    ImageFormat format;
+    if (!parse_image_format(name, format)) {
+        std::cerr << "Unknown image format " << name << ", writing " << image_format_extension(renderer->image_format)+1 << std::endl;
+        return 0;
+    }
+    if (format == renderer->image_format) return 1;
+    if (renderer->writer) renderer->write_failed |= !renderer->writer->finish();
+    renderer->writer.reset();
+    renderer->image_format = format;
+    return 1;
+}
+
+const char* sw_renderer_image_extension(const SwRenderer* renderer) {
+    return image_format_extension(renderer->image_format);
+}
+
+void sw_renderer_write_image(SwRenderer* renderer, const char* filename) {
+    if (!renderer->writer) renderer->writer = std::make_unique<ImageWriter>(renderer->image_format);
+    renderer->writer->write(TGAImage(renderer->framebuffer), filename); // encoded while the next frames render
+}
+
+int sw_renderer_finish_writes(SwRenderer* renderer) {
+    const bool ok = !renderer->write_failed && (!renderer->writer || renderer->writer->finish());
+    renderer->write_failed = false;
+    return ok;
+}
+
+int sw_renderer_open_stream(SwRenderer* renderer, const char* path, const int width, const int height, const char* format, const int max_queued) {
+    StreamFormat stream_format = STREAM_RGB24;
+    if (format && !parse_stream_format(format, stream_format)) std::cerr << "Unknown stream format " << format << ", streaming rgb24" << std::endl;
+    return renderer->stream.open(path, width, height, stream_format, std::max(1, max_queued));
+}
+
+int sw_renderer_stream_frame(SwRenderer* renderer) {
+    if (!renderer->stream.is_open()) {
+        std::cerr << "No stream open" << std::endl;
+        return 0;
+    }
+    if (renderer->stream.push(renderer->framebuffer)) return 1;
+    renderer->stream.close();
+    return 0;
+}
+
+// Turntable views need models and a positive count and size
+static bool check_turntable(const SwRenderer* renderer, const int nviews, const int size) {
+    if (nviews <= 0 || size <= 0) {
+        std::cerr << "Invalid turntable of " << nviews << " views of " << size << "x" << size << std::endl;
+        return false;
+    }
+    if (renderer->models.empty()) {
+        std::cerr << "Nothing to render, no model loaded" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// A batch is a profiler frame of its own on the host, elsewhere it only rewinds this thread's arena
+static void end_batch_frame() {
+    if (scheduler.on_scheduler_thread()) sw_renderer_end_frame();
+    else end_call();
+}
+
+int sw_renderer_turntable(SwRenderer* renderer, const int nviews, const int size, const int atlas, const double frame_rate) {
+    if (!check_turntable(renderer, nviews, size)) return 0;
+    constexpr double Pi = 3.14159265358979323846;
+    RenderContext ctx = renderer->ctx;
+    frame_viewport(ctx, size, size);
+    const std::vector<Model>& models = renderer->models;
+    const AmbientOcclusion* occlusion = renderer->ssao ? &renderer->occlusion : nullptr;
+    const ImageFormat format = renderer->image_format;
+    const int columns = std::ceil(std::sqrt(double(nviews)));
+    const int rows = (nviews + columns - 1) / columns;
+    TGAImage sheet(atlas ? columns*size : 0, atlas ? rows*size : 0, TGAImage::RGB);
+    ImageWriter writer(format);
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+    render_batch(nviews, size, size, renderer->background,
+        [&](const int i, TGAImage& framebuffer, std::vector<double>& zbuffer) {
+            RenderContext view = ctx;
+            view.time = i / frame_rate;
+            cpu_rasterize_models<true, true, true>(view, models, framebuffer, zbuffer, model_rotation(0, 2*Pi*i/nviews));
+            if (occlusion) AmbientOcclusion(*occlusion).apply(view, zbuffer, framebuffer); // every view gets its own copy of the settings
+        },
+        [&](const int i, const TGAImage& framebuffer) {
+            if (atlas) { // the views write disjoint cells of the sheet, rows count from the bottom in a TGA
+                const int x0 = (i % columns) * size, y0 = (rows - 1 - i / columns) * size;
+                for (int y=0; y<size; y++) for (int x=0; x<size; x++) sheet.set(x0+x, y0+y, framebuffer.get(x, y));
+                return;
+            }
+            char filename[64];
+            snprintf(filename, sizeof(filename), "turntable_%03d%s", i, image_format_extension(format));
+            writer.write(TGAImage(framebuffer), filename);
+        });
+    end_batch_frame(); // the whole batch is one frame
+    if (atlas) writer.write(std::move(sheet), std::string("turntable") + image_format_extension(format));
+    const bool ok = writer.finish();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start_time);
+    std::cout << "Rendered " << nviews << " views of " << size << "x" << size << " in " << duration.count() << " ms to "
+              << (atlas ? "turntable" : "turntable_NNN") << image_format_extension(format) << std::endl;
+    return ok;
+}
+
+int sw_renderer_stream_turntable(SwRenderer* renderer, const int nviews, const int size, const double frame_rate) {
+    if (!check_turntable(renderer, nviews, size)) return 0;
+    if (!renderer->stream.is_open()) {
+        std::cerr << "No stream open" << std::endl;
+        return 0;
+    }
+    // The views are rendered one after the other, each one still spread over the threads, so
+    // that the frames come out in order
+    constexpr double Pi = 3.14159265358979323846;
+    RenderContext ctx = renderer->ctx;
+    frame_viewport(ctx, size, size);
+    AmbientOcclusion* occlusion = renderer->ssao ? &renderer->occlusion : nullptr;
+    bool ok = true;
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+    for (int i=0; i<nviews && ok; i++) {
+        ctx.time = i / frame_rate;
+        render_batch(1, size, size, renderer->background,
+            [&](const int, TGAImage& framebuffer, std::vector<double>& zbuffer) {
+                cpu_rasterize_models<true, true, true>(ctx, renderer->models, framebuffer, zbuffer, model_rotation(0, 2*Pi*i/nviews));
+                if (occlusion) occlusion->apply(ctx, zbuffer, framebuffer);
+            },
+            [&](const int, const TGAImage& framebuffer) { ok = renderer->stream.push(framebuffer); });
+        end_batch_frame();
+    }
+    renderer->stream.close();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start_time);
+    std::cout << "Rendered " << nviews << " views of " << size << "x" << size << " in " << duration.count() << " ms" << std::endl;
+    return ok;
+}
+
+int sw_renderer_pick_turntable(SwRenderer* renderer, const int nviews, const int size, const double frame_rate, const int x, const int y, SwHit* hits) {
+    if (!hits) {
+        std::cerr << "No hits array to pick into" << std::endl;
+        return 0;
+    }
+    if (!check_turntable(renderer, nviews, size)) return 0;
+    constexpr double Pi = 3.14159265358979323846;
+    RenderContext ctx = renderer->ctx;
+    frame_viewport(ctx, size, size);
+    for (int i=0; i<nviews; i++) {
+        ctx.time = i / frame_rate;
+        RayHit hit;
+        pick(ctx, renderer->models, model_rotation(0, 2*Pi*i/nviews), x, size-1-y, hit);
+        hits[i] = to_hit(hit);
+        end_call();
+    }
+    return 1;
+}
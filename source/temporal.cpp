@@ -0,0 +1,44 @@
+#include <algorithm>
+#include <cstring>
+#include "temporal.h"
+#include "profiler.h"
+#include "scheduler.h"
+
+void TemporalCache::begin_frame(const RenderContext& ctx, const mat<4,4>& Model, const int w, const int h, const bool reuse) {
+    screen = affine_product(ctx.Viewport, ctx.MVP(Model));
+    reusing = reuse && valid && w == width && h == height;
+    if (reusing) reprojection = last_screen * screen.invert();
+    width = w;
+    height = h;
+    ids.resize(size_t(w)*h);
+    age.resize(size_t(w)*h);
+    scheduler.parallel_for(0, h, 32, [&](const int first, const int last) {
+        std::fill(ids.begin() + size_t(first)*w, ids.begin() + size_t(last)*w, 0);
+    });
+}
+
+void TemporalCache::end_frame(const TGAImage& framebuffer, const std::vector<double>& zbuffer) {
+#ifdef SW_PROFILE
+    std::uint64_t reused = 0;
+    for (size_t i=0; i<ids.size(); i++) reused += ids[i] && (age[i] & 0x80);
+    PROFILE_COUNT(COUNTER_PIXELS_REUSED, reused);
+#endif
+    const std::uint8_t* pixels = framebuffer.buffer();
+    const int bpp = framebuffer.bytespp();
+    last_color.resize(size_t(width)*height*3);
+    last_depth.resize(size_t(width)*height);
+    scheduler.parallel_for(0, height, 32, [&](const int first, const int last) {
+        const size_t begin = size_t(first)*width, end = size_t(last)*width;
+        if (bpp == 3) {
+            std::memcpy(last_color.data() + begin*3, pixels + begin*3, (end - begin)*3);
+        } else {
+            for (size_t i=begin; i<end; i++)
+                for (int k : {0,1,2}) last_color[i*3 + k] = pixels[i*bpp + k];
+        }
+        std::copy(zbuffer.begin() + begin, zbuffer.begin() + end, last_depth.begin() + begin); // float is plenty for the tolerance
+    });
+    ids.swap(last_ids);
+    age.swap(last_age);
+    last_screen = screen;
+    valid = true;
+}
@@ -0,0 +1,184 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include "texture.h"
+
+// 565 packing of a texel in TGA byte order (blue, green, red)
+static std::uint16_t pack565(const double b, const double g, const double r) {
+    const int r5 = std::lround(std::clamp(r, 0., 255.)*31/255);
+    const int g6 = std::lround(std::clamp(g, 0., 255.)*63/255);
+    const int b5 = std::lround(std::clamp(b, 0., 255.)*31/255);
+    return r5<<11 | g6<<5 | b5;
+}
+
+static void unpack565(const std::uint16_t c, int bgr[3]) {
+    const int r5 = c>>11, g6 = (c>>5) & 63, b5 = c & 31;
+    bgr[0] = (b5<<3) | (b5>>2);
+    bgr[1] = (g6<<2) | (g6>>4);
+    bgr[2] = (r5<<3) | (r5>>2);
+}
+
+static void bc1_palette(const std::uint16_t c0, const std::uint16_t c1, int palette[4][3]) {
+    unpack565(c0, palette[0]);
+    unpack565(c1, palette[1]);
+    for (int k : {0,1,2}) {
+        if (c0 > c1) {
+            palette[2][k] = (2*palette[0][k] + palette[1][k])/3;
+            palette[3][k] = (palette[0][k] + 2*palette[1][k])/3;
+        } else { // 3-colour mode, not produced by the encoder
+            palette[2][k] = (palette[0][k] + palette[1][k])/2;
+            palette[3][k] = 0;
+        }
+    }
+}
+
+// Endpoints are the extremes of the texels along their principal axis
+static std::uint64_t encode_bc1(const std::uint8_t texels[16][4]) {
+    double mean[3] = {0, 0, 0};
+    for (int i=0; i<16; i++) for (int k : {0,1,2}) mean[k] += texels[i][k]/16.;
+    double cov[3][3] = {};
+    for (int i=0; i<16; i++)
+        for (int a : {0,1,2}) for (int b : {0,1,2})
+            cov[a][b] += (texels[i][a]-mean[a])*(texels[i][b]-mean[b]);
+    double axis[3] = {1, 1, 1};
+    for (int iter=0; iter<8; iter++) { // power iteration
+        double next[3] = {0, 0, 0}, len = 0;
+        for (int a : {0,1,2}) for (int b : {0,1,2}) next[a] += cov[a][b]*axis[b];
+        for (int a : {0,1,2}) len = std::max(len, std::abs(next[a]));
+        if (len < 1e-9) break;
+        for (int a : {0,1,2}) axis[a] = next[a]/len;
+    }
+    int lo = 0, hi = 0;
+    double dlo = 1e30, dhi = -1e30;
+    for (int i=0; i<16; i++) {
+        const double d = (texels[i][0]-mean[0])*axis[0] + (texels[i][1]-mean[1])*axis[1] + (texels[i][2]-mean[2])*axis[2];
+        if (d < dlo) { dlo = d; lo = i; }
+        if (d > dhi) { dhi = d; hi = i; }
+    }
+    std::uint16_t c0 = pack565(texels[hi][0], texels[hi][1], texels[hi][2]);
+    std::uint16_t c1 = pack565(texels[lo][0], texels[lo][1], texels[lo][2]);
+    if (c0 < c1) std::swap(c0, c1);
+    std::uint64_t word = c0 | std::uint64_t(c1)<<16;
+    if (c0 == c1) return word; // flat block, all indices 0
+    int palette[4][3];
+    bc1_palette(c0, c1, palette);
+    for (int i=0; i<16; i++) {
+        int best = 0, best_dist = 1<<30;
+        for (int p=0; p<4; p++) {
+            int dist = 0;
+            for (int k : {0,1,2}) dist += (texels[i][k]-palette[p][k])*(texels[i][k]-palette[p][k]);
+            if (dist < best_dist) { best_dist = dist; best = p; }
+        }
+        word |= std::uint64_t(best) << (32 + 2*i);
+    }
+    return word;
+}
+
+static void decode_bc1(const std::uint64_t word, std::uint8_t texels[16][4]) {
+    int palette[4][3];
+    bc1_palette(word & 0xffff, (word>>16) & 0xffff, palette);
+    for (int i=0; i<16; i++) {
+        const int p = (word >> (32 + 2*i)) & 3;
+        for (int k : {0,1,2}) texels[i][k] = palette[p][k];
+        texels[i][3] = 255;
+    }
+}
+
+static void bc4_palette(const int a0, const int a1, int palette[8]) {
+    palette[0] = a0;
+    palette[1] = a1;
+    if (a0 > a1) {
+        for (int i=1; i<7; i++) palette[i+1] = ((7-i)*a0 + i*a1)/7;
+    } else { // 6-value mode with explicit 0 and 255, not produced by the encoder
+        for (int i=1; i<5; i++) palette[i+1] = ((5-i)*a0 + i*a1)/5;
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+}
+
+static std::uint64_t encode_bc4(const std::uint8_t texels[16][4], const int channel) {
+    int a0 = 0, a1 = 255;
+    for (int i=0; i<16; i++) {
+        a0 = std::max<int>(a0, texels[i][channel]);
+        a1 = std::min<int>(a1, texels[i][channel]);
+    }
+    std::uint64_t word = a0 | a1<<8;
+    if (a0 == a1) return word;
+    int palette[8];
+    bc4_palette(a0, a1, palette);
+    for (int i=0; i<16; i++) {
+        int best = 0;
+        for (int p=1; p<8; p++)
+            if (std::abs(texels[i][channel]-palette[p]) < std::abs(texels[i][channel]-palette[best])) best = p;
+        word |= std::uint64_t(best) << (16 + 3*i);
+    }
+    return word;
+}
+
+static void decode_bc4(const std::uint64_t word, std::uint8_t texels[16][4], const int channel) {
+    int palette[8];
+    bc4_palette(word & 0xff, (word>>8) & 0xff, palette);
+    for (int i=0; i<16; i++)
+        texels[i][channel] = palette[(word >> (16 + 3*i)) & 7];
+}
+
+Texture::Texture(TGAImage&& img, const TextureCompression compression) : format(compression), w(img.width()), h(img.height()) {
+    static std::atomic<std::uint32_t> next_id{0};
+    id = next_id++;
+    if (format == TEXTURE_UNCOMPRESSED) {
+        bytes = size_t(w)*h*img.get(0, 0).bytespp;
+        image = std::move(img);
+        return;
+    }
+    blocks_x = (w+3)/4;
+    const int blocks_y = (h+3)/4;
+    blocks.resize(size_t(blocks_x)*blocks_y*(format == TEXTURE_BC5 ? 2 : 1));
+    for (int by=0; by<blocks_y; by++)
+        for (int bx=0; bx<blocks_x; bx++) {
+            std::uint8_t texels[16][4];
+            for (int i=0; i<16; i++) { // edge blocks repeat the last row/column
+                const TGAColor c = img.get(std::min(bx*4 + i%4, w-1), std::min(by*4 + i/4, h-1));
+                std::memcpy(texels[i], c.bgra, 4);
+            }
+            const size_t block = size_t(by)*blocks_x + bx;
+            if (format == TEXTURE_BC1) {
+                blocks[block] = encode_bc1(texels);
+            } else {
+                blocks[block*2]   = encode_bc4(texels, 2);
+                blocks[block*2+1] = encode_bc4(texels, 1);
+            }
+        }
+    bytes = blocks.size()*sizeof(std::uint64_t);
+}
+
+// Direct mapped cache of decoded blocks, one per thread so the shading threads never share lines
+struct DecodedBlock {
+    std::uint32_t texture = ~0u;
+    int block = -1;
+    std::uint8_t texels[16][4];
+};
+static thread_local DecodedBlock block_cache[64];
+
+const std::uint8_t* Texture::decode_block(const int block) const {
+    DecodedBlock& entry = block_cache[(block ^ id*0x9e37) & 63];
+    if (entry.texture != id || entry.block != block) {
+        entry.texture = id;
+        entry.block = block;
+        if (format == TEXTURE_BC1) {
+            decode_bc1(blocks[block], entry.texels);
+        } else {
+            decode_bc4(blocks[block*2],   entry.texels, 2);
+            decode_bc4(blocks[block*2+1], entry.texels, 1);
+            for (auto& texel : entry.texels) { texel[0] = 0; texel[3] = 255; }
+        }
+    }
+    return entry.texels[0];
+}
+
+TGAColor Texture::fetch(const int x, const int y) const {
+    if (format == TEXTURE_UNCOMPRESSED) return image.get(x, y);
+    if (x<0 || y<0 || x>=w || y>=h) return {};
+    const std::uint8_t* texel = decode_block((y/4)*blocks_x + x/4) + ((y%4)*4 + x%4)*4;
+    return {{texel[0], texel[1], texel[2], texel[3]}, 4};
+}
@@ -1,168 +1,225 @@
 #include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstdio>
 #include <cstring>
 #include "tgaimage.h"
 
 TGAImage::TGAImage(const int w, const int h, const int bpp) : w(w), h(h), bpp(bpp), data(w*h*bpp, 0) {}
 
-bool TGAImage::read_tga_file(const std::string filename) {
-    std::ifstream in;
-    in.open(filename, std::ios::binary);
+// The whole file is read with a single call and decoded from memory
+static bool read_file(const std::string &filename, std::vector<std::uint8_t> &bytes) {
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
     if (!in.is_open()) {
         std::cerr << "can't open file " << filename << "\n";
         return false;
     }
-    TGAHeader header;
-    in.read(reinterpret_cast<char *>(&header), sizeof(header));
+    const std::streamoff size = in.tellg();
+    in.seekg(0);
+    if (size < 0 || in.peek() == EOF) { // a directory opens, but its size is bogus and reading it fails
+        std::cerr << "can't read file " << filename << "\n";
+        return false;
+    }
+    bytes.resize(size);
+    in.read(reinterpret_cast<char *>(bytes.data()), size);
     if (!in.good()) {
+        std::cerr << "an error occured while reading the file\n";
+        return false;
+    }
+    return true;
+}
+
+static bool parse_header(const std::vector<std::uint8_t> &bytes, TGAHeader &header, TGAInfo &info) {
+    if (bytes.size() < sizeof(header)) {
         std::cerr << "an error occured while reading the header\n";
         return false;
     }
-    w   = header.width;
-    h   = header.height;
-    bpp = header.bitsperpixel>>3;
-    if (w<=0 || h<=0 || (bpp!=GRAYSCALE && bpp!=RGB && bpp!=RGBA)) {
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    info.width  = header.width;
+    info.height = header.height;
+    info.bpp    = header.bitsperpixel>>3;
+    if (info.width<=0 || info.height<=0 || (info.bpp!=TGAImage::GRAYSCALE && info.bpp!=TGAImage::RGB && info.bpp!=TGAImage::RGBA)) {
         std::cerr << "bad bpp (or width/height) value\n";
         return false;
     }
-    size_t nbytes = bpp*w*h;
-    data = std::vector<std::uint8_t>(nbytes, 0);
-    if (3==header.datatypecode || 2==header.datatypecode) {
-        in.read(reinterpret_cast<char *>(data.data()), nbytes);
-        if (!in.good()) {
-            std::cerr << "an error occured while reading the data\n";
+    if (header.datatypecode!=2 && header.datatypecode!=3 && header.datatypecode!=10 && header.datatypecode!=11) {
+        std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
+        return false;
+    }
+    return true;
+}
+
+static void flip_rows(std::uint8_t *pixels, const int w, const int h, const int bpp) {
+    const size_t row = size_t(w)*bpp;
+    for (int j=0; j<h/2; j++)
+        std::swap_ranges(pixels+j*row, pixels+(j+1)*row, pixels+(h-1-j)*row);
+}
+
+static void flip_columns(std::uint8_t *pixels, const int w, const int h, const int bpp) {
+    for (int j=0; j<h; j++) {
+        std::uint8_t *row = pixels + size_t(j)*w*bpp;
+        for (int i=0; i<w/2; i++)
+            std::swap_ranges(row+i*bpp, row+(i+1)*bpp, row+(w-1-i)*bpp);
+    }
+}
+
+// RLE packets are expanded in bulk: raw packets with one copy, runs by doubling the copied span
+static bool decode_rle(const std::uint8_t *src, const std::uint8_t *end, std::uint8_t *dst, const size_t nbytes, const int bpp) {
+    std::uint8_t *const dst_end = dst + nbytes;
+    while (dst < dst_end) {
+        if (src >= end) return false;
+        const std::uint8_t chunkheader = *src++;
+        const size_t length = size_t((chunkheader & 0x7f) + 1)*bpp;
+        if (length > size_t(dst_end-dst)) {
+            std::cerr << "Too many pixels read\n";
             return false;
         }
-    } else if (10==header.datatypecode||11==header.datatypecode) {
-        if (!load_rle_data(in)) {
+        if (chunkheader < 128) {
+            if (length > size_t(end-src)) return false;
+            std::memcpy(dst, src, length);
+            src += length;
+        } else {
+            if (bpp > end-src) return false;
+            std::memcpy(dst, src, bpp);
+            src += bpp;
+            for (size_t done=bpp; done<length; done*=2)
+                std::memcpy(dst+done, dst, std::min(done, length-done));
+        }
+        dst += length;
+    }
+    return true;
+}
+
+static bool decode(const std::vector<std::uint8_t> &bytes, const TGAHeader &header, const TGAInfo &info, std::uint8_t *pixels, const bool vflip) {
+    const size_t row = size_t(info.width)*info.bpp;
+    const std::uint8_t *src = bytes.data() + sizeof(header) + header.idlength;
+    const std::uint8_t *end = bytes.data() + bytes.size();
+    const bool flip = !(header.imagedescriptor & 0x20) != vflip; // the file rows are bottom to top unless bit 5 is set
+    if (src > end) {
+        std::cerr << "an error occured while reading the data\n";
+        return false;
+    }
+    if (2==header.datatypecode || 3==header.datatypecode) {
+        if (row*info.height > size_t(end-src)) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
+        if (flip) {
+            for (int j=0; j<info.height; j++)
+                std::memcpy(pixels+(info.height-1-j)*row, src+j*row, row);
+        } else std::memcpy(pixels, src, row*info.height);
     } else {
-        std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
-        return false;
+        if (!decode_rle(src, end, pixels, row*info.height, info.bpp)) {
+            std::cerr << "an error occured while reading the data\n";
+            return false;
+        }
+        if (flip) flip_rows(pixels, info.width, info.height, info.bpp);
     }
-    if (!(header.imagedescriptor & 0x20))
-        flip_vertically();
     if (header.imagedescriptor & 0x10)
-        flip_horizontally();
+        flip_columns(pixels, info.width, info.height, info.bpp);
+    return true;
+}
+
+bool TGAImage::read_tga_file(const std::string filename, const bool vflip) {
+    std::vector<std::uint8_t> bytes;
+    TGAHeader header;
+    TGAInfo info;
+    if (!read_file(filename, bytes) || !parse_header(bytes, header, info)) return false;
+    w   = info.width;
+    h   = info.height;
+    bpp = info.bpp;
+    data.resize(size_t(w)*h*bpp);
+    if (!decode(bytes, header, info, data.data(), vflip)) return false;
     std::cerr << w << "x" << h << "/" << bpp*8 << "\n";
     return true;
 }
 
-bool TGAImage::load_rle_data(std::ifstream &in) {
-    size_t pixelcount = w*h;
-    size_t currentpixel = 0;
-    size_t currentbyte  = 0;
-    TGAColor colorbuffer;
-    do {
-        std::uint8_t chunkheader = 0;
-        chunkheader = in.get();
-        if (!in.good()) {
-            std::cerr << "an error occured while reading the data\n";
-            return false;
-        }
-        if (chunkheader<128) {
-            chunkheader++;
-            for (int i=0; i<chunkheader; i++) {
-                in.read(reinterpret_cast<char *>(colorbuffer.bgra), bpp);
-                if (!in.good()) {
-                    std::cerr << "an error occured while reading the header\n";
-                    return false;
-                }
-                for (int t=0; t<bpp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
-            }
+bool TGAImage::read_tga_info(const std::string filename, TGAInfo &info) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    std::vector<std::uint8_t> bytes(sizeof(TGAHeader));
+    in.read(reinterpret_cast<char *>(bytes.data()), bytes.size());
+    if (!in.good()) {
+        std::cerr << "an error occured while reading the header\n";
+        return false;
+    }
+    TGAHeader header;
+    return parse_header(bytes, header, info);
+}
+
+bool TGAImage::read_tga_file(const std::string filename, std::uint8_t *pixels, const size_t size, TGAInfo &info, const bool vflip) {
+    std::vector<std::uint8_t> bytes;
+    TGAHeader header;
+    if (!read_file(filename, bytes) || !parse_header(bytes, header, info)) return false;
+    if (size < size_t(info.width)*info.height*info.bpp) {
+        std::cerr << "buffer too small for " << filename << "\n";
+        return false;
+    }
+    return decode(bytes, header, info, pixels, vflip);
+}
+
+// Runs of equal pixels become run packets, everything else goes to raw packets of up to 128 pixels
+template<int bpp> static void encode_rle(const std::uint8_t *pixels, const size_t npixels, std::vector<std::uint8_t> &out) {
+    auto same = [pixels](const size_t a, const size_t b) { return !std::memcmp(pixels+a*bpp, pixels+b*bpp, bpp); };
+    for (size_t cur=0; cur<npixels; ) {
+        size_t length = 1;
+        if (cur+1<npixels && same(cur, cur+1)) {
+            while (cur+length<npixels && length<128 && same(cur, cur+length)) length++;
+            out.push_back(length+127);
+            out.insert(out.end(), pixels+cur*bpp, pixels+(cur+1)*bpp);
         } else {
-            chunkheader -= 127;
-            in.read(reinterpret_cast<char *>(colorbuffer.bgra), bpp);
-            if (!in.good()) {
-                std::cerr << "an error occured while reading the header\n";
-                return false;
-            }
-            for (int i=0; i<chunkheader; i++) {
-                for (int t=0; t<bpp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
-            }
+            while (cur+length<npixels && length<128 && !(cur+length+1<npixels && same(cur+length, cur+length+1))) length++;
+            out.push_back(length-1);
+            out.insert(out.end(), pixels+cur*bpp, pixels+(cur+length)*bpp);
         }
-    } while (currentpixel < pixelcount);
-    return true;
+        cur += length;
+    }
 }
 
 bool TGAImage::write_tga_file(const std::string filename, const bool vflip, const bool rle) const {
-    constexpr std::uint8_t developer_area_ref[4] = {0, 0, 0, 0};
-    constexpr std::uint8_t extension_area_ref[4] = {0, 0, 0, 0};
-    constexpr std::uint8_t footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
-    std::ofstream out;
-    out.open(filename, std::ios::binary);
+    // The file is assembled in memory and written with a single call
+    std::vector<std::uint8_t> bytes;
+    encode_tga(bytes, vflip, rle);
+    std::ofstream out(filename, std::ios::binary);
     if (!out.is_open()) {
         std::cerr << "can't open file " << filename << "\n";
         return false;
     }
+    out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    if (!out.good()) {
+        std::cerr << "can't dump the tga file\n";
+        return false;
+    }
+    return true;
+}
+
+void TGAImage::encode_tga(std::vector<std::uint8_t> &bytes, const bool vflip, const bool rle) const {
+    constexpr std::uint8_t developer_area_ref[4] = {0, 0, 0, 0};
+    constexpr std::uint8_t extension_area_ref[4] = {0, 0, 0, 0};
+    constexpr std::uint8_t footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
     TGAHeader header = {};
     header.bitsperpixel = bpp<<3;
     header.width  = w;
     header.height = h;
     header.datatypecode = (bpp==GRAYSCALE ? (rle?11:3) : (rle?10:2));
     header.imagedescriptor = vflip ? 0x00 : 0x20; // top-left or bottom-left origin
-    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
-    if (!out.good()) goto err;
-    if (!rle) {
-        out.write(reinterpret_cast<const char *>(data.data()), w*h*bpp);
-        if (!out.good()) goto err;
-    } else if (!unload_rle_data(out)) goto err;
-    out.write(reinterpret_cast<const char *>(developer_area_ref), sizeof(developer_area_ref));
-    if (!out.good()) goto err;
-    out.write(reinterpret_cast<const char *>(extension_area_ref), sizeof(extension_area_ref));
-    if (!out.good()) goto err;
-    out.write(reinterpret_cast<const char *>(footer), sizeof(footer));
-    if (!out.good()) goto err;
-    return true;
-err:
-    std::cerr << "can't dump the tga file\n";
-    return false;
-}
-
-bool TGAImage::unload_rle_data(std::ofstream &out) const {
-    const std::uint8_t max_chunk_length = 128;
-    size_t npixels = w*h;
-    size_t curpix = 0;
-    while (curpix<npixels) {
-        size_t chunkstart = curpix*bpp;
-        size_t curbyte = curpix*bpp;
-        std::uint8_t run_length = 1;
-        bool raw = true;
-        while (curpix+run_length<npixels && run_length<max_chunk_length) {
-            bool succ_eq = true;
-            for (int t=0; succ_eq && t<bpp; t++)
-                succ_eq = (data[curbyte+t]==data[curbyte+t+bpp]);
-            curbyte += bpp;
-            if (1==run_length)
-                raw = !succ_eq;
-            if (raw && succ_eq) {
-                run_length--;
-                break;
-            }
-            if (!raw && !succ_eq)
-                break;
-            run_length++;
-        }
-        curpix += run_length;
-        out.put(raw ? run_length-1 : run_length+127);
-        if (!out.good()) return false;
-        out.write(reinterpret_cast<const char *>(data.data()+chunkstart), (raw?run_length*bpp:bpp));
-        if (!out.good()) return false;
+
+    bytes.reserve(bytes.size() + sizeof(header) + data.size() + data.size()/128 + sizeof(developer_area_ref) + sizeof(extension_area_ref) + sizeof(footer));
+    const std::uint8_t *p = reinterpret_cast<const std::uint8_t *>(&header);
+    bytes.insert(bytes.end(), p, p+sizeof(header));
+    if (!rle)
+        bytes.insert(bytes.end(), data.begin(), data.end());
+    else switch (bpp) {
+        case GRAYSCALE: encode_rle<GRAYSCALE>(data.data(), size_t(w)*h, bytes); break;
+        case RGB:       encode_rle<RGB>      (data.data(), size_t(w)*h, bytes); break;
+        case RGBA:      encode_rle<RGBA>     (data.data(), size_t(w)*h, bytes); break;
     }
-    return true;
+    bytes.insert(bytes.end(), developer_area_ref, developer_area_ref+sizeof(developer_area_ref));
+    bytes.insert(bytes.end(), extension_area_ref, extension_area_ref+sizeof(extension_area_ref));
+    bytes.insert(bytes.end(), footer, footer+sizeof(footer));
 }
 
 TGAColor TGAImage::get(const int x, const int y) const {
@@ -179,17 +236,11 @@ void TGAImage::set(int x, int y, const TGAColor &c) {
 }
 
 void TGAImage::flip_horizontally() {
-    for (int i=0; i<w/2; i++)
-        for (int j=0; j<h; j++)
-            for (int b=0; b<bpp; b++)
-                std::swap(data[(i+j*w)*bpp+b], data[(w-1-i+j*w)*bpp+b]);
+    flip_columns(data.data(), w, h, bpp);
 }
 
 void TGAImage::flip_vertically() {
-    for (int i=0; i<w; i++)
-        for (int j=0; j<h/2; j++)
-            for (int b=0; b<bpp; b++)
-                std::swap(data[(i+j*w)*bpp+b], data[(i+(h-1-j)*w)*bpp+b]);
+    flip_rows(data.data(), w, h, bpp);
 }
 
 int TGAImage::width() const {
@@ -199,3 +250,15 @@ int TGAImage::width() const {
 int TGAImage::height() const {
     return h;
 }
+
+int TGAImage::bytespp() const {
+    return bpp;
+}
+
+const std::uint8_t *TGAImage::buffer() const {
+    return data.data();
+}
+
+std::uint8_t *TGAImage::buffer() {
+    return data.data();
+}
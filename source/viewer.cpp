@@ -1,4 +1,6 @@
 #include "viewer.h"
+#include "profiler.h"
+#include "scheduler.h"
 
 #ifdef USE_RAYLIB
 #include <raylib.h>
@@ -39,6 +41,8 @@ bool viewer_key_down(ViewerKey key) {
         case ViewerKey_Down:  return IsKeyDown(KEY_DOWN);
         case ViewerKey_Space: return IsKeyDown(KEY_SPACE);
         case ViewerKey_S:     return IsKeyDown(KEY_S);
+        case ViewerKey_H:     return IsKeyDown(KEY_H);
+        case ViewerKey_E:     return IsKeyDown(KEY_E);
     }
     return false;
 #else
@@ -46,6 +50,17 @@ bool viewer_key_down(ViewerKey key) {
 #endif
 }
 
+bool viewer_mouse_clicked(int& x, int& y) {
+#ifdef USE_RAYLIB
+    if (!IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) return false;
+    x = GetMouseX();
+    y = GetMouseY();
+    return true;
+#else
+    (void)x; (void)y; return false;
+#endif
+}
+
 void viewer_present_from_tga(const TGAImage &img, std::vector<unsigned char> &rgbaScratch) {
 #ifdef USE_RAYLIB
     if (!g_initialized) return;
@@ -73,31 +88,22 @@ void viewer_present_from_tga(const TGAImage &img, std::vector<unsigned char> &rg
 #endif
 }
 
-void viewer_present_with_timing(const TGAImage &img, std::vector<unsigned char> &rgbaScratch, 
-                                double render_time_ms, double angleX, double angleY, const char* mode_name, const char* shading_name, const char* normal_mapping_status) {
+void viewer_present_with_timing(const std::vector<unsigned char> &rgba,
+                                double render_time_ms, double angleX, double angleY, const char* mode_name, const char* shading_name, const char* normal_mapping_status,
+                                double render_scale, bool image_changed) {
 #ifdef USE_RAYLIB
     if (!g_initialized) return;
-    if ((int)rgbaScratch.size() < img.width()*img.height()*4) rgbaScratch.resize(img.width()*img.height()*4);
-    for (int y = 0; y < img.height(); ++y) {
-        const int srcY = (img.height() - 1 - y);
-        for (int x = 0; x < img.width(); ++x) {
-            TGAColor c = img.get(x, srcY);
-            const int idx = (y*img.width() + x) * 4;
-            rgbaScratch[idx+0] = c[2];
-            rgbaScratch[idx+1] = c[1];
-            rgbaScratch[idx+2] = c[0];
-            rgbaScratch[idx+3] = 255;
-        }
-    }
+    PROFILE_SCOPE(STAGE_PRESENT);
     // ==== Begin draw to window ====
-    UpdateTexture(g_tex, rgbaScratch.data());
+    if (image_changed) UpdateTexture(g_tex, rgba.data());
     BeginDrawing();
     ClearBackground(BLACK);
     DrawTexture(g_tex, 0, 0, WHITE);
     
     // Display timing information on screen
     char timing_text[256];
-    snprintf(timing_text, sizeof(timing_text), "Render Time: %.2f ms", render_time_ms);
+    if (render_scale < 1) snprintf(timing_text, sizeof(timing_text), "Render Time: %.2f ms at %.0f%%", render_time_ms, render_scale*100);
+    else snprintf(timing_text, sizeof(timing_text), "Render Time: %.2f ms", render_time_ms);
     DrawText(timing_text, 10, 10, 20, GREEN);
     
     char angle_text[256];
@@ -116,10 +122,10 @@ void viewer_present_with_timing(const TGAImage &img, std::vector<unsigned char>
     snprintf(normal_text, sizeof(normal_text), "Normal Mapping: %s", normal_mapping_status);
     DrawText(normal_text, 10, 104, 18, ORANGE);
     
-    DrawText("Arrow keys: rotate | Space: mode | S: cycle shading", 10, 127, 16, RAYWHITE);
+    DrawText("Arrow keys: rotate | Space: mode | S: cycle shading | H: heatmap view | E: export heatmap | Click: pick", 10, 127, 16, RAYWHITE);
     EndDrawing();
 #else
-    (void)img; (void)rgbaScratch; (void)render_time_ms; (void)angleX; (void)angleY; (void)mode_name; (void)shading_name; (void)normal_mapping_status;
+    (void)rgba; (void)render_time_ms; (void)angleX; (void)angleY; (void)mode_name; (void)shading_name; (void)normal_mapping_status; (void)render_scale; (void)image_changed;
 #endif
 }
 